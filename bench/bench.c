@@ -0,0 +1,483 @@
+/* smallsh benchmark harness
+*   Usage: bench SMALLSH_PATH [COMMANDS] [LAUNCHES] [JOBS]
+*
+*   Measures the shell's hot paths and prints one JSON object per result on stdout, so runs can be stored and compared:
+*       parse      - parseCommandLine on lines of increasing length
+*       expand     - expandVariables on words with an increasing number of $$ pairs
+*       jobtable   - adding, looking up and removing background process records with 10 to 100000 jobs in the table
+*       glob       - expanding a wildcard over a directory of 100000 files, the first time and from the directory cache
+*       launch     - fork-to-exec latency percentiles of a single "true" for each launch engine
+*       commands   - end to end commands per second of a script of COMMANDS lines running the true program, per launch engine,
+*                    and of the same script using the built in true
+*       background - a script launching JOBS concurrent jobs running the true program
+*       parallel   - items per second of seq N | parallel -k echo {} (work items piped in), checking that every item comes out in order
+*       cache      - startup of a large control flow script with the script cache off, on its first (caching) run and from the cache
+*       submit     - latency percentiles of running "true" in a newly started shell (smallsh -c) and as a request to a command server
+*                    (smallsh -s), from submission to the exit status
+*
+*   The file includes smallsh.c directly (without its main) so the internal functions are measured exactly as the shell uses them.
+*/
+#define SMALLSH_NO_MAIN
+#include "../smallsh.c"
+
+
+/* compareLongLong - qsort comparison for latency samples
+*   Inputs: first, second - Pointers to the two samples
+*   Outputs: Negative, zero or positive like strcmp
+*/
+int compareLongLong(const void* first, const void* second) {
+    long long a = *(const long long*)first;
+    long long b = *(const long long*)second;
+    return (a > b) - (a < b);
+}
+
+/* benchParse - Time parseCommandLine on lines with a growing number of words
+*   Inputs: None
+*   Outputs: None, prints one result per line length
+*
+*   Purpose: Each line is a command with redirections, a pipe and $$ words, repeated until it reaches the target length. The arena is
+*   reset after every parse, exactly like the prompt loop does.
+*/
+void benchParse() {
+    int lengths[] = { 16, 64, 256, 1024, 4096 };
+    char* pattern = "grep -v x$$ < in.txt | sort -n > out$$.txt ";
+    struct arena benchArena = { 0 };
+    for (int i = 0; i < 5; i++) {
+        char* line = calloc(lengths[i] + 64, 1);
+        while ((int)strlen(line) < lengths[i]) {
+            strcat(line, pattern);
+        }
+        line[lengths[i]] = '\0';
+        int iterations = 4000000 / lengths[i];
+        long long start = nowNanoseconds();
+        for (int j = 0; j < iterations; j++) {
+            if (parseCommandLine(&benchArena, line) == NULL) {
+                printf("{\"bench\":\"parse\",\"error\":\"syntax error at length %d\"}\n", lengths[i]);
+                break;
+            }
+            arenaReset(&benchArena);
+        }
+        long long elapsed = nowNanoseconds() - start;
+        printf("{\"bench\":\"parse\",\"input_bytes\":%d,\"iterations\":%d,\"ns_per_op\":%.1f}\n", lengths[i], iterations, (double)elapsed / iterations);
+        free(line);
+    }
+}
+
+/* benchExpand - Time expandVariables on words with a growing number of $$ pairs
+*   Inputs: None
+*   Outputs: None, prints one result per word length
+*/
+void benchExpand() {
+    int lengths[] = { 16, 64, 256, 1024, 4096 };
+    struct arena benchArena = { 0 };
+    for (int i = 0; i < 5; i++) {
+        // Every fourth pair of characters is a $$, the rest is plain text
+        char* word = calloc(lengths[i] + 1, 1);
+        for (int j = 0; j < lengths[i]; j++) {
+            word[j] = (j % 8 < 2) ? '$' : 'a' + j % 26;
+        }
+        int iterations = 8000000 / lengths[i];
+        long long start = nowNanoseconds();
+        for (int j = 0; j < iterations; j++) {
+            expandVariables(&benchArena, word);
+            arenaReset(&benchArena);
+        }
+        long long elapsed = nowNanoseconds() - start;
+        printf("{\"bench\":\"expand\",\"input_bytes\":%d,\"iterations\":%d,\"ns_per_op\":%.1f}\n", lengths[i], iterations, (double)elapsed / iterations);
+        free(word);
+    }
+}
+
+/* benchJobTable - Time the job table with a growing number of concurrent jobs
+*   Inputs: None
+*   Outputs: None, prints the cost per job of each operation for every table size
+*
+*   Purpose: Each round fills the table with jobs (PIDs spaced like a busy system would hand them out), looks every one up and
+*   then removes them, odd positions first so most removals are from the middle of the list. No processes are started, so the
+*   numbers are the table's own cost, which should stay flat as the number of jobs grows.
+*/
+void benchJobTable() {
+    int counts[] = { 10, 100, 1000, 10000, 100000 };
+    struct backgroundProcess listHead = { 0 };
+    listHead.processID = -1;
+    for (int i = 0; i < 5; i++) {
+        int jobCount = counts[i];
+        int rounds = 1000000 / jobCount;
+        struct backgroundProcess** records = malloc(jobCount * sizeof(struct backgroundProcess*));
+        long long addTime = 0;
+        long long findTime = 0;
+        long long removeTime = 0;
+        for (int round = 0; round < rounds; round++) {
+            long long start = nowNanoseconds();
+            for (int j = 0; j < jobCount; j++) {
+                records[j] = addBackgroundProcess(&listHead, 1000 + j * 3, -1, NULL);
+            }
+            long long added = nowNanoseconds();
+            for (int j = 0; j < jobCount; j++) {
+                if (findBackgroundProcess(1000 + j * 3) != records[j]) {
+                    printf("{\"bench\":\"jobtable\",\"error\":\"lookup failed with %d jobs\"}\n", jobCount);
+                    return;
+                }
+            }
+            long long found = nowNanoseconds();
+            for (int j = 1; j < jobCount; j += 2) {
+                removeBackgroundProcess(records[j]);
+            }
+            for (int j = 0; j < jobCount; j += 2) {
+                removeBackgroundProcess(records[j]);
+            }
+            long long removed = nowNanoseconds();
+            addTime += added - start;
+            findTime += found - added;
+            removeTime += removed - found;
+        }
+        double operations = (double)rounds * jobCount;
+        printf("{\"bench\":\"jobtable\",\"jobs\":%d,\"rounds\":%d,\"add_ns\":%.1f,\"find_ns\":%.1f,\"remove_ns\":%.1f}\n",
+            jobCount, rounds, addTime / operations, findTime / operations, removeTime / operations);
+        free(records);
+    }
+}
+
+/* benchGlob - Time glob expansion over a large directory
+*   Inputs: None
+*   Outputs: None, prints the time of the first expansion (which reads the directory) and the average of the cached ones
+*
+*   Purpose: The directory's modification time is set an hour back after it is filled, so the listing is trusted right away
+*   instead of after a second. The files are removed again at the end.
+*/
+void benchGlob() {
+    int fileCount = 100000;
+    int repeats = 50;
+    char directory[] = "/tmp/smallsh-glob-XXXXXX";
+    if (mkdtemp(directory) == NULL) {
+        printf("{\"bench\":\"glob\",\"error\":\"mkdtemp failed\"}\n");
+        return;
+    }
+    int directoryFd = open(directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    char name[32];
+    for (int i = 0; i < fileCount; i++) {
+        snprintf(name, sizeof(name), "f%06d.log", i);
+        close(openat(directoryFd, name, O_WRONLY | O_CREAT | O_CLOEXEC, 0644));
+    }
+    struct timespec times[2];
+    clock_gettime(CLOCK_REALTIME, &times[0]);
+    times[0].tv_sec -= 3600;
+    times[1] = times[0];
+    futimens(directoryFd, times);
+
+    int savedDirectory = workingDirectoryFd;
+    workingDirectoryFd = directoryFd;
+    struct arena benchArena = { 0 };
+    char line[] = "ls f0999*.log";
+    struct commandLine* command = parseCommandLine(&benchArena, line);
+    long long start = nowNanoseconds();
+    char** args = expandArguments(&benchArena, command->stages);
+    long long first = nowNanoseconds() - start;
+    int matches = 0;
+    while (args[matches + 1] != NULL) {
+        matches++;
+    }
+    start = nowNanoseconds();
+    for (int i = 0; i < repeats; i++) {
+        expandArguments(&benchArena, command->stages);
+    }
+    long long cached = (nowNanoseconds() - start) / repeats;
+    printf("{\"bench\":\"glob\",\"entries\":%d,\"matches\":%d,\"first_us\":%.1f,\"cached_us\":%.1f}\n", fileCount, matches,
+        first / 1000.0, cached / 1000.0);
+    arenaReset(&benchArena);
+    workingDirectoryFd = savedDirectory;
+
+    for (int i = 0; i < fileCount; i++) {
+        snprintf(name, sizeof(name), "f%06d.log", i);
+        unlinkat(directoryFd, name, 0);
+    }
+    close(directoryFd);
+    rmdir(directory);
+}
+
+/* printPercentiles - Sort latency samples and print their percentiles
+*   Inputs: bench, mode - Names for the result, samples - The samples in nanoseconds, count - Number of samples
+*   Outputs: None
+*/
+void printPercentiles(char* bench, char* mode, long long* samples, int count) {
+    qsort(samples, count, sizeof(long long), compareLongLong);
+    printf("{\"bench\":\"%s\",\"mode\":\"%s\",\"samples\":%d,\"p50_us\":%.1f,\"p90_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f}\n",
+        bench, mode, count, samples[count / 2] / 1000.0, samples[count * 9 / 10] / 1000.0, samples[count * 99 / 100] / 1000.0,
+        samples[count - 1] / 1000.0);
+}
+
+/* benchLaunch - Measure fork-to-exec latency of each launch engine
+*   Inputs: launches - Number of samples per engine
+*   Outputs: None, prints percentiles per engine
+*
+*   Procedure:
+*   Before each launch a close on exec pipe is created. The child inherits the write end, which the kernel closes when exec succeeds,
+*   so the parent (after closing its own copy) sees end of file on the read end at exactly the moment the new program is running.
+*   The time from calling launchStage to that end of file is one sample.
+*/
+void benchLaunch(int launches) {
+    char* modeNames[] = { "fork", "vfork", "spawn" };
+    long long* samples = malloc(launches * sizeof(long long));
+    char* trueArgs[] = { "true", NULL };
+    for (int mode = LAUNCH_FORK; mode <= LAUNCH_SPAWN; mode++) {
+        launchMode = mode;
+        for (int i = 0; i < launches; i++) {
+            int execPipe[2];
+            pipe2(execPipe, O_CLOEXEC);
+            struct stageLaunch stage = { 0 };
+            stage.args = trueArgs;
+            stage.path = resolveCommand("true");
+            stage.inFd = -1;
+            stage.outFd = -1;
+            long long start = nowNanoseconds();
+            pid_t child = launchStage(&stage, -1, NULL);
+            close(execPipe[1]);
+            char unused;
+            read(execPipe[0], &unused, 1);
+            samples[i] = nowNanoseconds() - start;
+            close(execPipe[0]);
+            waitpid(child, NULL, 0);
+        }
+        printPercentiles("launch", modeNames[mode], samples, launches);
+    }
+    free(samples);
+}
+
+/* runScript - Run the shell on a script file with a given launch engine and time it
+*   Inputs: shellPath - Path of the smallsh executable, scriptPath - The script, modeName - Value for SMALLSH_LAUNCH
+*   Outputs: Elapsed nanoseconds, or -1 if the shell could not be started
+*/
+long long runScript(char* shellPath, char* scriptPath, char* modeName) {
+    setenv("SMALLSH_LAUNCH", modeName, 1);
+    char* shellArgs[] = { shellPath, scriptPath, NULL };
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, 1, "/dev/null", O_WRONLY, 0);
+    long long start = nowNanoseconds();
+    pid_t shell;
+    if (posix_spawn(&shell, shellPath, &actions, NULL, shellArgs, environ) != 0) {
+        posix_spawn_file_actions_destroy(&actions);
+        return -1;
+    }
+    waitpid(shell, NULL, 0);
+    posix_spawn_file_actions_destroy(&actions);
+    return nowNanoseconds() - start;
+}
+
+/* writeScript - Write a script repeating one line
+*   Inputs: path - File to create, line - Line to repeat (with its newline), count - Number of repetitions
+*   Outputs: None
+*/
+void writeScript(char* path, char* line, int count) {
+    FILE* script = fopen(path, "w");
+    for (int i = 0; i < count; i++) {
+        fputs(line, script);
+    }
+    fclose(script);
+}
+
+/* benchScripts - End to end throughput of the shell binary
+*   Inputs: shellPath - Path of the smallsh executable, commands - Lines in the foreground script, jobs - Lines in the background script
+*   Outputs: None, prints commands per second per launch engine and the background job storm result
+*/
+void benchScripts(char* shellPath, int commands, int jobs) {
+    char* modeNames[] = { "fork", "vfork", "spawn" };
+    setenv("SMALLSH_CACHE", "off", 1);
+    char scriptPath[] = "/tmp/smallsh-bench-XXXXXX";
+    int scriptFd = mkstemp(scriptPath);
+    close(scriptFd);
+
+    // The program is named by its full path, since a plain true is now run by the shell itself
+    char programLine[4096];
+    snprintf(programLine, sizeof(programLine), "%s\n", resolveCommand("true"));
+    writeScript(scriptPath, programLine, commands);
+    for (int mode = LAUNCH_FORK; mode <= LAUNCH_SPAWN; mode++) {
+        long long elapsed = runScript(shellPath, scriptPath, modeNames[mode]);
+        printf("{\"bench\":\"commands\",\"mode\":\"%s\",\"commands\":%d,\"seconds\":%.3f,\"commands_per_sec\":%.0f}\n",
+            modeNames[mode], commands, elapsed / 1e9, commands / (elapsed / 1e9));
+    }
+    writeScript(scriptPath, "true\n", commands);
+    long long builtinElapsed = runScript(shellPath, scriptPath, "spawn");
+    printf("{\"bench\":\"commands\",\"mode\":\"builtin\",\"commands\":%d,\"seconds\":%.3f,\"commands_per_sec\":%.0f}\n",
+        commands, builtinElapsed / 1e9, commands / (builtinElapsed / 1e9));
+
+    // The same built in run as the body of one for loop, parsed once instead of once per line
+    snprintf(programLine, sizeof(programLine), "for i in $(seq 1 %d); do true; done\n", commands);
+    writeScript(scriptPath, programLine, 1);
+    long long loopElapsed = runScript(shellPath, scriptPath, "spawn");
+    printf("{\"bench\":\"commands\",\"mode\":\"loop\",\"commands\":%d,\"seconds\":%.3f,\"commands_per_sec\":%.0f}\n",
+        commands, loopElapsed / 1e9, commands / (loopElapsed / 1e9));
+
+    snprintf(programLine, sizeof(programLine), "%s &\n", resolveCommand("true"));
+    writeScript(scriptPath, programLine, jobs);
+    long long elapsed = runScript(shellPath, scriptPath, "spawn");
+    printf("{\"bench\":\"background\",\"mode\":\"spawn\",\"jobs\":%d,\"seconds\":%.3f,\"jobs_per_sec\":%.0f}\n",
+        jobs, elapsed / 1e9, jobs / (elapsed / 1e9));
+    unlink(scriptPath);
+}
+
+/* benchParallel - Run work items piped into the parallel command and check its output
+*   Inputs: shellPath - Path of the smallsh executable, items - Number of work items
+*   Outputs: 0 if every item was echoed once and in order, -1 otherwise. Prints the elapsed time and the check result
+*/
+int benchParallel(char* shellPath, int items) {
+    char commandText[128];
+    snprintf(commandText, sizeof(commandText), "seq %d | parallel -k echo {}", items);
+    char* shellArgs[] = { shellPath, "-c", commandText, NULL };
+    int outputPipe[2];
+    pipe(outputPipe);
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, outputPipe[1], 1);
+    posix_spawn_file_actions_addclose(&actions, outputPipe[0]);
+    long long start = nowNanoseconds();
+    pid_t shell;
+    int spawned = posix_spawn(&shell, shellPath, &actions, NULL, shellArgs, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(outputPipe[1]);
+
+    // Every line has to be the next item number
+    FILE* output = fdopen(outputPipe[0], "r");
+    char line[64];
+    int expected = 1;
+    int ok = spawned == 0;
+    while (fgets(line, sizeof(line), output) != NULL) {
+        ok &= atoi(line) == expected++;
+    }
+    fclose(output);
+    if (spawned == 0) {
+        waitpid(shell, NULL, 0);
+    }
+    long long elapsed = nowNanoseconds() - start;
+    ok &= expected == items + 1;
+    printf("{\"bench\":\"parallel\",\"mode\":\"piped\",\"items\":%d,\"seconds\":%.3f,\"items_per_sec\":%.0f,\"ok\":%s}\n",
+        items, elapsed / 1e9, items / (elapsed / 1e9), ok ? "true" : "false");
+    fflush(stdout);
+    return ok ? 0 : -1;
+}
+
+/* benchScriptCache - Time a large script parsed from text and run from the script cache
+*   Inputs: shellPath - Path of the smallsh executable, blocks - Number of if blocks in the script
+*   Outputs: None, prints the elapsed time with the cache off, on the first run and the median of the cached runs
+*
+*   Purpose: The script is only built in commands, so the time is mostly reading and parsing it. The cache is kept in a temporary
+*   directory that is removed afterwards.
+*/
+void benchScriptCache(char* shellPath, int blocks) {
+    char scriptPath[] = "/tmp/smallsh-bench-XXXXXX";
+    int scriptFd = mkstemp(scriptPath);
+    close(scriptFd);
+    char cacheDirectory[] = "/tmp/smallsh-cache-XXXXXX";
+    mkdtemp(cacheDirectory);
+    writeScript(scriptPath, "if false\nthen\n    echo one $$ two > /dev/null | cat\nelse\n    true\nfi\n", blocks);
+
+    setenv("SMALLSH_CACHE", "off", 1);
+    long long uncached = runScript(shellPath, scriptPath, "spawn");
+    setenv("SMALLSH_CACHE", cacheDirectory, 1);
+    long long first = runScript(shellPath, scriptPath, "spawn");
+    long long samples[5];
+    for (int i = 0; i < 5; i++) {
+        samples[i] = runScript(shellPath, scriptPath, "spawn");
+    }
+    qsort(samples, 5, sizeof(long long), compareLongLong);
+    char* modes[] = { "off", "first", "cached" };
+    long long elapsed[] = { uncached, first, samples[2] };
+    for (int i = 0; i < 3; i++) {
+        printf("{\"bench\":\"cache\",\"mode\":\"%s\",\"blocks\":%d,\"seconds\":%.4f}\n", modes[i], blocks, elapsed[i] / 1e9);
+    }
+    fflush(stdout);
+
+    // Remove the cache directory and the cache file in it
+    DIR* directory = opendir(cacheDirectory);
+    struct dirent* entry;
+    char path[PATH_MAX];
+    while (directory != NULL && (entry = readdir(directory)) != NULL) {
+        if (entry->d_name[0] != '.') {
+            snprintf(path, sizeof(path), "%s/%s", cacheDirectory, entry->d_name);
+            unlink(path);
+        }
+    }
+    if (directory != NULL) {
+        closedir(directory);
+    }
+    rmdir(cacheDirectory);
+    unlink(scriptPath);
+    unsetenv("SMALLSH_CACHE");
+}
+
+/* benchSubmit - Compare starting a shell per command with submitting it to a command server
+*   Inputs: shellPath - Path of the smallsh executable, submissions - Number of samples for each
+*   Outputs: None, prints percentiles for both
+*
+*   Procedure:
+*   A fresh sample spawns smallsh -c true and waits for it. For the server, smallsh -s is started on a temporary socket, and a sample
+*   is the time from writing a "run true" request to reading its "done" line (the second line of the reply, after "started").
+*/
+void benchSubmit(char* shellPath, int submissions) {
+    long long* samples = malloc(submissions * sizeof(long long));
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, 1, "/dev/null", O_WRONLY, 0);
+    char* freshArgs[] = { shellPath, "-c", "true", NULL };
+    for (int i = 0; i < submissions; i++) {
+        long long start = nowNanoseconds();
+        pid_t shell;
+        posix_spawn(&shell, shellPath, &actions, NULL, freshArgs, environ);
+        waitpid(shell, NULL, 0);
+        samples[i] = nowNanoseconds() - start;
+    }
+    printPercentiles("submit", "fresh", samples, submissions);
+
+    struct sockaddr_un address = { 0 };
+    address.sun_family = AF_UNIX;
+    snprintf(address.sun_path, sizeof(address.sun_path), "/tmp/smallsh-bench-%d.sock", getpid());
+    char* serverArgs[] = { shellPath, "-s", address.sun_path, NULL };
+    pid_t server;
+    posix_spawn(&server, shellPath, &actions, NULL, serverArgs, environ);
+    int clientFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    for (int attempt = 0; attempt < 1000 && connect(clientFd, (struct sockaddr*)&address, sizeof(address)) == -1; attempt++) {
+        usleep(1000);
+    }
+    for (int i = 0; i < submissions; i++) {
+        long long start = nowNanoseconds();
+        write(clientFd, "run true\n", 9);
+        int lines = 0;
+        char reply[512];
+        ssize_t got;
+        while (lines < 2 && (got = read(clientFd, reply, sizeof(reply))) > 0) {
+            for (ssize_t j = 0; j < got; j++) {
+                lines += reply[j] == '\n';
+            }
+        }
+        samples[i] = nowNanoseconds() - start;
+    }
+    printPercentiles("submit", "server", samples, submissions);
+    close(clientFd);
+    kill(server, SIGTERM);
+    waitpid(server, NULL, 0);
+    posix_spawn_file_actions_destroy(&actions);
+    free(samples);
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s SMALLSH_PATH [COMMANDS] [LAUNCHES] [JOBS]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    int commands = argc > 2 ? atoi(argv[2]) : 5000;
+    int launches = argc > 3 ? atoi(argv[3]) : 2000;
+    int jobs = argc > 4 ? atoi(argv[4]) : 10000;
+    shellPidLength = sprintf(shellPidText, "%d", getpid());
+    importEnvironment();
+
+    benchParse();
+    benchExpand();
+    benchJobTable();
+    benchGlob();
+    benchLaunch(launches);
+    benchScripts(argv[1], commands, jobs);
+    int parallelResult = benchParallel(argv[1], jobs);
+    benchScriptCache(argv[1], commands * 10);
+    benchSubmit(argv[1], launches);
+    return parallelResult == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -1,31 +1,560 @@
+#define _GNU_SOURCE
 #include <fcntl.h>
+#include <errno.h>
+#include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <limits.h>
 #include <string.h>
 #include <dirent.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 #include <unistd.h>
 #include <signal.h>
+#include <spawn.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 
 //Global state variable for FG/BG status 
 int foregroundOnly = 0;
 
+// Size of each splice/tee transfer made by the in-shell pipeline relay, matching the default pipe capacity
+#define RELAY_CHUNK 65536
+
+// Here-documents and here-strings up to this size are fed through a pipe (the write never blocks), larger ones through a memfd
+#define INLINE_PIPE_LIMIT 4096
+
+// Engines available for starting child processes, selected with the launch command or the SMALLSH_LAUNCH environment variable
+#define LAUNCH_FORK 0
+#define LAUNCH_VFORK 1
+#define LAUNCH_SPAWN 2
+int launchMode = LAUNCH_SPAWN;
+
+// Placement of background jobs (CPU pinning, resource limits and cgroups), set with the placement command or SMALLSH_* variables
+#define PIN_NONE 0
+#define PIN_CPU 1
+#define PIN_NODE 2
+int pinMode = PIN_NONE;
+int pinReserved = 0;
+long jobCpuSeconds = 0;
+long jobMemoryMB = 0;
+char* cgroupBase = NULL;
+int cgroupUsable = 0;
+long cgroupCpuPercent = 0;
+long cgroupMemoryMB = 0;
+
+// CPU sets that pinned processes are rotated through, rebuilt by loadPinTargets whenever the pin mode or reservation changes
+cpu_set_t* pinTargets = NULL;
+int pinTargetCount = 0;
+int pinNext = 0;
+
+// The shell's PID as text, formatted once at startup for $$ expansion
+char shellPidText[24];
+int shellPidLength = 0;
+
+// Values of the special parameters $? and $!, updated by the command loop and createBackgroundProcess
+int lastExitValue = 0;
+pid_t lastBackgroundPid = 0;
+
+// Scratch space expandVariables builds words in, kept and grown between calls
+char* expandBuffer = NULL;
+size_t expandBufferSize = 0;
+
+// Descriptors kept open for the shell's lifetime: /dev/null (shared by every stage that needs it) and the working directory,
+// which relative redirection targets are opened against with openat (reopened by cd)
+int devNullFd = -1;
+int workingDirectoryFd = AT_FDCWD;
+
+// SIGINT action for the programs of a command substitution, which is started from expandVariables (set by main)
+struct sigaction* substitutionSIGINT = NULL;
+
+// Shell variables, see setVariable. exportedEnvironment is the environment for children, NULL when it has to be rebuilt
+#define VARIABLE_BUCKETS 256
+struct shellVariable
+{
+    char* name;
+    char* value;
+    int exported;
+    struct shellVariable* next;
+};
+struct shellVariable* variableTable[VARIABLE_BUCKETS];
+int variableCount = 0;
+char** exportedEnvironment = NULL;
+
+// Command history, see openHistory. The log file is mapped at historyMap (historyLength bytes), historyLines holds the offset of
+// every line start in the first historyIndexed bytes and is only built when a command needs entry numbers or a search.
+// The prefix index (see indexHistory) chains the entries by a hash of their first 1, 2 and 3 bytes: historyPrefixHeads holds
+// the newest entry of each bucket and historyPrefixNext the next older entry in the same bucket, both as entry number + 1.
+// The substring index holds, for each hash bucket of 3 byte sequences, the ascending numbers of the entries containing one
+#define HISTORY_FILE ".smallsh_history"
+#define HISTORY_PREFIX_BYTES 3
+#define HISTORY_PREFIX_BUCKETS 4096
+#define HISTORY_TRIGRAM_BUCKETS 16384
+struct historyPostings {
+    size_t* entries;
+    size_t count;
+    size_t capacity;
+};
+int historyFd = -1;
+char* historyMap = NULL;
+size_t historyLength = 0;
+size_t* historyLines = NULL;
+size_t historyLineCount = 0;
+size_t historyLineCapacity = 0;
+size_t historyIndexed = 0;
+size_t historyPrefixHeads[HISTORY_PREFIX_BYTES][HISTORY_PREFIX_BUCKETS];
+size_t* historyPrefixNext = NULL;
+struct historyPostings historyTrigrams[HISTORY_TRIGRAM_BUCKETS];
+
+// Per-phase tracing, see traceEnd and writeTrace. traceFd is -1 while tracing is off, which is the only thing a trace point checks
+// then. tracePhases collects the time of each phase of the current command, traceSamples every recorded value for the summary
+#define TRACE_PARSE 0
+#define TRACE_EXPAND 1
+#define TRACE_REDIRECT 2
+#define TRACE_RESOLVE 3
+#define TRACE_LAUNCH 4
+#define TRACE_WAIT 5
+#define TRACE_BUILTIN 6
+#define TRACE_TOTAL 7
+#define TRACE_PHASES 8
+char* tracePhaseNames[TRACE_PHASES] = { "parse", "expand", "redirect", "resolve", "launch", "wait", "builtin", "total" };
+int traceFd = -1;
+long long tracePhases[TRACE_PHASES];
+long long* traceSamples[TRACE_PHASES];
+size_t traceSampleCount[TRACE_PHASES];
+size_t traceSampleCapacity[TRACE_PHASES];
+long long traceCommandCount = 0;
+
+// Set once scriptCachePath has reported that the script cache directory can't be created
+int cacheWarned = 0;
+
+// The terminal handed to foreground jobs with tcsetpgrp when job control is on (interactive sessions), -1 when it is off
+int terminalFd = -1;
+
+// SIGCHLD is blocked and read from childSignalFd, which is watched together with the input by inputEpollFd (-1 when the input can't be polled)
+int childSignalFd = -1;
+int inputEpollFd = -1;
+
+// Cache of resolved command paths, see resolveCommand. cachedPathVariable is the PATH value the cache was filled with
+#define PATH_CACHE_BUCKETS 256
+struct pathCacheEntry
+{
+    char* name;
+    char* path;
+    unsigned int hits;
+    struct pathCacheEntry* next;
+};
+struct pathCacheEntry* pathCache[PATH_CACHE_BUCKETS];
+char* cachedPathVariable = NULL;
+
+// Directory listings kept for glob patterns, see listDirectory. A listing is identified by the directory's device and inode, and
+// names is one block of null terminated names that the sorted entries array points into. trusted is cleared when the directory
+// changed during the second in which it was read, since its modification time might then not show a later change
+#define DIRECTORY_CACHE_SLOTS 8
+#define GETDENTS_BUFFER 262144
+struct directoryListing
+{
+    dev_t device;
+    ino_t inode;
+    struct timespec modified;
+    int trusted;
+    char* names;
+    char** entries;
+    int count;
+    unsigned long lastUsed;
+};
+struct directoryListing directoryCache[DIRECTORY_CACHE_SLOTS];
+unsigned long directoryCacheClock = 0;
+char* getdentsBuffer = NULL;
+
 
 /* Background Process Struct
 *   Creating a struct for the process ID's to be stored in a double-linked list. I decided to use this data structure 
 *   because I wanted the ability to iterate through the list, pull completed processes out of the middle and not have 
-*   to deal with a gap in the remaining process list like an array would have
+*   to deal with a gap in the remaining process list like an array would have. Processes started by the parallel command are
+*   kept in the same list (so exit still terminates them) with the number of their work item, jobs started with & use -1.
+*   startTime (monotonic nanoseconds) and commandText are kept for the statistics reported when the process finishes, cgroupPath
+*   is the job's cgroup leaf when one was created by placeBackgroundJob (it is removed once empty). Every process of a job shares
+*   the job's process group groupID (-1 for processes left in the shell's group), which fg, bg and signals address as a unit, and
+*   stopped is set while the job is stopped by a signal like SIGTSTP. Jobs submitted to the command server have the connection of
+*   their client in clientFd and, when their output is captured, the read end of its pipe in outputFd (both -1 otherwise).
 */
 struct backgroundProcess
 {
     pid_t processID;
+    pid_t groupID;
+    int stopped;
+    int itemIndex;
+    long long startTime;
+    char* commandText;
+    char* cgroupPath;
+    int clientFd;
+    int outputFd;
     struct backgroundProcess* next;
     struct backgroundProcess* prev;
 };
 
+// Job table behind the background process list, so a shell with many thousands of jobs pays the same per job as one with a few.
+// Nodes are carved from slabs of JOB_SLAB_SIZE and recycled through jobFreeList, jobIndex maps PIDs to nodes (open addressing
+// with linear probing, at most half full), lastJob is the end of the list (NULL when it is empty) and stoppedProcessCount counts
+// the nodes with stopped set. Appending, looking up and removing a process are all constant time.
+#define JOB_SLAB_SIZE 256
+#define JOB_INDEX_INITIAL 1024
+struct backgroundProcess* jobFreeList = NULL;
+struct backgroundProcess** jobIndex = NULL;
+size_t jobIndexSize = 0;
+size_t jobIndexCount = 0;
+struct backgroundProcess* lastJob = NULL;
+int stoppedProcessCount = 0;
+
+
+/* Job Statistics Structs
+*   Resource usage of a finished job, collected from wait4 when its processes are reaped: wall time from launch to exit, CPU time,
+*   peak memory and context switches. The last COMPLETED_JOB_HISTORY background processes are kept for the jobs -l command.
+*/
+#define COMPLETED_JOB_HISTORY 64
+struct jobStats
+{
+    long long wallNanoseconds;
+    long long userMicroseconds;
+    long long systemMicroseconds;
+    long maxResidentKB;
+    long voluntarySwitches;
+    long involuntarySwitches;
+};
+struct completedJob
+{
+    pid_t processID;
+    int status;
+    char* commandText;
+    struct jobStats stats;
+};
+
+// Ring of recently finished background processes for jobs -l, completedJobCount counts every one ever recorded
+struct completedJob completedJobs[COMPLETED_JOB_HISTORY];
+int completedJobCount = 0;
+
+
+/* Server Endpoint Struct
+*   A descriptor the command server (smallsh -s SOCKET) waits on besides its listening socket and signal descriptors, kept in
+*   serverEndpoints at the index of the descriptor. A client connection has the partial request line read so far, the replies its
+*   socket had no room for yet (output), the epoll events it is registered for, the number of its jobs still running, closing
+*   once the client has stopped sending (it is closed when its last job is done and its replies are sent) and broken once it
+*   can't be written to. The pipe carrying a job's captured output names the job's process and its client's connection.
+*/
+#define ENDPOINT_CLIENT 1
+#define ENDPOINT_OUTPUT 2
+struct serverEndpoint
+{
+    int type;
+    pid_t processID;
+    int clientFd;
+    char* input;
+    size_t inputLength;
+    size_t inputCapacity;
+    char* output;
+    size_t outputLength;
+    size_t outputCapacity;
+    unsigned int events;
+    int runningJobs;
+    int closing;
+    int broken;
+};
+
+// Command server state, serverEndpointCount is the size of serverEndpoints (one past the highest descriptor it can hold)
+struct serverEndpoint* serverEndpoints = NULL;
+int serverEndpointCount = 0;
+int serverEpollFd = -1;
+int serverListenFd = -1;
+int serverStopFd = -1;
+
+
+/* Shell Metrics Struct
+*   Live counters published for external monitors in a shared memory file (/dev/shm/smallsh.PID) when SMALLSH_METRICS is set, read
+*   with tools/metrics. The shell only updates them with relaxed atomic adds and stores, so publishing costs no system calls, and
+*   forked copies of the shell (built in utilities, command server jobs) share the mapping and add to the same counters. Without
+*   SMALLSH_METRICS the counters go to metricsFallback and nothing is published. spawnNanoseconds is the time spent in launchStage
+*   for the forks counted, and foregroundOnly mirrors the current foreground-only mode.
+*/
+#define METRICS_MAGIC 0x534d5348
+#define METRICS_VERSION 1
+#define METRIC_ADD(counter, amount) __atomic_fetch_add(&shellMetrics->counter, (amount), __ATOMIC_RELAXED)
+struct shellMetrics
+{
+    uint32_t magic;
+    uint32_t version;
+    int64_t processID;
+    int64_t startTime;
+    uint64_t commands;
+    uint64_t forks;
+    uint64_t execFailures;
+    int64_t backgroundLive;
+    uint64_t backgroundTotal;
+    uint64_t spawnNanoseconds;
+    uint64_t foregroundToggles;
+    uint64_t foregroundOnly;
+};
+struct shellMetrics metricsFallback;
+struct shellMetrics* shellMetrics = &metricsFallback;
+char metricsPath[64] = "";
+
+
+/* Line Reader Struct
+*   Buffered input for the prompt loop. Input is read() in as large pieces as are available into a growable buffer and split
+*   into lines there, start is the first byte not yet returned as part of a line and length the number of bytes buffered.
+*   Script files and -c strings are placed in the buffer whole (a script is mapped with mmap) and start with endOfInput set.
+*/
+struct lineReader
+{
+    int fd;
+    char* buffer;
+    size_t start;
+    size_t length;
+    size_t capacity;
+    int endOfInput;
+};
+
+
+/* Arena Structs
+*   A simple bump allocator for everything created while handling one command. Memory is taken from the current block by
+*   advancing its used count, and the whole arena is emptied at once by arenaReset, which keeps the blocks for reuse.
+*/
+#define ARENA_BLOCK_SIZE 65536
+struct arenaBlock
+{
+    struct arenaBlock* next;
+    size_t size;
+    size_t used;
+    char data[];
+};
+struct arena
+{
+    struct arenaBlock* first;
+    struct arenaBlock* current;
+};
+
+
+/* Command Structs
+*   The result of parsing one line with parseCommandLine, all allocated from the command arena. A commandLine is a pipeline of one
+*   or more simpleCommand stages, each with its argument words and the redirections typed for it. Words are kept as typed, and the
+*   ones flagged WORD_EXPAND (they contain a $) are expanded when the command runs, and the ones flagged WORD_GLOB (they contain a *,
+*   ? or a non-empty [...] outside a $( )) are replaced by the file names they match, the whole word being matched after it is
+*   expanded. expandCount is the number of flagged arguments.
+*   A here-document's target is its delimiter until readHereDocuments replaces it with the body (hereDocuments counts them), and
+*   a here-string's target is the word itself. Both become the stage's input through openInlineInput. fd is the descriptor being
+*   redirected, and for REDIRECT_DUPLICATE (N<&M, N>&M) the target is the descriptor number to copy, or - to close fd.
+*/
+#define WORD_EXPAND 1
+#define WORD_GLOB 2
+#define REDIRECT_INPUT 0
+#define REDIRECT_OUTPUT 1
+#define REDIRECT_HEREDOC 2
+#define REDIRECT_HERESTRING 3
+#define REDIRECT_APPEND 4
+#define REDIRECT_DUPLICATE 5
+#define REDIRECT_BOTH 6
+#define REDIRECT_BOTH_APPEND 7
+struct redirection
+{
+    int type;
+    int fd;
+    char* target;
+    int targetFlags;
+    struct redirection* next;
+};
+struct simpleCommand
+{
+    int argc;
+    char** argv;
+    int* argFlags;
+    int expandCount;
+    struct redirection* redirections;
+    struct simpleCommand* next;
+};
+struct commandLine
+{
+    struct simpleCommand* stages;
+    int stageCount;
+    int background;
+    int hereDocuments;
+    int timed;
+};
+
+
+/* Script Node Struct
+*   One command of the tree that parseScriptNode builds for if, while and for, so a loop body is parsed once however many times it
+*   runs. A NODE_COMMAND holds a parsed commandLine. NODE_IF runs the condition list and then body or elseBody (an elif is an
+*   if node as the elseBody), NODE_WHILE runs body while condition succeeds, and NODE_FOR sets variable to each of the words in turn
+*   and runs body. Lists are chained through next. Everything is allocated from the script arena.
+*/
+#define NODE_COMMAND 0
+#define NODE_IF 1
+#define NODE_WHILE 2
+#define NODE_FOR 3
+struct scriptNode
+{
+    int type;
+    struct commandLine* command;
+    struct scriptNode* condition;
+    struct scriptNode* body;
+    struct scriptNode* elseBody;
+    char* variable;
+    struct simpleCommand* words;
+    struct scriptNode* next;
+};
+
+
+/* Stage Launch Struct
+*   Everything needed to start one command of a pipeline, prepared by the shell before the child process is created so the
+*   child only has to move descriptors into place and call exec. path is the resolved program to execute, inFd and outFd are the descriptors that become the child's
+*   stdin and stdout (-1 to inherit the shell's), normally the pipes to its neighbours. The redirections are then applied on top
+*   of those as the fdActions table, in the order they were typed: each action makes descriptor target a copy of source (dup2),
+*   or closes target when source is -1. openedFds are the files the shell opened for the actions, closed again once the child has
+*   started. relay marks cat/tee stages run by the shell itself, and builtin is set for stages that are built in utilities, which
+*   are run by a forked copy of the shell without an exec.
+*/
+#define STAGE_FD_ACTIONS 16
+struct fdAction
+{
+    int target;
+    int source;
+};
+struct stageLaunch
+{
+    char* path;
+    char** args;
+    int inFd;
+    int outFd;
+    struct fdAction fdActions[STAGE_FD_ACTIONS];
+    int fdActionCount;
+    int openedFds[STAGE_FD_ACTIONS];
+    int openedCount;
+    int relay;
+    struct builtinCommand* builtin;
+};
+
+
+/* Shell State Struct
+*   The state of the command loop that built in commands work with: the command being run (and the arena it was parsed into),
+*   the background process list, the SIGINT action for foreground children, the exit status and statistics of the last
+*   foreground command, and exitRequested, which the exit command sets to end the loop. loopDepth counts the for and while loops
+*   being run, and loopControl (with loopLevels, the number of loops it still applies to) is set by break and continue, or to
+*   LOOP_ABORT when CTL-C kills a foreground command, so runScriptNode stops running the rest of the compound command.
+*/
+#define LOOP_BREAK 1
+#define LOOP_CONTINUE 2
+#define LOOP_ABORT 3
+struct shellState
+{
+    struct arena* arena;
+    struct commandLine* command;
+    struct backgroundProcess* listHead;
+    struct sigaction* SIGINT_original;
+    int lastStatus;
+    struct jobStats lastStats;
+    int exitRequested;
+    int loopControl;
+    int loopLevels;
+    int loopDepth;
+};
+
+
+/* Script Parser Struct
+*   Where parseScriptNode gets its input from. Lines are read from reader and split at ; into segments, pending is the rest of the
+*   current line still to be split and pushback is one segment given back, the words that followed a keyword on the same segment
+*   (then echo a). depth counts the unfinished if, while and for commands, which changes the interactive prompt to "> ".
+*/
+struct scriptParser
+{
+    struct lineReader* reader;
+    struct arena* arena;
+    struct shellState* shell;
+    char* pending;
+    char* pushback;
+    int interactive;
+    int depth;
+};
+
+
+/* Script Cache Structs
+*   The parsed form of a script file, saved so the next run of the same unchanged script maps it instead of parsing. The cache
+*   file is an image of the scriptNode tree and everything it points to, with every pointer stored as an offset from the start of
+*   the file and listed in the relocation table, with the size of the object it points to (CACHE_STRING marks strings, whose
+*   size includes the terminator). Loading maps the file privately and adds the mapping's address to each listed pointer. The header identifies the script (its absolute path, size, modification time in nanoseconds and a hash of its
+*   contents) and the build (version and the sizes of the cached structs, in layout), and nodes is the table of top level commands.
+*   scriptCache is the image being built while the script runs the first time, relocations holds its pairs of field offset and
+*   target size (relocationCount pairs), failed is set when the script can't be cached
+*   (a syntax error, or an exit with commands left to run).
+*/
+#define SCRIPT_CACHE_MAGIC 0x43485353
+#define SCRIPT_CACHE_VERSION 2
+#define CACHE_STRING ((uint64_t)1 << 63)
+#define SCRIPT_CACHE_LAYOUT (sizeof(struct scriptNode) | sizeof(struct commandLine) << 8 | sizeof(struct simpleCommand) << 16 | sizeof(struct redirection) << 24)
+struct scriptCacheHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t layout;
+    uint64_t scriptSize;
+    int64_t scriptModified;
+    uint64_t scriptHash;
+    uint64_t pathOffset;
+    uint64_t nodesOffset;
+    uint64_t nodeCount;
+    uint64_t relocationsOffset;
+    uint64_t relocationCount;
+    uint64_t imageSize;
+};
+struct scriptCache
+{
+    char* image;
+    size_t length;
+    size_t capacity;
+    uint64_t* relocations;
+    size_t relocationCount;
+    size_t relocationCapacity;
+    uint64_t* nodes;
+    size_t nodeCount;
+    size_t nodeCapacity;
+    int failed;
+};
+
+
+/* Builtin Command Struct
+*   One command run by the shell itself. run receives the expanded arguments and returns a wait status (exit value << 8), which
+*   becomes the status reported by status when BUILTIN_SETS_STATUS is set. BUILTIN_FORKABLE marks utilities that only use their
+*   standard streams, so in a pipeline or a background job they run in a forked copy of the shell instead of being executed.
+*   BUILTIN_PURE marks the utilities with no effect on the shell besides their output, the only ones command substitution runs
+*   inside the shell (the others, like set or parallel, run in a forked copy there too, so they can't change the shell's variables
+*   or collect its jobs).
+*   The commands are placed in builtinSlots by registerBuiltins, at an index given by a perfect hash of the name (see findBuiltin).
+*/
+#define BUILTIN_FORKABLE 1
+#define BUILTIN_SETS_STATUS 2
+#define BUILTIN_PURE 4
+struct builtinCommand
+{
+    char* name;
+    int (*run)(char** args, struct shellState* shell);
+    int flags;
+};
+
+#define BUILTIN_SLOT_BITS 6
+#define BUILTIN_SLOTS (1 << BUILTIN_SLOT_BITS)
+struct builtinCommand* builtinSlots[BUILTIN_SLOTS];
+unsigned int builtinSeed = 0;
+
 
 /* Handle_CTLZ - SIGTSTP  signal handler function
 *   Inputs: signal number
@@ -41,6 +570,8 @@ struct backgroundProcess
 */
 void handle_CTLZ(int signo) {
     //If user input includes the ^Z, change the val of Foreground only mode
+    METRIC_ADD(foregroundToggles, 1);
+    __atomic_store_n(&shellMetrics->foregroundOnly, !foregroundOnly, __ATOMIC_RELAXED);
     switch (foregroundOnly) {
     case 0:
         foregroundOnly = 1;
@@ -57,6 +588,82 @@ void handle_CTLZ(int signo) {
     }
 }
 
+/* jobSlot - Home slot of a PID in jobIndex
+*   Inputs: processID - The PID
+*   Outputs: Index into jobIndex
+*
+*   Purpose: Consecutive PIDs are spread over the table with a multiplicative (Fibonacci) hash, jobIndexSize is a power of two.
+*/
+size_t jobSlot(pid_t processID) {
+    return ((unsigned int)processID * 2654435761u) & (jobIndexSize - 1);
+}
+
+/* indexBackgroundProcess - Add a node to the PID index
+*   Inputs: newProcess - The node
+*   Outputs: None
+*
+*   Purpose: The index doubles (and every node is re-inserted) before it would become more than half full, which keeps the probe
+*   sequences short.
+*/
+void indexBackgroundProcess(struct backgroundProcess* newProcess) {
+    if ((jobIndexCount + 1) * 2 > jobIndexSize) {
+        struct backgroundProcess** oldIndex = jobIndex;
+        size_t oldSize = jobIndexSize;
+        jobIndexSize = oldSize == 0 ? JOB_INDEX_INITIAL : oldSize * 2;
+        jobIndex = calloc(jobIndexSize, sizeof(struct backgroundProcess*));
+        for (size_t i = 0; i < oldSize; i++) {
+            if (oldIndex[i] != NULL) {
+                size_t slot = jobSlot(oldIndex[i]->processID);
+                while (jobIndex[slot] != NULL) {
+                    slot = (slot + 1) & (jobIndexSize - 1);
+                }
+                jobIndex[slot] = oldIndex[i];
+            }
+        }
+        free(oldIndex);
+    }
+    size_t slot = jobSlot(newProcess->processID);
+    while (jobIndex[slot] != NULL) {
+        slot = (slot + 1) & (jobIndexSize - 1);
+    }
+    jobIndex[slot] = newProcess;
+    jobIndexCount++;
+}
+
+/* unindexBackgroundProcess - Remove a node from the PID index
+*   Inputs: focusProcess - The node, which must be in the index
+*   Outputs: None
+*
+*   Purpose: Instead of leaving a deleted marker, the entries after the hole that would no longer be found past it are shifted
+*   back into it (backward shift deletion), so lookups never slow down as processes come and go.
+*/
+void unindexBackgroundProcess(struct backgroundProcess* focusProcess) {
+    size_t mask = jobIndexSize - 1;
+    size_t hole = jobSlot(focusProcess->processID);
+    while (jobIndex[hole] != focusProcess) {
+        hole = (hole + 1) & mask;
+    }
+    for (size_t next = (hole + 1) & mask; jobIndex[next] != NULL; next = (next + 1) & mask) {
+        // An entry may fill the hole unless its home slot lies cyclically after the hole, up to its current position
+        size_t home = jobSlot(jobIndex[next]->processID);
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            jobIndex[hole] = jobIndex[next];
+            hole = next;
+        }
+    }
+    jobIndex[hole] = NULL;
+    jobIndexCount--;
+}
+
+/* setProcessStopped - Change whether a background process is stopped
+*   Inputs: focusProcess - The list node, stopped - integer value for whether it is now stopped (1) or running (0)
+*   Outputs: None
+*/
+void setProcessStopped(struct backgroundProcess* focusProcess, int stopped) {
+    stoppedProcessCount += stopped - focusProcess->stopped;
+    focusProcess->stopped = stopped;
+}
+
 /* removeBackgroundProcess - Process list (structure) cleanup
 *   Inputs: Target Process structure to remove from list
 *   Outputs: None
@@ -65,7 +672,8 @@ void handle_CTLZ(int signo) {
 *
 *   Procedure:
 *   When called, the function will deploy pointers to the next process and the prior process in the list, remove the focus process's 
-*   link by connecting the two pointer processes to one another, and then the struct for the focus process will be freed.
+*   link by connecting the two pointer processes to one another, and then the struct for the focus process is taken out of the PID
+*   index and returned to the job table's free list.
 */
 void removeBackgroundProcess(struct backgroundProcess* focusProcess) {
     // Remove a completed or killed process from the list of running background processes
@@ -73,397 +681,6191 @@ void removeBackgroundProcess(struct backgroundProcess* focusProcess) {
     struct backgroundProcess* previousProcess = focusProcess->prev;
     if (restOfList == NULL) {
         previousProcess->next = NULL;
+        // Only the list head has no previous node
+        lastJob = previousProcess->prev != NULL ? previousProcess : NULL;
     }
     else {
         previousProcess->next = restOfList;
         restOfList->prev = previousProcess;
     }
-    free(focusProcess);
+    // The job's cgroup can only be removed once all of its processes are gone, so this succeeds for the last one
+    if (focusProcess->cgroupPath != NULL) {
+        rmdir(focusProcess->cgroupPath);
+        free(focusProcess->cgroupPath);
+    }
+    free(focusProcess->commandText);
+    setProcessStopped(focusProcess, 0);
+    unindexBackgroundProcess(focusProcess);
+    METRIC_ADD(backgroundLive, -1);
+    focusProcess->next = jobFreeList;
+    jobFreeList = focusProcess;
 }
 
-/* CleanupBackgroundProcesses 
-*   Inputs: Head Node of the background process linkedList
+/* forgetBackgroundProcesses - Empty the job table without touching the processes in it
+*   Inputs: listHead - Head Node of the background process linkedList
 *   Outputs: None
-* 
-*   Purpose: To remove a given process from the linked list of active processes once it has completed running. 
-* 
-*   Procedure:
-*   When called, the function will iterate through the linked list of processes, checking each for an exit condition with a non-blocking wait.
-*   If the wait returns 0 (the process is stll running) the check will return 0 and that process will be left in the list. If it returns a non-zero status,
-*   the function will print a text alert to the user stating the exit condition and value or signal recieved on exit, then call the removeBackgroundProcess
-*   function to remove it from the linkedList before moving on
-*/
-void cleanupBackgroundProcesses(struct backgroundProcess* listHead) {  
-    //Handles a once per loop cleanup of any finished backgorund processes before re-prompting for the next user input
-    struct backgroundProcess* focusProcess = listHead->next;
-    while (focusProcess != NULL) {
-        int status;
-        int waitVal = waitpid(focusProcess->processID, &status, WNOHANG);
-        if (waitVal == 0) {
-            focusProcess = focusProcess->next;
-        }
-        else {
-            if (WIFEXITED(status)) {
-                printf("\nbackground pid %d is done: exit value %d\n", focusProcess->processID, status);
-                fflush(stdout);
-                focusProcess = focusProcess->prev;
-                removeBackgroundProcess(focusProcess->next);
-                focusProcess = focusProcess->next;
-            }else if (WIFSIGNALED(status)) {
-                printf("\nbackground pid %d is done: terminated by signal %d\n", focusProcess->processID, status);
-                fflush(stdout);
-                focusProcess = focusProcess->prev;
-                removeBackgroundProcess(focusProcess->next);
-                focusProcess = focusProcess->next;
-            }
-        }
+*
+*   Purpose: A forked copy of the shell that goes on to run commands of its own (a command server job) starts with no jobs, since
+*   the processes in the table it inherited are its siblings and not its children.
+*/
+void forgetBackgroundProcesses(struct backgroundProcess* listHead) {
+    // The inherited jobs stay counted as the server's, they are still running
+    listHead->next = NULL;
+    lastJob = NULL;
+    stoppedProcessCount = 0;
+    if (jobIndex != NULL) {
+        memset(jobIndex, 0, jobIndexSize * sizeof(struct backgroundProcess*));
     }
+    jobIndexCount = 0;
 }
 
-/* killRunningProcesses 
-*   Inputs: listHead  - Head Node of the background process linkedList
+/* nowNanoseconds - Read the monotonic clock
+*   Inputs: None
+*   Outputs: Current CLOCK_MONOTONIC time in nanoseconds
+*/
+long long nowNanoseconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/* addUsage - Add the resource usage of one finished process to a job's statistics
+*   Inputs: stats - The job statistics to update, usage - Resource usage returned by wait4
 *   Outputs: None
-* 
-*   Purpose: On exit, terminate/clean up all child processes in the process structure
-*   This function is called upon recieving the 'exit' command from the user, and will terminate all running child processes managed by the shell 
-*   as well as clear the linked list process structure before returning. The function first calls the cleanupBackgroundProcesses command to remove 
-*   and already completed processes, then will iterate throguh the process list issueing SIGTERM commands to each child process running in the background.
-*   After reaching the end of the list, the function will return
+*
+*   Purpose: CPU times and context switches of the processes in a pipeline add up, the memory high water mark is the largest one.
 */
-void killRunningProcesses(struct backgroundProcess* listHead) {
-    // Take the process ID out of the background monitoring list, kill it and continue down the list of open processes until all are terminated 
-    cleanupBackgroundProcesses(listHead);
-    struct backgroundProcess* target = listHead->next;
-    while (target != NULL) {
-        kill(target->processID, SIGTERM);
-        target = target->next;
+void addUsage(struct jobStats* stats, struct rusage* usage) {
+    stats->userMicroseconds += (long long)usage->ru_utime.tv_sec * 1000000 + usage->ru_utime.tv_usec;
+    stats->systemMicroseconds += (long long)usage->ru_stime.tv_sec * 1000000 + usage->ru_stime.tv_usec;
+    if (usage->ru_maxrss > stats->maxResidentKB) {
+        stats->maxResidentKB = usage->ru_maxrss;
     }
-    return;
+    stats->voluntarySwitches += usage->ru_nvcsw;
+    stats->involuntarySwitches += usage->ru_nivcsw;
 }
 
-/* checkBackgroundCommand 
-*   Inputs:     arguments - User input character array
-*   Outputs:    Integer representing a boolean value for whether it is a background process, 1 for True (Backgroud process and 0 for false (Not Background process)
-* 
-*   Purpose: Take a provided the command line input, verify whether the & was recieved and return a  value to report results
-* 
-*   Procedure:
-*   This function accepts the user input character array, creates a copy to work with and will use strtok_r to iterate through the space-delimited command argments. 
-*   At each argument, the variable for 'backgroundCommand' is toggled on (1) and off (0) depending on whether the last token seen was a solitary & character. 
-*   In order to return true (1), the final token will need to set the variable to 1 just before the last strtok_r call returns null and the loop is exited. After
-*   the loop is finished, the copy array memory will be freed.
-*/
-int checkBackgroundCommand(char* arguments) {
-    //Create copy of the string to iterate over
-    char* argCopy = calloc(strlen(arguments) + 1, sizeof(char));
-    strcpy(argCopy, arguments);
-
-    // Iterate over the full array, flipping the backgroundCommand variable with each token. If the last one is an &, the variable will end as a 1. Otherwise, 
-    // an & earlier will be reset to 0 by the next token
-    char* bgPtr;
-    char* token = strtok_r(argCopy, " ", &bgPtr);
-    int backgroundCommand = 0;
-    while (token != NULL) {
-        if (strcmp(token, "&") == 0) {
-            backgroundCommand = 1;
-        }
-        else {
-            backgroundCommand = 0;
-        }
-        token = strtok_r(NULL, " ", &bgPtr);
-    }
-    free(argCopy);
-    return backgroundCommand;
+/* printJobStats - Print a job's statistics on one line
+*   Inputs: output - Stream to print to, stats - The statistics
+*   Outputs: None
+*/
+void printJobStats(FILE* output, struct jobStats* stats) {
+    fprintf(output, "real %.3fs user %.3fs sys %.3fs maxrss %ldKB ctxsw %ld/%ld\n", stats->wallNanoseconds / 1e9,
+        stats->userMicroseconds / 1e6, stats->systemMicroseconds / 1e6, stats->maxResidentKB, stats->voluntarySwitches,
+        stats->involuntarySwitches);
+    fflush(output);
 }
 
-/* redirectIO
-*   Inputs:     expandedArge - Character array of arguments, after $$ variable expansion
-*               foregrond    - integer value for whether the process is foreground (1) or background (0)
-*   Outputs:    Integer value for the success of the file redirection, with 0 for success and -1 for failure. 
+/* usageSince - Measure the resources used since an earlier snapshot
+*   Inputs: stats  - Receives the difference, or a new snapshot when before is NULL
+*           before - Snapshot taken with an earlier call, or NULL
+*   Outputs: None
 *
-*   Purpose: Redirect the Input and output streams when requested, and set background process I/O to dev/null if no redirect is specified
-* 
-*   Procedure:
-*   This function accepts the arguments with the $$ variables expanded, will make a copy to perform work on and then proceed to iterate over the space delimited 
-*   arguments with the strtok_r method, searching for a '<' or '>' token. When one is found, the program will take the provided path argument immediately following the '<' or '>' token,
-*   and will redirect the corresponding Input or output stream to the path argument provided. 
+*   Purpose: Times built in commands run under time, which aren't collected with wait4. The snapshot adds the shell's own usage to
+*   that of every child collected so far, so the difference covers the command's in-shell work and any children it waited for.
+*   The peak memory can't be split that way and is the larger of the two peaks.
 */
-int redirectIO(char* expandedArgs, int foreground) {
-
-    //Create base path for inputs in the cwd
-    char inPath[250];
-    getcwd(inPath, 249);
-    strcat(inPath, "/");
-
-    //Create base path for outputs in the cwd
-    char outPath[250];
-    getcwd(outPath, 249);
-    strcat(outPath, "/");
-
-    // Declare token and location pointers for iterating over the arguments
-    char* pathToken;
-    char* IOptr;
-
-    // Create boolean flag variables for whether input and output were each redirected
-    int inRedirected = 0;
-    int outRedirected = 0;
-
-    // Copy Arguments to tokenize and iterate over
-    char* IOCopy = malloc((strlen(expandedArgs) + 1) * sizeof(char));
-    strcpy(IOCopy, expandedArgs);
-
-    // Iterate over the arguments, searching for the < or > operators
-    char* token = strtok_r(IOCopy, " ", &IOptr);
-    while (token != NULL) {
-        // One of the two operators found, save the path argument immediately following the operator
-        if (strcmp(token, "<") == 0 || strcmp(token, ">") == 0) {
-            pathToken = strtok_r(NULL, " ", &IOptr);
+void usageSince(struct jobStats* stats, struct jobStats* before) {
+    struct rusage usage;
+    memset(stats, 0, sizeof(struct jobStats));
+    getrusage(RUSAGE_SELF, &usage);
+    addUsage(stats, &usage);
+    getrusage(RUSAGE_CHILDREN, &usage);
+    addUsage(stats, &usage);
+    stats->wallNanoseconds = nowNanoseconds();
+    if (before != NULL) {
+        stats->wallNanoseconds -= before->wallNanoseconds;
+        stats->userMicroseconds -= before->userMicroseconds;
+        stats->systemMicroseconds -= before->systemMicroseconds;
+        stats->voluntarySwitches -= before->voluntarySwitches;
+        stats->involuntarySwitches -= before->involuntarySwitches;
+    }
+}
 
+/* writeAll - Write a full buffer to a file descriptor, retrying on short writes
+*   Inputs: fd - Destination descriptor, buffer - Data to write, length - Number of bytes in the buffer
+*   Outputs: 0 on success, -1 on failure
+*/
+int writeAll(int fd, const char* buffer, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(fd, buffer, length);
+        if (written == -1 && errno == EINTR) {
+            continue;
         }
-        // Redirect Input if < was found
-        if (strcmp(token, "<") == 0) {
-            inRedirected = 1;
-            strcat(inPath, pathToken);
-            int newInput = open(inPath, O_RDONLY, 0777);
-            if (newInput == -1) {
-                printf("Unable to open %s for Input\n:", pathToken);
-                fflush(stdout);
-                return -1;
-            }
-            else {
-                dup2(newInput, 0);
-            }
-        }
-        // Redirect Output if > was found
-        else if (strcmp(token, ">") == 0) {
-            outRedirected = 1;
-            strcat(outPath, pathToken);
-            int newOutput = open(outPath, O_WRONLY | O_CREAT | O_TRUNC, 0777);
-            if (newOutput == -1) {
-                printf("Unable to open %s for Output\n:", pathToken);
-                fflush(stdout);
-                return -1;
-            }
-            else {
-                dup2(newOutput, 1);
-            }
+        if (written <= 0) {
+            return -1;
         }
-        token = strtok_r(NULL, " ", &IOptr);
-    }
-    // Redirect input and output to dev/null if this is a background process and the stream in question wasn't already redirected
-    int bgdefault = open("/dev/null", O_RDWR);
-    if (inRedirected == 0 && foreground == 0) {
-        dup2(bgdefault, 0);
-    }
-    if (outRedirected == 0 && foreground == 0) {
-        dup2(bgdefault, 1);
+        buffer += written;
+        length -= written;
     }
     return 0;
 }
 
-/* expandVariables - Find all $$ occurances and expand them to the PID of the shell process
-*   Inputs: arguments - Character array pointer leading to the user input
-*   Outputs: Character array pointer for an expanded array created in this function
+/* traceStart - Start timing a traced phase
+*   Inputs: None
+*   Outputs: The current monotonic time in nanoseconds, or 0 without reading the clock when tracing is off
+*/
+long long traceStart() {
+    return traceFd == -1 ? 0 : nowNanoseconds();
+}
+
+/* traceEnd - Add the time since traceStart to a phase of the current command
+*   Inputs: phase - One of the TRACE_ phases, start - The value returned by traceStart
+*   Outputs: None
 *
-*   Purpose: 
-*   This funciton accepts the user input array pointer, and will iterate through the array character by character to expand the $$ variables.
-*   
-*   Procedure
-*   To perform this expansion, the function will advance one letter at a time, seeing if the next two letters are both $'s. If this is the case,
-*   the function counts this as one double variable and advances the position 2 places instead of 1 to avoid double counting part of the pair. 
-*   After recording the number of doubles to expand, a character array is allocated based on the number of necessary caracters for the expanded string 
-*   (length of the original input with extra space added for PID's longer than 2 characters). The function will then copy all characters into the new array,
-*   replacing the $$ pairs with the PID characters for the shell process
-*/
-char* expandVariables(char* arguments) {
-    // Allocate a char array for the PID's string representation, size picked arbitrarily to be certain the PID wouldn't cause overflow
-    char* pidChars = calloc(25, sizeof(char));
-    
-    // Print the PID characters into the new char array, measure the length in characters and initialize counter and index variables 
-    sprintf(pidChars, "%d", getpid());
-    int pidLen = strlen(pidChars);
-    int doubleVarCount = 0;
-    int index = 1;
-
-    // Loop through characters, counting the number of occurrances of a the '$$' pairs
-    while (index < strlen(arguments)) {
-        char* letter1 = calloc(2, sizeof(char));
-        char* letter2 = calloc(2, sizeof(char));
-        sprintf(letter1, "%c", arguments[index-1]);
-        sprintf(letter2, "%c", arguments[index]);
-        if (strncmp(letter2, "$",1) == 0 && strncmp(letter1, "$", 1) == 0) {
-            doubleVarCount++;
-            index++;
-        }
-        index++;
-        free(letter1);
-        free(letter2);
-    }
-
-    // Allocate an expanded char array memory block, using the full PID length * the number of occurances added to the original length. 
-    // This is more than strictly necessary to provide overflow security
-    char* argCopy = calloc(strlen(arguments) + ((pidLen)*doubleVarCount) + 1, sizeof(char));
-    index = 0;
-    int doublePrintedLast = 0;
-
-    // Iterate through the original array again, printing characters. When the double is encountered, concatenate the PID characters and 
-    // advance the index twice to skip the 2nd $ character
-    while (index < strlen(arguments)-1) {
-        char* letter1 = calloc(2, sizeof(char));
-        char* letter2 = calloc(2, sizeof(char));
-        sprintf(letter1, "%c", arguments[index]);
-        sprintf(letter2, "%c", arguments[index+1]);
-        if (strncmp(letter2, "$", 1) == 0 && strncmp(letter1, "$", 1) == 0) {
-            strcat(argCopy, pidChars);
-            index++;
-            doublePrintedLast = 1;
+*   Purpose: A phase that happens several times in one command (a stage of a pipeline, a command substitution) adds up. Phases
+*   nest where the shell's work does: the programs of a $( ) are launched and waited for during the expand phase.
+*/
+void traceEnd(int phase, long long start) {
+    if (traceFd != -1) {
+        tracePhases[phase] += nowNanoseconds() - start;
+    }
+}
+
+/* writeTrace - Write the trace record of a finished command
+*   Inputs: commandText - The command, as printed by describeCommand, or NULL to discard the phases without a record
+*           start       - traceStart value taken when the line was read, 0 if tracing was off then (nothing is recorded)
+*   Outputs: None
+*
+*   Purpose: One compact JSON line per command goes to the trace descriptor in a single write: a sequence number, the monotonic
+*   start time and the nanoseconds spent in each phase. Each phase that took any time is also kept for printTraceSummary.
+*/
+void writeTrace(char* commandText, long long start) {
+    if (traceFd == -1) {
+        return;
+    }
+    if (commandText == NULL || start == 0) {
+        memset(tracePhases, 0, sizeof(tracePhases));
+        return;
+    }
+    tracePhases[TRACE_TOTAL] = nowNanoseconds() - start;
+    char record[1024];
+    int length = snprintf(record, sizeof(record), "{\"command\":%lld,\"start_ns\":%lld", ++traceCommandCount, start);
+    for (int phase = 0; phase < TRACE_PHASES; phase++) {
+        length += snprintf(record + length, sizeof(record) - length, ",\"%s_ns\":%lld", tracePhaseNames[phase], tracePhases[phase]);
+        if (tracePhases[phase] > 0) {
+            if (traceSampleCount[phase] == traceSampleCapacity[phase]) {
+                traceSampleCapacity[phase] = traceSampleCapacity[phase] == 0 ? 1024 : traceSampleCapacity[phase] * 2;
+                traceSamples[phase] = realloc(traceSamples[phase], traceSampleCapacity[phase] * sizeof(long long));
+            }
+            traceSamples[phase][traceSampleCount[phase]++] = tracePhases[phase];
+        }
+        tracePhases[phase] = 0;
+    }
+
+    // The command text is escaped for JSON, and cut short if the record would not fit
+    length += snprintf(record + length, sizeof(record) - length, ",\"text\":\"");
+    for (char* cursor = commandText; *cursor != '\0' && length < (int)sizeof(record) - 16; cursor++) {
+        if (*cursor == '"' || *cursor == '\\') {
+            record[length++] = '\\';
+            record[length++] = *cursor;
+        }
+        else if ((unsigned char)*cursor < 0x20) {
+            length += sprintf(record + length, "\\u%04x", *cursor);
         }
         else {
-            strcat(argCopy, letter1);
-            doublePrintedLast = 0;
+            record[length++] = *cursor;
         }
-        index++;
-        free(letter1);
-        free(letter2);
     }
+    length += sprintf(record + length, "\"}\n");
+    writeAll(traceFd, record, length);
+}
 
-    // Since it's possible to miss the last letter is an expansion occurs towards the end, 
-    // copy the last letter if this has occurred based on ending index variable
-    if (strlen(arguments)-index==1) {
-        char* lastLetter = calloc(2, sizeof(char));
-        sprintf(lastLetter, "%c", arguments[index]);
-        strcat(argCopy, lastLetter);
-        free(lastLetter);
-    }
-    return argCopy;
+/* compareTraceSamples - qsort comparison for trace samples
+*   Inputs: first, second - Pointers to the two samples
+*   Outputs: Negative, zero or positive like strcmp
+*/
+int compareTraceSamples(const void* first, const void* second) {
+    long long a = *(const long long*)first;
+    long long b = *(const long long*)second;
+    return (a > b) - (a < b);
 }
 
-/* parseArgs - Parse the arguments from the user input character array into an array of pointers to individual arguments
-*   Inputs: exandedArgs - The input Arguments character array
-*   Outputs: One array of Character array pointers, each pointing to an argument string
+/* printTraceSummary - Print latency percentiles for every traced phase
+*   Inputs: fd - Descriptor to write the summary to
+*   Outputs: None
 *
-*   Purpose: The purpose of this function is to create an array of pointers to the various argmuents that can be accepted
-*   by the execvp function call.
-* 
-*   Procedure:
-*   To parse the arguments necessary for an execvp function call, the function first copies the expanded inputs array to perform work on,
-*   then will iterate over the space delimited array of arguments using strtok_r. The loop will allocate memory for the initial command name 
-*   and each valid argument and record them into character arrays pointed to by each index of the pointer array. Tokens containing redrect operators, thier filepaths 
-*   or the background & operator are skipped. After completing all tokens, a null terminator will be added (if a & was the final argument, it will be overwritten as it 
-*   is not used for the execvp function
-*/
-char** parseArgs(char* expandedArgs) {
-
-    //Create a copy of the inputs array to tokenize
-    char* argCopy = malloc((strlen(expandedArgs)+1)*sizeof(char));
-    strcpy(argCopy, expandedArgs);
-
-    // Create the structure by allocating memory for an array of pointers. 514 chosen based on the 512 max argument requirement, 
-    // +1 for the name of the command at index 0 and +1 for the null terminated final index required by execvp 
-    char* saveArgPtr;
-    char* token;
-    char** args;
-    args = malloc((514) * sizeof(char*));
-    int argIndex = 0;
-
-    //Parse Arguments into an array of strings passable to an exec function
-    token = strtok_r(argCopy, " ", &saveArgPtr);
-    while (token != NULL) {
-        if (strcmp(token, "<") == 0 || strcmp(token, ">") == 0) {
-            token = strtok_r(NULL, " ", &saveArgPtr);
-        }
-        else if (strcmp(token, "&") != 0) {
-            args[argIndex] = (char*)malloc((strlen(token) + 1)*sizeof(char));
-            strcpy(args[argIndex], token);
-            argIndex++;
+*   Purpose: One JSON line per phase with the number of commands it took time in and the 50th, 90th and 99th percentile and
+*   maximum, in microseconds. The samples are sorted in place, which doesn't disturb later additions.
+*/
+void printTraceSummary(int fd) {
+    for (int phase = 0; phase < TRACE_PHASES; phase++) {
+        size_t count = traceSampleCount[phase];
+        if (count == 0) {
+            continue;
         }
-        token = strtok_r(NULL, " ", &saveArgPtr);
+        long long* samples = traceSamples[phase];
+        qsort(samples, count, sizeof(long long), compareTraceSamples);
+        char line[256];
+        int length = snprintf(line, sizeof(line), "{\"summary\":\"%s\",\"count\":%zu,\"p50_us\":%.1f,\"p90_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f}\n",
+            tracePhaseNames[phase], count, samples[count / 2] / 1000.0, samples[count * 9 / 10] / 1000.0,
+            samples[count * 99 / 100] / 1000.0, samples[count - 1] / 1000.0);
+        writeAll(fd, line, length);
     }
+}
 
-    // Add null terminato to the end of the argument pointers 
-    args[argIndex+1] = NULL;
-    free(expandedArgs);
-    return args;
+/* startTrace - Turn tracing on
+*   Inputs: destination - A file to append the records to, or the number of an open descriptor
+*   Outputs: 0 on success, -1 if the file could not be opened
+*
+*   Purpose: A descriptor number is duplicated (above 9, close on exec), so redirections of later commands don't move the trace.
+*/
+int startTrace(char* destination) {
+    char* end;
+    long number = strtol(destination, &end, 10);
+    int newFd;
+    if (*destination != '\0' && *end == '\0') {
+        newFd = fcntl(number, F_DUPFD_CLOEXEC, 10);
+    }
+    else {
+        newFd = open(destination, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    }
+    if (newFd == -1) {
+        return -1;
+    }
+    if (traceFd != -1) {
+        close(traceFd);
+    }
+    traceFd = newFd;
+    memset(tracePhases, 0, sizeof(tracePhases));
+    return 0;
 }
 
-/* createBackgroundProcess
-*   Inputs: args - A null terminated array of character array pointers, with each index corresponding to an argument. used in execvp
-*           expandedArgs - The single characterArray of the arguments, for use with the input/output redirection in the child process
-*           listHead  - Head Node of the background process linkedList
+/* removeMetrics - Remove the shell's metrics file at exit
+*   Inputs: None
 *   Outputs: None
-* 
-*   Purpose: This function creates a background process and adds it to the background process linked list data structure
-* 
-*   Procedure:
-*   This funciton will first create a new background process struct to store the process, and create a child process fork
-*   to execute the program contained withing the args variable array. Based upon the pid check performed after the fork to 
-*   differentiate between parent and child behavior, the function will finish one of two ways. The Child process will 
-*   redirect the input and output as necessary, then attempt to run the new program. The parent will add the child process
-*   to the linkedList struct and will continue back to the user prompt to await the next input
-*/
-void createBackgroundProcess(char** args, char* expandedArgs, struct backgroundProcess* listHead) {
-    //create Process struct and insert it into the list
-    struct backgroundProcess* newProcess = malloc(sizeof(struct backgroundProcess));
-    int newChildPid = fork();
-    int redirectSuccess = 0;
-    int executionSuccess;
-    switch (newChildPid) {
-    case -1:
+*
+*   Purpose: Registered with atexit. Forked copies of the shell run the handler too when they exit, so only the shell that created
+*   the file removes it.
+*/
+void removeMetrics() {
+    if (metricsPath[0] != '\0' && shellMetrics->processID == getpid()) {
+        unlink(metricsPath);
+    }
+}
+
+/* openMetrics - Start publishing the shell's counters in shared memory
+*   Inputs: None
+*   Outputs: 0 on success, -1 if the file could not be created or mapped
+*
+*   Purpose: The counters move from metricsFallback into a page of /dev/shm/smallsh.PID mapped shared, which monitors map read only
+*   and sample whenever they like. The header is written last, so a reader that finds the magic number sees a complete page.
+*/
+int openMetrics() {
+    snprintf(metricsPath, sizeof(metricsPath), "/dev/shm/smallsh.%d", getpid());
+    int metricsFd = open(metricsPath, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (metricsFd == -1) {
+        metricsPath[0] = '\0';
+        return -1;
+    }
+    struct shellMetrics* page = MAP_FAILED;
+    if (ftruncate(metricsFd, sizeof(struct shellMetrics)) == 0) {
+        page = mmap(NULL, sizeof(struct shellMetrics), PROT_READ | PROT_WRITE, MAP_SHARED, metricsFd, 0);
+    }
+    close(metricsFd);
+    if (page == MAP_FAILED) {
+        unlink(metricsPath);
+        metricsPath[0] = '\0';
+        return -1;
+    }
+    *page = metricsFallback;
+    page->processID = getpid();
+    page->startTime = time(NULL);
+    page->foregroundOnly = foregroundOnly;
+    page->version = METRICS_VERSION;
+    __atomic_store_n(&page->magic, METRICS_MAGIC, __ATOMIC_RELEASE);
+    shellMetrics = page;
+    atexit(removeMetrics);
+    return 0;
+}
+
+/* jobsCommand - The jobs built in command
+*   Inputs: args - Expanded arguments (jobs [-l]), shell - Shell state, for the background process list
+*   Outputs: 0
+*
+*   Purpose: Print the background processes, running or stopped, with how long ago they started. With -l, the most recently finished
+*   ones (up to COMPLETED_JOB_HISTORY) are printed first, oldest first, with their exit condition and the wall time, CPU time,
+*   memory and context switch counts recorded when they were collected.
+*/
+int jobsCommand(char** args, struct shellState* shell) {
+    if (args[1] != NULL && strcmp(args[1], "-l") == 0) {
+        int first = completedJobCount > COMPLETED_JOB_HISTORY ? completedJobCount - COMPLETED_JOB_HISTORY : 0;
+        for (int i = first; i < completedJobCount; i++) {
+            struct completedJob* job = &completedJobs[i % COMPLETED_JOB_HISTORY];
+            if (WIFEXITED(job->status)) {
+                printf("%d  done, exit value %d  %s\n", job->processID, WEXITSTATUS(job->status), job->commandText);
+            }
+            else {
+                printf("%d  done, terminated by signal %d  %s\n", job->processID, WTERMSIG(job->status), job->commandText);
+            }
+            printf("    ");
+            printJobStats(stdout, &job->stats);
+        }
+    }
+    else if (args[1] != NULL) {
+        printf("jobs: usage: jobs [-l]\n");
+        fflush(stdout);
+        return 0;
+    }
+    long long now = nowNanoseconds();
+    for (struct backgroundProcess* focusProcess = shell->listHead->next; focusProcess != NULL; focusProcess = focusProcess->next) {
+        printf("%d  %s %.3fs  %s\n", focusProcess->processID, focusProcess->stopped ? "stopped" : "running",
+            (now - focusProcess->startTime) / 1e9, focusProcess->commandText != NULL ? focusProcess->commandText : "");
+    }
+    fflush(stdout);
+    return 0;
+}
+
+/* addBackgroundProcess - Append a started process to the background process list
+*   Inputs: listHead  - Head Node of the background process linkedList
+*           processID - PID of the new child
+*           itemIndex - Work item number for processes started by the parallel command, -1 for jobs started with &
+*           commandText - Text of the command for job listings (copied), or NULL
+*   Outputs: Pointer to the new list node
+*
+*   Purpose: The node is taken from the job table's free list, which is refilled a whole slab at a time, linked in after lastJob
+*   and added to the PID index.
+*/
+struct backgroundProcess* addBackgroundProcess(struct backgroundProcess* listHead, pid_t processID, int itemIndex, char* commandText) {
+    struct backgroundProcess* endOfList = lastJob != NULL ? lastJob : listHead;
+    if (jobFreeList == NULL) {
+        struct backgroundProcess* slab = malloc(JOB_SLAB_SIZE * sizeof(struct backgroundProcess));
+        for (int i = 0; i < JOB_SLAB_SIZE; i++) {
+            slab[i].next = jobFreeList;
+            jobFreeList = &slab[i];
+        }
+    }
+    struct backgroundProcess* newProcess = jobFreeList;
+    jobFreeList = newProcess->next;
+    newProcess->processID = processID;
+    newProcess->groupID = -1;
+    newProcess->stopped = 0;
+    newProcess->itemIndex = itemIndex;
+    newProcess->startTime = nowNanoseconds();
+    newProcess->commandText = commandText == NULL ? NULL : strdup(commandText);
+    newProcess->cgroupPath = NULL;
+    newProcess->clientFd = -1;
+    newProcess->outputFd = -1;
+    newProcess->next = NULL;
+    newProcess->prev = endOfList;
+    endOfList->next = newProcess;
+    lastJob = newProcess;
+    indexBackgroundProcess(newProcess);
+    METRIC_ADD(backgroundLive, 1);
+    METRIC_ADD(backgroundTotal, 1);
+    return newProcess;
+}
+
+/* findBackgroundProcess - Look up a process in the background process list
+*   Inputs: processID - PID to find
+*   Outputs: Pointer to the list node, or NULL if the process is not in the list
+*
+*   Purpose: The PID is looked up in the job table's index, which covers the list, instead of walking the list.
+*/
+struct backgroundProcess* findBackgroundProcess(pid_t processID) {
+    if (jobIndexCount == 0) {
+        return NULL;
+    }
+    size_t slot = jobSlot(processID);
+    while (jobIndex[slot] != NULL && jobIndex[slot]->processID != processID) {
+        slot = (slot + 1) & (jobIndexSize - 1);
+    }
+    return jobIndex[slot];
+}
+
+void finishServerJob(struct backgroundProcess* focusProcess, int status, struct jobStats* stats);
+
+/* reportBackgroundProcess - Print the notice for a finished background job, record its statistics and remove it from the list
+*   Inputs: focusProcess - The list node of the finished process
+*           status       - Its wait status
+*           usage        - Its resource usage from wait4
+*   Outputs: None
+*
+*   Purpose: A job submitted to the command server is reported to its client by finishServerJob instead of with a notice.
+*/
+void reportBackgroundProcess(struct backgroundProcess* focusProcess, int status, struct rusage* usage) {
+    if (focusProcess->clientFd == -1) {
+        if (WIFEXITED(status)) {
+            printf("\nbackground pid %d is done: exit value %d\n", focusProcess->processID, WEXITSTATUS(status));
+        }
+        else {
+            printf("\nbackground pid %d is done: terminated by signal %d\n", focusProcess->processID, WTERMSIG(status));
+        }
+        fflush(stdout);
+    }
+
+    // Keep the statistics for jobs -l, taking over the command text
+    struct completedJob* job = &completedJobs[completedJobCount % COMPLETED_JOB_HISTORY];
+    if (completedJobCount >= COMPLETED_JOB_HISTORY) {
+        free(job->commandText);
+    }
+    memset(job, 0, sizeof(struct completedJob));
+    job->processID = focusProcess->processID;
+    job->status = status;
+    job->commandText = focusProcess->commandText != NULL ? focusProcess->commandText : strdup("");
+    focusProcess->commandText = NULL;
+    job->stats.wallNanoseconds = nowNanoseconds() - focusProcess->startTime;
+    addUsage(&job->stats, usage);
+    completedJobCount++;
+    if (focusProcess->clientFd != -1) {
+        finishServerJob(focusProcess, status, &job->stats);
+    }
+    removeBackgroundProcess(focusProcess);
+}
+
+/* CleanupBackgroundProcesses 
+*   Inputs: None
+*   Outputs: Number of finished background processes that were reported
+* 
+*   Purpose: To remove processes from the linked list of active processes once they have completed running. 
+* 
+*   Procedure:
+*   SIGCHLD is blocked in the shell and delivered through childSignalFd instead, so this function is called by readCommandLine as soon
+*   as a child exits (and once per command when the input can not be waited on). The queued signal records are drained first, since
+*   several exits can be merged into one. Then wait4(-1) with WNOHANG collects every child that has exited until none are left, so
+*   the cost depends on the number of exits rather than the number of running jobs. Each collected process is looked up in the list,
+*   the exit condition and value or signal recieved on exit is printed, and reportBackgroundProcess records its resource usage and takes
+*   it out of the linkedList. Processes that were stopped or continued by a signal are reported the same way (WUNTRACED, WCONTINUED)
+*   and only have their stopped flag changed.
+*/
+int cleanupBackgroundProcesses() {  
+    // Drain the pending SIGCHLD notifications, they only tell us that waitpid has work to do
+    struct signalfd_siginfo childInfo[16];
+    while (read(childSignalFd, childInfo, sizeof(childInfo)) > 0) {
+    }
+
+    int reported = 0;
+    int status;
+    struct rusage usage;
+    pid_t finishedPid;
+    while ((finishedPid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED, &usage)) > 0) {
+        struct backgroundProcess* focusProcess = findBackgroundProcess(finishedPid);
+        if (focusProcess == NULL) {
+            continue;
+        }
+        if (WIFCONTINUED(status)) {
+            setProcessStopped(focusProcess, 0);
+            continue;
+        }
+        if (WIFSTOPPED(status)) {
+            setProcessStopped(focusProcess, 1);
+            printf("\nbackground pid %d is stopped\n", finishedPid);
+            fflush(stdout);
+        }
+        else {
+            reportBackgroundProcess(focusProcess, status, &usage);
+        }
+        reported++;
+    }
+    return reported;
+}
+
+/* killRunningProcesses 
+*   Inputs: listHead  - Head Node of the background process linkedList
+*   Outputs: None
+* 
+*   Purpose: On exit, terminate/clean up all child processes in the process structure
+*   This function is called upon recieving the 'exit' command from the user, and will terminate all running child processes managed by the shell 
+*   as well as clear the linked list process structure before returning. The function first calls the cleanupBackgroundProcesses command to remove 
+*   and already completed processes, then will iterate throguh the process list issueing SIGTERM commands to each child process running in the background.
+*   After reaching the end of the list, the function will return
+*/
+void killRunningProcesses(struct backgroundProcess* listHead) {
+    // Take the process ID out of the background monitoring list, kill it and continue down the list of open processes until all are terminated 
+    cleanupBackgroundProcesses();
+    struct backgroundProcess* target = listHead->next;
+    while (target != NULL) {
+        kill(target->processID, SIGTERM);
+        // A stopped process only acts on the SIGTERM once it is continued
+        if (target->stopped) {
+            kill(target->processID, SIGCONT);
+        }
+        target = target->next;
+    }
+    return;
+}
+
+/* arenaAlloc - Allocate memory from an arena
+*   Inputs: arena - The arena to allocate from, size - Number of bytes needed
+*   Outputs: Pointer to the (uninitialized, 16 byte aligned) memory, valid until the arena is reset
+*
+*   Purpose: Everything parsed from one command line is allocated here, so handling a line costs a pointer increment per object
+*   instead of a malloc and free. When the current block is full a new one (at least ARENA_BLOCK_SIZE bytes) is chained in front.
+*/
+void* arenaAlloc(struct arena* arena, size_t size) {
+    size = (size + 15) & ~(size_t)15;
+    struct arenaBlock* block = arena->current;
+    if (block == NULL || block->used + size > block->size) {
+        // Reuse the next block kept from before the last reset, or chain a new one
+        if (block != NULL && block->next != NULL && block->next->size >= size) {
+            block = block->next;
+            block->used = 0;
+        }
+        else {
+            size_t blockSize = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+            struct arenaBlock* newBlock = malloc(sizeof(struct arenaBlock) + blockSize);
+            newBlock->size = blockSize;
+            newBlock->used = 0;
+            newBlock->next = block == NULL ? NULL : block->next;
+            if (block == NULL) {
+                arena->first = newBlock;
+            }
+            else {
+                block->next = newBlock;
+            }
+            block = newBlock;
+        }
+        arena->current = block;
+    }
+    void* memory = block->data + block->used;
+    block->used += size;
+    return memory;
+}
+
+/* arenaReset - Release everything allocated from an arena at once
+*   Inputs: arena - The arena to reset
+*   Outputs: None
+*
+*   Purpose: Called after every command. The blocks are kept for the next command, so a shell running a long script settles on
+*   a fixed amount of memory and stops calling malloc entirely.
+*/
+void arenaReset(struct arena* arena) {
+    arena->current = arena->first;
+    if (arena->first != NULL) {
+        arena->first->used = 0;
+    }
+}
+
+/* variableBucket - Hash chain of a variable name
+*   Inputs: name - Start of the name (need not be null terminated), length - Number of characters in the name
+*   Outputs: Pointer to the head of the chain in variableTable
+*/
+struct shellVariable** variableBucket(const char* name, size_t length) {
+    unsigned int hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619u;
+    }
+    return &variableTable[hash % VARIABLE_BUCKETS];
+}
+
+/* findVariable - Look up a shell variable
+*   Inputs: name - Start of the name (need not be null terminated), length - Number of characters in the name
+*   Outputs: Pointer to the variable, or NULL if it is not set
+*/
+struct shellVariable* findVariable(const char* name, size_t length) {
+    for (struct shellVariable* variable = *variableBucket(name, length); variable != NULL; variable = variable->next) {
+        if (strncmp(variable->name, name, length) == 0 && variable->name[length] == '\0') {
+            return variable;
+        }
+    }
+    return NULL;
+}
+
+/* getVariable - Read a shell variable
+*   Inputs: name - Variable name
+*   Outputs: The value, or NULL if the variable is not set
+*/
+char* getVariable(const char* name) {
+    struct shellVariable* variable = findVariable(name, strlen(name));
+    return variable != NULL ? variable->value : NULL;
+}
+
+/* invalidateEnvironment - Drop the environment built for child processes, so the next launch builds it again
+*   Inputs: None
+*   Outputs: None
+*/
+void invalidateEnvironment() {
+    free(exportedEnvironment);
+    exportedEnvironment = NULL;
+}
+
+/* setVariable - Create or change a shell variable
+*   Inputs: name  - Variable name
+*           value - New value (copied), or NULL to only change the export flag of an existing variable
+*           exported - 1 to export the variable, 0 to leave its export flag as it is
+*   Outputs: Pointer to the variable
+*
+*   Purpose: Shell variables are kept in a hash table of VARIABLE_BUCKETS chains. The environment of child processes is only
+*   thrown away when an exported variable changes.
+*/
+struct shellVariable* setVariable(const char* name, const char* value, int exported) {
+    struct shellVariable* variable = findVariable(name, strlen(name));
+    if (variable == NULL) {
+        struct shellVariable** bucket = variableBucket(name, strlen(name));
+        variable = malloc(sizeof(struct shellVariable));
+        variable->name = strdup(name);
+        variable->value = strdup("");
+        variable->exported = 0;
+        variable->next = *bucket;
+        *bucket = variable;
+        variableCount++;
+    }
+    if (value != NULL) {
+        free(variable->value);
+        variable->value = strdup(value);
+    }
+    if (exported) {
+        variable->exported = 1;
+    }
+    if (variable->exported) {
+        invalidateEnvironment();
+    }
+    return variable;
+}
+
+/* unsetVariable - Remove a shell variable
+*   Inputs: name - Variable name
+*   Outputs: None
+*/
+void unsetVariable(const char* name) {
+    struct shellVariable** link = variableBucket(name, strlen(name));
+    while (*link != NULL && strcmp((*link)->name, name) != 0) {
+        link = &(*link)->next;
+    }
+    struct shellVariable* variable = *link;
+    if (variable == NULL) {
+        return;
+    }
+    *link = variable->next;
+    if (variable->exported) {
+        invalidateEnvironment();
+    }
+    free(variable->name);
+    free(variable->value);
+    free(variable);
+    variableCount--;
+}
+
+/* childEnvironment - The environment for new child processes
+*   Inputs: None
+*   Outputs: Null terminated array of NAME=VALUE strings for every exported variable
+*
+*   Purpose: The array is built on the first launch after an exported variable changed and then reused by every launch until the
+*   next change, so running commands costs nothing for the environment. The array and its strings are one allocation.
+*/
+char** childEnvironment() {
+    if (exportedEnvironment != NULL) {
+        return exportedEnvironment;
+    }
+    size_t textSize = 0;
+    int exportedCount = 0;
+    for (int bucket = 0; bucket < VARIABLE_BUCKETS; bucket++) {
+        for (struct shellVariable* variable = variableTable[bucket]; variable != NULL; variable = variable->next) {
+            if (variable->exported) {
+                textSize += strlen(variable->name) + strlen(variable->value) + 2;
+                exportedCount++;
+            }
+        }
+    }
+    exportedEnvironment = malloc((exportedCount + 1) * sizeof(char*) + textSize);
+    char* text = (char*)(exportedEnvironment + exportedCount + 1);
+    int index = 0;
+    for (int bucket = 0; bucket < VARIABLE_BUCKETS; bucket++) {
+        for (struct shellVariable* variable = variableTable[bucket]; variable != NULL; variable = variable->next) {
+            if (variable->exported) {
+                exportedEnvironment[index++] = text;
+                text += sprintf(text, "%s=%s", variable->name, variable->value) + 1;
+            }
+        }
+    }
+    exportedEnvironment[index] = NULL;
+    return exportedEnvironment;
+}
+
+/* importEnvironment - Load the shell's own environment into the variable table as exported variables
+*   Inputs: None
+*   Outputs: None
+*/
+void importEnvironment() {
+    for (char** entry = environ; *entry != NULL; entry++) {
+        char* separator = strchr(*entry, '=');
+        if (separator == NULL) {
+            continue;
+        }
+        char* name = strndup(*entry, separator - *entry);
+        setVariable(name, separator + 1, 1);
+        free(name);
+    }
+}
+
+/* appendExpanded - Add text to expandBuffer, where expandVariables builds words and readHereDocuments collects bodies
+*   Inputs: used - Number of bytes already in expandBuffer (advanced past the new text), text - Text to add, length - Its length
+*   Outputs: None
+*/
+void appendExpanded(size_t* used, const char* text, size_t length) {
+    if (*used + length + 1 > expandBufferSize) {
+        expandBufferSize = (*used + length + 1) * 2;
+        expandBuffer = realloc(expandBuffer, expandBufferSize);
+    }
+    memcpy(expandBuffer + *used, text, length);
+    *used += length;
+}
+
+// Command substitution runs whole commands, which are expanded in turn, so it is declared ahead of expandVariables
+char* captureCommand(struct arena* arena, char* commandText, size_t* length);
+
+/* expandVariables - Expand the variables and special parameters in a word
+*   Inputs: arena - Arena to allocate the expanded word from, word - The word as it was typed
+*   Outputs: Character array pointer for the expanded word
+*
+*   Purpose: 
+*   The lexer marks words containing a $ with WORD_EXPAND, and only those are passed through this function before the command runs.
+*   
+*   Procedure
+*   The word is scanned once, copying the text between $ signs into expandBuffer and replacing each expansion as it is reached: $$ by
+*   the PID of the shell (formatted once when the shell starts), $? by the exit value of the last foreground command, $! by the PID of
+*   the last background job, $NAME or ${NAME} by the variable's value (nothing if it is not set) and $(COMMAND) by the output of the
+*   command (see captureCommand). A $ that starts none of these is kept as it is. The finished word is then copied into the arena at
+*   its exact length.
+*/
+char* expandVariables(struct arena* arena, char* word) {
+    size_t used = 0;
+    char* cursor = word;
+    while (*cursor != '\0') {
+        char* dollar = strchr(cursor, '$');
+        if (dollar == NULL) {
+            appendExpanded(&used, cursor, strlen(cursor));
+            break;
+        }
+        appendExpanded(&used, cursor, dollar - cursor);
+        char* next = dollar + 1;
+        char number[24];
+        if (*next == '$') {
+            appendExpanded(&used, shellPidText, shellPidLength);
+            cursor = next + 1;
+        }
+        else if (*next == '(') {
+            // Find the matching parenthesis, an unclosed substitution runs to the end of the word
+            int depth = 1;
+            char* commandEnd = next + 1;
+            while (*commandEnd != '\0' && (depth > 1 || *commandEnd != ')')) {
+                depth += (*commandEnd == '(') - (*commandEnd == ')');
+                commandEnd++;
+            }
+            char* commandText = arenaAlloc(arena, commandEnd - next);
+            memcpy(commandText, next + 1, commandEnd - next - 1);
+            commandText[commandEnd - next - 1] = '\0';
+
+            // The command's own expansions reuse expandBuffer, so the word so far is set aside while it runs
+            char* partial = arenaAlloc(arena, used + 1);
+            size_t partialLength = used;
+            if (used > 0) {
+                memcpy(partial, expandBuffer, used);
+            }
+            size_t outputLength;
+            char* output = captureCommand(arena, commandText, &outputLength);
+            used = 0;
+            appendExpanded(&used, partial, partialLength);
+            appendExpanded(&used, output, outputLength);
+            cursor = *commandEnd == ')' ? commandEnd + 1 : commandEnd;
+        }
+        else if (*next == '?') {
+            appendExpanded(&used, number, sprintf(number, "%d", lastExitValue));
+            cursor = next + 1;
+        }
+        else if (*next == '!') {
+            if (lastBackgroundPid > 0) {
+                appendExpanded(&used, number, sprintf(number, "%d", lastBackgroundPid));
+            }
+            cursor = next + 1;
+        }
+        else {
+            // A name starts with a letter or underscore, ${NAME} needs its closing brace
+            int braced = (*next == '{');
+            char* name = braced ? next + 1 : next;
+            char* nameEnd = name;
+            if (isalpha((unsigned char)*name) || *name == '_') {
+                while (isalnum((unsigned char)*nameEnd) || *nameEnd == '_') {
+                    nameEnd++;
+                }
+            }
+            if (nameEnd == name || (braced && *nameEnd != '}')) {
+                appendExpanded(&used, "$", 1);
+                cursor = next;
+                continue;
+            }
+            struct shellVariable* variable = findVariable(name, nameEnd - name);
+            if (variable != NULL) {
+                appendExpanded(&used, variable->value, strlen(variable->value));
+            }
+            cursor = braced ? nameEnd + 1 : nameEnd;
+        }
+    }
+    char* expanded = arenaAlloc(arena, used + 1);
+    memcpy(expanded, expandBuffer, used);
+    expanded[used] = '\0';
+    return expanded;
+}
+
+/* compareNames - qsort comparison for directory entry names
+*   Inputs: first, second - Pointers to the two name pointers
+*   Outputs: Negative, zero or positive like strcmp
+*/
+int compareNames(const void* first, const void* second) {
+    return strcmp(*(char* const*)first, *(char* const*)second);
+}
+
+/* listDirectory - Get the sorted names in a directory, from the directory cache when it is still current
+*   Inputs: path - The directory, relative to the shell's working directory ("" for the working directory itself)
+*   Outputs: The listing, valid until the next call, or NULL if the directory can't be read
+*
+*   Purpose: Globbing the same large directory again (a *.log over a directory of log files, or a loop) must not read it again.
+*
+*   Procedure:
+*   The directory is opened and fstat'ed. A cached listing with the same device and inode is used as long as the modification time
+*   hasn't changed, which it does whenever an entry is added, removed or renamed, and the listing was trusted when it was made.
+*   Otherwise the least recently used slot is refilled: getdents64 reads the entries GETDENTS_BUFFER bytes per system call, the
+*   names (without . and ..) are packed into one block, and the pointers to them are sorted once so every glob over the listing
+*   produces its matches in order.
+*/
+struct directoryListing* listDirectory(char* path) {
+    int directoryFd = openat(workingDirectoryFd, *path != '\0' ? path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (directoryFd == -1) {
+        return NULL;
+    }
+    struct stat directoryStat;
+    fstat(directoryFd, &directoryStat);
+    struct directoryListing* listing = NULL;
+    for (int i = 0; i < DIRECTORY_CACHE_SLOTS; i++) {
+        struct directoryListing* slot = &directoryCache[i];
+        if (slot->names != NULL && slot->device == directoryStat.st_dev && slot->inode == directoryStat.st_ino) {
+            listing = slot;
+            break;
+        }
+        if (listing == NULL || slot->lastUsed < listing->lastUsed) {
+            listing = slot;
+        }
+    }
+    listing->lastUsed = ++directoryCacheClock;
+    if (listing->names != NULL && listing->device == directoryStat.st_dev && listing->inode == directoryStat.st_ino &&
+        listing->trusted && listing->modified.tv_sec == directoryStat.st_mtim.tv_sec &&
+        listing->modified.tv_nsec == directoryStat.st_mtim.tv_nsec) {
+        close(directoryFd);
+        return listing;
+    }
+
+    // Read the whole directory into one block of names
+    free(listing->names);
+    free(listing->entries);
+    if (getdentsBuffer == NULL) {
+        getdentsBuffer = malloc(GETDENTS_BUFFER);
+    }
+    size_t capacity = 4096;
+    size_t used = 0;
+    int count = 0;
+    char* names = malloc(capacity);
+    ssize_t bytesRead;
+    while ((bytesRead = getdents64(directoryFd, getdentsBuffer, GETDENTS_BUFFER)) > 0) {
+        for (ssize_t offset = 0; offset < bytesRead; ) {
+            struct dirent64* entry = (struct dirent64*)(getdentsBuffer + offset);
+            offset += entry->d_reclen;
+            char* name = entry->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+                continue;
+            }
+            size_t length = strlen(name) + 1;
+            if (used + length > capacity) {
+                capacity = capacity * 2 + length;
+                names = realloc(names, capacity);
+            }
+            memcpy(names + used, name, length);
+            used += length;
+            count++;
+        }
+    }
+    close(directoryFd);
+
+    char** entries = malloc((count + 1) * sizeof(char*));
+    char* name = names;
+    for (int i = 0; i < count; i++) {
+        entries[i] = name;
+        name += strlen(name) + 1;
+    }
+    qsort(entries, count, sizeof(char*), compareNames);
+
+    // A change made in the same second as the read might leave the modification time as it was, so such a listing is used once
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    listing->device = directoryStat.st_dev;
+    listing->inode = directoryStat.st_ino;
+    listing->modified = directoryStat.st_mtim;
+    listing->trusted = directoryStat.st_mtim.tv_sec < now.tv_sec - 1;
+    listing->names = names;
+    listing->entries = entries;
+    listing->count = count;
+    return listing;
+}
+
+/* matchBracket - Match one character against a [...] expression
+*   Inputs: pattern - Points at the [, character - The character to match
+*           end     - Receives the position after the closing ], or NULL if there is none (the [ is then an ordinary character)
+*   Outputs: Integer representing a boolean value, 1 if the character is in the set
+*/
+int matchBracket(const char* pattern, char character, const char** end) {
+    const char* cursor = pattern + 1;
+    int negated = (*cursor == '!' || *cursor == '^');
+    if (negated) {
+        cursor++;
+    }
+    int matched = 0;
+    // A ] right after the [ (or [!) is part of the set
+    const char* first = cursor;
+    while (*cursor != '\0' && (*cursor != ']' || cursor == first)) {
+        if (cursor[1] == '-' && cursor[2] != ']' && cursor[2] != '\0') {
+            matched |= ((unsigned char)character >= (unsigned char)cursor[0] && (unsigned char)character <= (unsigned char)cursor[2]);
+            cursor += 3;
+        }
+        else {
+            matched |= (character == *cursor);
+            cursor++;
+        }
+    }
+    if (*cursor != ']') {
+        *end = NULL;
+        return character == '[';
+    }
+    *end = cursor + 1;
+    return matched != negated;
+}
+
+/* matchPattern - Match a name against one glob pattern component
+*   Inputs: pattern - The pattern, with *, ? and [...], name - The name to test
+*   Outputs: Integer representing a boolean value, 1 if the whole name matches
+*
+*   Purpose: The matcher never backtracks more than one step: when a character fails after a *, only the most recent * is retried
+*   one character further along the name, since an earlier * can't match anything the latest one can't. The cost is therefore at
+*   most the product of the two lengths, whatever the pattern. Names starting with a dot are only matched by patterns that do too.
+*/
+int matchPattern(const char* pattern, const char* name) {
+    if (name[0] == '.' && pattern[0] != '.') {
+        return 0;
+    }
+    const char* starPattern = NULL;
+    const char* starName = NULL;
+    while (*name != '\0') {
+        if (*pattern == '*') {
+            pattern++;
+            starPattern = pattern;
+            starName = name;
+            continue;
+        }
+        const char* next = pattern + 1;
+        int matched;
+        if (*pattern == '?') {
+            matched = 1;
+        }
+        else if (*pattern == '[') {
+            matched = matchBracket(pattern, *name, &next);
+            if (next == NULL) {
+                next = pattern + 1;
+            }
+        }
+        else {
+            matched = (*pattern == *name && *pattern != '\0');
+        }
+        if (matched) {
+            pattern = next;
+            name++;
+        }
+        else if (starPattern != NULL) {
+            pattern = starPattern;
+            name = ++starName;
+        }
+        else {
+            return 0;
+        }
+    }
+    while (*pattern == '*') {
+        pattern++;
+    }
+    return *pattern == '\0';
+}
+
+/* hasGlobCharacters - Check whether part of a pattern needs matching
+*   Inputs: text - The text, length - Number of bytes to check
+*   Outputs: Integer representing a boolean value, 1 if it contains *, ? or [
+*/
+int hasGlobCharacters(const char* text, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        if (text[i] == '*' || text[i] == '?' || text[i] == '[') {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* globPath - Expand the rest of a glob pattern below one directory
+*   Inputs: arena     - Arena for the paths and the result array
+*           directory - The path matched so far, ending in / unless it is "" (the working directory)
+*           pattern   - The remaining pattern components
+*           results   - The result array, grown as needed
+*           count     - Number of results so far, updated
+*           capacity  - Size of the result array, updated
+*   Outputs: None
+*
+*   Purpose: The pattern is matched one component at a time. Components without wildcards are appended as they are, and the
+*   others are matched against the cached listing of the directory. The matches are copied out before going deeper, since reading
+*   the subdirectories may replace the listing in the cache. A pattern ending in / only matches directories.
+*/
+void globPath(struct arena* arena, char* directory, char* pattern, char*** results, int* count, int* capacity) {
+    char* slash = strchr(pattern, '/');
+    size_t componentLength = slash != NULL ? (size_t)(slash - pattern) : strlen(pattern);
+    size_t directoryLength = strlen(directory);
+    int matchCount = 0;
+    char** matches;
+
+    if (hasGlobCharacters(pattern, componentLength) == 0) {
+        matches = arenaAlloc(arena, sizeof(char*));
+        matches[0] = arenaAlloc(arena, directoryLength + componentLength + 2);
+        memcpy(matches[0], directory, directoryLength);
+        memcpy(matches[0] + directoryLength, pattern, componentLength);
+        matches[0][directoryLength + componentLength] = '\0';
+        matchCount = 1;
+    }
+    else {
+        struct directoryListing* listing = listDirectory(directory);
+        if (listing == NULL) {
+            return;
+        }
+        char* component = arenaAlloc(arena, componentLength + 1);
+        memcpy(component, pattern, componentLength);
+        component[componentLength] = '\0';
+        matches = arenaAlloc(arena, (listing->count + 1) * sizeof(char*));
+        for (int i = 0; i < listing->count; i++) {
+            if (matchPattern(component, listing->entries[i])) {
+                size_t nameLength = strlen(listing->entries[i]);
+                char* path = arenaAlloc(arena, directoryLength + nameLength + 2);
+                memcpy(path, directory, directoryLength);
+                memcpy(path + directoryLength, listing->entries[i], nameLength + 1);
+                matches[matchCount++] = path;
+            }
+        }
+    }
+
+    for (int i = 0; i < matchCount; i++) {
+        struct stat matchStat;
+        char* path = matches[i];
+        if (slash == NULL) {
+            // The last component has to name something that exists (a listed name always does)
+            if (hasGlobCharacters(pattern, componentLength) == 0 && fstatat(workingDirectoryFd, path, &matchStat, AT_SYMLINK_NOFOLLOW) == -1) {
+                continue;
+            }
+        }
+        else if (slash[1] != '\0') {
+            strcat(path, "/");
+            globPath(arena, path, slash + 1, results, count, capacity);
+            continue;
+        }
+        else {
+            if (fstatat(workingDirectoryFd, path, &matchStat, 0) == -1 || S_ISDIR(matchStat.st_mode) == 0) {
+                continue;
+            }
+            strcat(path, "/");
+        }
+        if (*count == *capacity) {
+            *capacity *= 2;
+            char** grown = arenaAlloc(arena, *capacity * sizeof(char*));
+            memcpy(grown, *results, *count * sizeof(char*));
+            *results = grown;
+        }
+        (*results)[(*count)++] = path;
+    }
+}
+
+/* expandArguments - Produce the final argument array of one pipeline stage
+*   Inputs: arena - Arena for the expanded words, stageCommand - The parsed stage
+*   Outputs: Null terminated argument array, ready for exec
+*
+*   Purpose: Stages without any $ or wildcard are used exactly as parsed. Otherwise a new array is built with the marked words
+*   expanded, and each word marked WORD_GLOB replaced by the paths it matches (in sorted order), or kept as it is if it matches
+*   nothing. The array starts with room for every word and doubles when globs produce more.
+*/
+char** expandArguments(struct arena* arena, struct simpleCommand* stageCommand) {
+    if (stageCommand->expandCount == 0) {
+        return stageCommand->argv;
+    }
+    int capacity = stageCommand->argc + 1;
+    int count = 0;
+    char** args = arenaAlloc(arena, capacity * sizeof(char*));
+    for (int i = 0; i < stageCommand->argc; i++) {
+        char* word = (stageCommand->argFlags[i] & WORD_EXPAND) ? expandVariables(arena, stageCommand->argv[i]) : stageCommand->argv[i];
+        int before = count;
+        if (stageCommand->argFlags[i] & WORD_GLOB) {
+            if (word[0] == '/') {
+                globPath(arena, "/", word + 1, &args, &count, &capacity);
+            }
+            else {
+                globPath(arena, "", word, &args, &count, &capacity);
+            }
+        }
+        if (count == before) {
+            if (count == capacity) {
+                capacity *= 2;
+                char** grown = arenaAlloc(arena, capacity * sizeof(char*));
+                memcpy(grown, args, count * sizeof(char*));
+                args = grown;
+            }
+            args[count++] = word;
+        }
+    }
+    if (count == capacity) {
+        char** grown = arenaAlloc(arena, (capacity + 1) * sizeof(char*));
+        memcpy(grown, args, count * sizeof(char*));
+        args = grown;
+    }
+    args[count] = NULL;
+    return args;
+}
+
+/* newStage - Create an empty pipeline stage whose words start at the given slot of the line's word array
+*   Inputs: arena - Arena to allocate from, words/flags - The word and flag arrays for the whole line, slot - First free slot
+*   Outputs: Pointer to the zeroed stage
+*/
+struct simpleCommand* newStage(struct arena* arena, char** words, int* flags, int slot) {
+    struct simpleCommand* stageCommand = arenaAlloc(arena, sizeof(struct simpleCommand));
+    memset(stageCommand, 0, sizeof(struct simpleCommand));
+    stageCommand->argv = words + slot;
+    stageCommand->argFlags = flags + slot;
+    return stageCommand;
+}
+
+/* parseRedirectOperator - Recognise a redirection operator at the start of a word
+*   Inputs: word    - The word to check
+*           fd      - Receives the descriptor being redirected
+*           type    - Receives the REDIRECT_ type
+*           operand - Receives the rest of the word after the operator (empty when the target is the next word)
+*   Outputs: 1 if the word starts with a redirection operator, 0 if it is an ordinary word
+*
+*   Purpose: The operators are < > >> (optionally after a descriptor number 0 to 9, as in 2> or 3<), <& and >& with a descriptor
+*   number or - as the target (2>&1, 0<&3, 2>&-), and &> and &>> which send both stdout and stderr to a file.
+*/
+int parseRedirectOperator(char* word, int* fd, int* type, char** operand) {
+    // The descriptor is a single digit, so descriptors from 10 up stay free for the shell's own use (see runBuiltin)
+    char* cursor = word;
+    int number = -1;
+    if (word[0] == '&' && word[1] == '>') {
+        *fd = 1;
+        *type = word[2] == '>' ? REDIRECT_BOTH_APPEND : REDIRECT_BOTH;
+        *operand = word + (word[2] == '>' ? 3 : 2);
+        return 1;
+    }
+    if (isdigit((unsigned char)*cursor)) {
+        number = *cursor - '0';
+        cursor++;
+    }
+    if (*cursor == '<' && cursor[1] != '<') {
+        *fd = number != -1 ? number : 0;
+        *type = cursor[1] == '&' ? REDIRECT_DUPLICATE : REDIRECT_INPUT;
+        *operand = cursor + (cursor[1] == '&' ? 2 : 1);
+        return 1;
+    }
+    if (*cursor == '>') {
+        *fd = number != -1 ? number : 1;
+        *type = cursor[1] == '>' ? REDIRECT_APPEND : (cursor[1] == '&' ? REDIRECT_DUPLICATE : REDIRECT_OUTPUT);
+        *operand = cursor + (cursor[1] == '>' || cursor[1] == '&' ? 2 : 1);
+        return 1;
+    }
+    return 0;
+}
+
+/* parseCommandLine - Parse one line of input into a command structure
+*   Inputs: arena - Arena holding everything the parse creates (reset by the caller after the command has run)
+*           line  - The line of user input
+*   Outputs: Pointer to the parsed command (with stageCount 0 for a blank line or comment), or NULL after reporting a syntax error
+*
+*   Purpose: A single pass over the line finds every word, redirection, pipe and the background &, replacing the separate strtok_r
+*   passes (and copies of the line) that checking for &, redirecting, splitting the pipeline and building argv used to make.
+*
+*   Procedure:
+*   The line is copied into the arena once and split in place on spaces and tabs (except inside $( )). While a word is scanned, a $
+*   marks it for expansion.
+*   Every word is then classified: a first word starting with # makes the line a comment, a redirection operator (see
+*   parseRedirectOperator) takes the rest of the word or the following word as its target, <<DELIMITER and <<<WORD (or with the
+*   operand as the next word) add a here-document or here-string, a | closes the current stage and starts the next, and a solitary & is dropped but sets the background flag when
+*   it is the last word. Any other word is an argument. All the argument pointers of the line share one array, sized for the largest
+*   possible number of words, and each stage's argv is a NULL terminated slice of it, so no per-word or per-stage arrays are needed.
+*/
+struct commandLine* parseCommandLine(struct arena* arena, char* line) {
+    // Copy the line and allocate the word slots (every word and separator takes at least two characters)
+    int lineLength = strlen(line);
+    char* text = arenaAlloc(arena, lineLength + 1);
+    memcpy(text, line, lineLength + 1);
+    int slotCount = lineLength / 2 + 3;
+    char** words = arenaAlloc(arena, slotCount * sizeof(char*));
+    int* flags = arenaAlloc(arena, slotCount * sizeof(int));
+
+    struct commandLine* command = arenaAlloc(arena, sizeof(struct commandLine));
+    memset(command, 0, sizeof(struct commandLine));
+    struct simpleCommand* stageCommand = newStage(arena, words, flags, 0);
+    command->stages = stageCommand;
+    command->stageCount = 1;
+    struct redirection** redirectTail = &stageCommand->redirections;
+    struct redirection* pendingRedirect = NULL;
+    int slot = 0;
+    int wordCount = 0;
+
+    char* position = text;
+    while (1) {
+        // Find the next word and terminate it in place, noting whether it needs expansion
+        while (*position == ' ' || *position == '\t') {
+            position++;
+        }
+        if (*position == '\0') {
+            break;
+        }
+        // Spaces inside a $( ) command substitution belong to the word
+        char* word = position;
+        int wordFlags = 0;
+        int substitutionDepth = 0;
+        while (*position != '\0' && ((*position != ' ' && *position != '\t') || substitutionDepth > 0)) {
+            if (*position == '$') {
+                wordFlags |= WORD_EXPAND;
+                if (position[1] == '(') {
+                    substitutionDepth++;
+                    position++;
+                }
+                // $? is a parameter, not a pattern
+                else if (position[1] == '?') {
+                    position++;
+                }
+            }
+            else if ((*position == '*' || *position == '?') && substitutionDepth == 0) {
+                wordFlags |= WORD_GLOB;
+            }
+            // A [ only starts a pattern when the same word closes a non-empty set, so [ and test's ] stay plain words
+            else if (*position == '[' && substitutionDepth == 0 && position[1] != '\0') {
+                size_t rest = strcspn(position + 2, " \t");
+                if (memchr(position + 2, ']', rest) != NULL) {
+                    wordFlags |= WORD_GLOB;
+                }
+            }
+            else if (*position == '(' && substitutionDepth > 0) {
+                substitutionDepth++;
+            }
+            else if (*position == ')' && substitutionDepth > 0) {
+                substitutionDepth--;
+            }
+            position++;
+        }
+        if (*position != '\0') {
+            *position = '\0';
+            position++;
+        }
+        wordCount++;
+
+        // A comment line (first character #) is not run
+        if (wordCount == 1 && word[0] == '#') {
+            command->stageCount = 0;
+            return command;
+        }
+        command->background = 0;
+
+        // The word after a < or > is the file to redirect to
+        if (pendingRedirect != NULL) {
+            pendingRedirect->target = word;
+            pendingRedirect->targetFlags = wordFlags;
+            pendingRedirect = NULL;
+            continue;
+        }
+        if (word[0] == '<' && word[1] == '<') {
+            // The delimiter or string can be attached to the operator or be the next word
+            int hereString = (word[2] == '<');
+            char* operand = word + (hereString ? 3 : 2);
+            pendingRedirect = arenaAlloc(arena, sizeof(struct redirection));
+            pendingRedirect->type = hereString ? REDIRECT_HERESTRING : REDIRECT_HEREDOC;
+            pendingRedirect->fd = 0;
+            pendingRedirect->next = NULL;
+            *redirectTail = pendingRedirect;
+            redirectTail = &pendingRedirect->next;
+            if (hereString == 0) {
+                command->hereDocuments++;
+            }
+            if (*operand != '\0') {
+                pendingRedirect->target = operand;
+                pendingRedirect->targetFlags = wordFlags;
+                pendingRedirect = NULL;
+            }
+            continue;
+        }
+        int redirectFd;
+        int redirectType;
+        char* operand;
+        if (parseRedirectOperator(word, &redirectFd, &redirectType, &operand)) {
+            pendingRedirect = arenaAlloc(arena, sizeof(struct redirection));
+            pendingRedirect->type = redirectType;
+            pendingRedirect->fd = redirectFd;
+            pendingRedirect->next = NULL;
+            *redirectTail = pendingRedirect;
+            redirectTail = &pendingRedirect->next;
+            if (*operand != '\0') {
+                pendingRedirect->target = operand;
+                pendingRedirect->targetFlags = wordFlags;
+                pendingRedirect = NULL;
+            }
+            continue;
+        }
+        if (word[0] == '|' && word[1] == '\0') {
+            if (stageCommand->argc == 0) {
+                printf("syntax error near unexpected token |\n");
+                fflush(stdout);
+                return NULL;
+            }
+            words[slot] = NULL;
+            slot++;
+            stageCommand->next = newStage(arena, words, flags, slot);
+            stageCommand = stageCommand->next;
+            redirectTail = &stageCommand->redirections;
+            command->stageCount++;
+            continue;
+        }
+        if (word[0] == '&' && word[1] == '\0') {
+            command->background = 1;
+            continue;
+        }
+        words[slot] = word;
+        flags[slot] = wordFlags;
+        if (wordFlags != 0) {
+            stageCommand->expandCount++;
+        }
+        slot++;
+        stageCommand->argc++;
+    }
+    words[slot] = NULL;
+
+    // Report operators left without their operand
+    if (pendingRedirect != NULL) {
+        printf("syntax error near unexpected token newline\n");
+        fflush(stdout);
+        return NULL;
+    }
+    if (stageCommand->argc == 0 && command->stageCount > 1) {
+        printf("syntax error near unexpected token |\n");
+        fflush(stdout);
+        return NULL;
+    }
+    if (stageCommand->argc == 0 && stageCommand->redirections == NULL) {
+        command->stageCount = 0;
+    }
+
+    // A leading time word is taken off here, once, so a command in a loop body is measured on every run
+    struct simpleCommand* firstStage = command->stages;
+    if (firstStage->argc > 1 && strcmp(firstStage->argv[0], "time") == 0) {
+        command->timed = 1;
+        firstStage->argv++;
+        firstStage->argFlags++;
+        firstStage->argc--;
+        if (firstStage->argFlags[-1] != 0) {
+            firstStage->expandCount--;
+        }
+    }
+    return command;
+}
+
+/* openInlineInput - Make a readable descriptor holding a here-document or here-string
+*   Inputs: text - The body or string, addNewline - 1 to end the input with a newline (here-strings)
+*   Outputs: Close on exec descriptor positioned at the start of the text, or -1 on failure
+*
+*   Purpose: Small inputs are written into a pipe, whose buffer always holds INLINE_PIPE_LIMIT bytes so the write can't block, and
+*   the write end is closed so the reader sees end of file after the text. Larger inputs go into an anonymous memfd_create file,
+*   which is rewound before it is returned.
+*/
+int openInlineInput(char* text, int addNewline) {
+    size_t length = strlen(text);
+    if (length + addNewline <= INLINE_PIPE_LIMIT) {
+        int inlinePipe[2];
+        if (pipe2(inlinePipe, O_CLOEXEC) == -1) {
+            return -1;
+        }
+        if (writeAll(inlinePipe[1], text, length) == -1 || (addNewline && writeAll(inlinePipe[1], "\n", 1) == -1)) {
+            close(inlinePipe[0]);
+            inlinePipe[0] = -1;
+        }
+        close(inlinePipe[1]);
+        return inlinePipe[0];
+    }
+    int memoryFile = memfd_create("here-document", MFD_CLOEXEC);
+    if (memoryFile == -1) {
+        return -1;
+    }
+    if (writeAll(memoryFile, text, length) == -1 || (addNewline && writeAll(memoryFile, "\n", 1) == -1)
+        || lseek(memoryFile, 0, SEEK_SET) == -1) {
+        close(memoryFile);
+        return -1;
+    }
+    return memoryFile;
+}
+
+/* addFdAction - Append a descriptor action to a stage (redirectIO makes sure there is room)
+*   Inputs: stage - The launch description, target - Descriptor to set, source - Descriptor to copy into it, or -1 to close it
+*   Outputs: None
+*/
+void addFdAction(struct stageLaunch* stage, int target, int source) {
+    stage->fdActions[stage->fdActionCount].target = target;
+    stage->fdActions[stage->fdActionCount].source = source;
+    stage->fdActionCount++;
+}
+
+/* applyFdActions - Move a stage's descriptors into place in its child process
+*   Inputs: stage - The launch description
+*   Outputs: None
+*
+*   Purpose: Used by forked and vforked children, so it only makes system calls. The pipe ends become stdin and stdout first, then
+*   the redirections are applied in order, so 2>&1 copies whatever stdout is at that point.
+*/
+void applyFdActions(struct stageLaunch* stage) {
+    if (stage->inFd != -1) {
+        dup2(stage->inFd, 0);
+    }
+    if (stage->outFd != -1) {
+        dup2(stage->outFd, 1);
+    }
+    for (int i = 0; i < stage->fdActionCount; i++) {
+        if (stage->fdActions[i].source == -1) {
+            close(stage->fdActions[i].target);
+        }
+        else {
+            dup2(stage->fdActions[i].source, stage->fdActions[i].target);
+        }
+    }
+}
+
+/* closeOpenedFds - Close the files the shell opened for a stage's redirections, once its child has them
+*   Inputs: stage - The launch description
+*   Outputs: None
+*/
+void closeOpenedFds(struct stageLaunch* stage) {
+    for (int i = 0; i < stage->openedCount; i++) {
+        close(stage->openedFds[i]);
+    }
+    stage->openedCount = 0;
+}
+
+/* refreshWorkingDirectory - Reopen the cached working directory descriptor
+*   Inputs: None
+*   Outputs: None
+*
+*   Purpose: Called at startup and after every successful cd. If the directory can't be opened the descriptor falls back to
+*   AT_FDCWD, which openat treats as the current directory.
+*/
+void refreshWorkingDirectory() {
+    if (workingDirectoryFd != AT_FDCWD) {
+        close(workingDirectoryFd);
+    }
+    workingDirectoryFd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (workingDirectoryFd == -1) {
+        workingDirectoryFd = AT_FDCWD;
+    }
+}
+
+/* openRedirectTarget - Open the file of a redirection
+*   Inputs: path - The expanded target, flags - open flags, which O_CLOEXEC is added to
+*   Outputs: The descriptor, or -1 on failure
+*
+*   Purpose: Relative paths are opened against the cached working directory descriptor with openat, so the kernel resolves them
+*   from the directory directly and the path length is only limited by the kernel.
+*/
+int openRedirectTarget(char* path, int flags) {
+    return openat(workingDirectoryFd, path, flags | O_CLOEXEC, 0777);
+}
+
+/* sharedDevNull - The shell's /dev/null descriptor, opened the first time it is needed
+*   Inputs: None
+*   Outputs: A close on exec descriptor for /dev/null, open for reading and writing
+*/
+int sharedDevNull() {
+    if (devNullFd == -1) {
+        devNullFd = open("/dev/null", O_RDWR | O_CLOEXEC);
+    }
+    return devNullFd;
+}
+
+/* redirectIO
+*   Inputs:     arena        - Arena for expanding the redirection targets
+*               stageCommand - The parsed pipeline stage, whose redirections are opened
+*               nullInput    - integer value for whether stdin should default to /dev/null (1) when it isn't redirected (0 to leave it alone)
+*               nullOutput   - integer value for whether stdout should default to /dev/null (1) when it isn't redirected (0 to leave it alone)
+*               stage        - Launch description for the command, which receives the descriptor actions and opened files
+*   Outputs:    Integer value for the success of the file redirection, with 0 for success and -1 for failure. 
+*
+*   Purpose: Open the files for the redirections when requested, and set background process I/O to dev/null if no redirect is specified.
+*   The files are opened by the shell before the child is created, so the launch engine only has to move the descriptors into place.
+*   Stages in the middle of a pipeline already have their streams connected to pipes, so the caller decides which ends get the /dev/null default
+* 
+*   Procedure:
+*   This function walks the redirections the lexer recorded for the stage, in the order they were typed, and turns each into entries of
+*   the stage's fdActions table. Each target is expanded if it contains a $. Files are opened (close on exec, so only the dup2'd copy
+*   reaches the program) with openRedirectTarget: < for reading, > truncating, >> appending, and &> / &>> for stdout with stderr made a
+*   copy of it. N<&M and N>&M copy descriptor M, or close N when M is -. Here-document bodies and here-strings are handed to
+*   openInlineInput instead, so inline input never touches the filesystem. The /dev/null default is the shell's shared descriptor.
+*/
+int redirectIO(struct arena* arena, struct simpleCommand* stageCommand, int nullInput, int nullOutput, struct stageLaunch* stage) {
+    // Create boolean flag variables for whether input and output were each redirected
+    int inRedirected = 0;
+    int outRedirected = 0;
+
+    for (struct redirection* redirect = stageCommand->redirections; redirect != NULL; redirect = redirect->next) {
+        // Every redirection needs at most two actions and one opened file
+        if (stage->fdActionCount > STAGE_FD_ACTIONS - 2) {
+            printf("too many redirections\n");
+            fflush(stdout);
+            return -1;
+        }
+        char* pathToken = (redirect->targetFlags & WORD_EXPAND) ? expandVariables(arena, redirect->target) : redirect->target;
+        inRedirected |= (redirect->fd == 0);
+        outRedirected |= (redirect->fd == 1);
+
+        // Copying or closing a descriptor needs no file
+        if (redirect->type == REDIRECT_DUPLICATE) {
+            char* end;
+            long source = strtol(pathToken, &end, 10);
+            if (strcmp(pathToken, "-") == 0) {
+                source = -1;
+            }
+            else if (*pathToken == '\0' || *end != '\0' || source < 0 || source > 9) {
+                printf("%s: bad file descriptor\n", pathToken);
+                fflush(stdout);
+                return -1;
+            }
+            addFdAction(stage, redirect->fd, source);
+            continue;
+        }
+
+        int newFd;
+        // Here-documents and here-strings are read from memory
+        if (redirect->type == REDIRECT_HEREDOC || redirect->type == REDIRECT_HERESTRING) {
+            newFd = openInlineInput(pathToken, redirect->type == REDIRECT_HERESTRING);
+            if (newFd == -1) {
+                perror("Unable to create here-document");
+                return -1;
+            }
+        }
+        // Open the Input file for <
+        else if (redirect->type == REDIRECT_INPUT) {
+            newFd = openRedirectTarget(pathToken, O_RDONLY);
+            if (newFd == -1) {
+                printf("Unable to open %s for Input\n:", pathToken);
+                fflush(stdout);
+                return -1;
+            }
+        }
+        // Open the output file for >, >>, &> and &>>
+        else {
+            int append = (redirect->type == REDIRECT_APPEND || redirect->type == REDIRECT_BOTH_APPEND);
+            newFd = openRedirectTarget(pathToken, O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC));
+            if (newFd == -1) {
+                printf("Unable to open %s for Output\n:", pathToken);
+                fflush(stdout);
+                return -1;
+            }
+        }
+        stage->openedFds[stage->openedCount++] = newFd;
+        addFdAction(stage, redirect->fd, newFd);
+        if (redirect->type == REDIRECT_BOTH || redirect->type == REDIRECT_BOTH_APPEND) {
+            addFdAction(stage, 2, 1);
+        }
+    }
+
+    // Redirect input and output to dev/null if this is a background process and the stream in question wasn't already redirected
+    if (inRedirected == 0 && nullInput == 1) {
+        stage->inFd = sharedDevNull();
+    }
+    if (outRedirected == 0 && nullOutput == 1) {
+        stage->outFd = sharedDevNull();
+    }
+    return 0;
+}
+
+/* isRelayStage - Check whether a pipeline stage can be handled by the in-shell relay instead of a new program
+*   Inputs: args       - Null terminated argument array for the stage, from expandArguments
+*           stageIndex - Position of the stage within the pipeline
+*   Outputs: Integer representing a boolean value, 1 if the stage should run as an in-shell relay and 0 if it should be executed
+*
+*   Purpose: A stage that only copies its input ("cat" with no arguments) or copies it and saves it to files ("tee FILE...") does
+*   not need its own program. When the SMALLSH_RELAY environment variable is set to 1, those stages are run by the shell itself with
+*   splice and tee so the stream moves between pipes inside the kernel instead of through a userspace buffer. Only stages reading
+*   from another stage (not the first one) qualify, and tee is only replaced when no options are given.
+*/
+int isRelayStage(char** args, int stageIndex) {
+    char* relaySetting = getVariable("SMALLSH_RELAY");
+    if (relaySetting == NULL || strcmp(relaySetting, "1") != 0 || stageIndex == 0) {
+        return 0;
+    }
+    if (strcmp(args[0], "cat") == 0) {
+        return args[1] == NULL;
+    }
+    if (strcmp(args[0], "tee") == 0) {
+        for (int i = 1; args[i] != NULL; i++) {
+            if (args[i][0] == '-') {
+                return 0;
+            }
+        }
+        return 1;
+    }
+    return 0;
+}
+
+/* spliceAll - Move an exact number of bytes from one file descriptor to another with splice
+*   Inputs: fromFd - Source descriptor, toFd - Destination descriptor (one of the two must be a pipe), length - Bytes to move
+*   Outputs: 0 on success, -1 on failure
+*/
+int spliceAll(int fromFd, int toFd, size_t length) {
+    while (length > 0) {
+        ssize_t moved = splice(fromFd, NULL, toFd, NULL, length, SPLICE_F_MOVE);
+        if (moved == -1 && errno == EINTR) {
+            continue;
+        }
+        if (moved <= 0) {
+            return -1;
+        }
+        length -= moved;
+    }
+    return 0;
+}
+
+/* relayStream - Copy a stream from one descriptor to another, and optionally to a set of files, without leaving the kernel
+*   Inputs: inFd      - Descriptor the stream is read from
+*           outFd     - Descriptor the stream is forwarded to
+*           teeFds    - Array of additional file descriptors that receive a copy of the stream
+*           teeCount  - Number of descriptors in teeFds
+*   Outputs: 0 on success, 1 on failure (used as the exit value of the relay stage)
+*
+*   Purpose: To implement the cat and tee pipeline stages inside the shell.
+*
+*   Procedure:
+*   When the input is a pipe and the output is a pipe, file or socket, the data is moved with splice. For each tee file, tee(2) first
+*   duplicates the waiting pipe contents into a scratch pipe (sized like the input pipe so the copy is never short), which is then
+*   spliced into the file. Finally the same number of bytes is spliced from the input to the output, consuming it. tee returning 0
+*   means the writer closed its end and the relay is done. If the descriptors do not support splice (for example a terminal) the
+*   function falls back to a read/write loop with a RELAY_CHUNK sized buffer.
+*/
+int relayStream(int inFd, int outFd, int* teeFds, int teeCount) {
+    struct stat inInfo;
+    struct stat outInfo;
+    fstat(inFd, &inInfo);
+    fstat(outFd, &outInfo);
+    int spliceOut = S_ISFIFO(outInfo.st_mode) || S_ISREG(outInfo.st_mode) || S_ISSOCK(outInfo.st_mode);
+
+    if (S_ISFIFO(inInfo.st_mode) && spliceOut) {
+        // Scratch pipe used to hold the duplicated data on its way to the tee files
+        int scratch[2] = { -1, -1 };
+        if (teeCount > 0) {
+            if (pipe2(scratch, O_CLOEXEC) == -1) {
+                return 1;
+            }
+            int pipeSize = fcntl(inFd, F_GETPIPE_SZ);
+            if (pipeSize > 0) {
+                fcntl(scratch[1], F_SETPIPE_SZ, pipeSize);
+            }
+        }
+        int result = 0;
+        while (1) {
+            ssize_t chunk;
+            if (teeCount > 0) {
+                // Duplicate the waiting data once per file, then splice the duplicate into that file
+                chunk = tee(inFd, scratch[1], RELAY_CHUNK, 0);
+                for (int i = 0; i < teeCount && chunk > 0; i++) {
+                    if (i > 0 && tee(inFd, scratch[1], chunk, 0) != chunk) {
+                        chunk = -1;
+                    }
+                    else if (spliceAll(scratch[0], teeFds[i], chunk) == -1) {
+                        chunk = -1;
+                    }
+                }
+                // Consume the same bytes from the input by moving them to the output
+                if (chunk > 0 && spliceAll(inFd, outFd, chunk) == -1) {
+                    chunk = -1;
+                }
+            }
+            else {
+                chunk = splice(inFd, NULL, outFd, NULL, RELAY_CHUNK, SPLICE_F_MOVE);
+            }
+            if (chunk == -1 && errno == EINTR) {
+                continue;
+            }
+            if (chunk <= 0) {
+                result = chunk == 0 ? 0 : 1;
+                break;
+            }
+        }
+        if (teeCount > 0) {
+            close(scratch[0]);
+            close(scratch[1]);
+        }
+        return result;
+    }
+
+    // Fallback for descriptors that do not support splice, copy through a userspace buffer
+    char* buffer = malloc(RELAY_CHUNK);
+    int result = 0;
+    while (1) {
+        ssize_t chunk = read(inFd, buffer, RELAY_CHUNK);
+        if (chunk == -1 && errno == EINTR) {
+            continue;
+        }
+        if (chunk <= 0) {
+            result = chunk == 0 ? 0 : 1;
+            break;
+        }
+        for (int i = 0; i < teeCount; i++) {
+            writeAll(teeFds[i], buffer, chunk);
+        }
+        if (writeAll(outFd, buffer, chunk) == -1) {
+            result = 1;
+            break;
+        }
+    }
+    free(buffer);
+    return result;
+}
+
+/* runRelayStage - Run a cat or tee pipeline stage inside the (forked) shell
+*   Inputs: args - Null terminated argument array for the stage, already redirected onto stdin and stdout
+*   Outputs: Exit value for the stage, 0 for success and 1 for failure
+*/
+int runRelayStage(char** args) {
+    int teeCount = 0;
+    while (args[teeCount + 1] != NULL) {
+        teeCount++;
+    }
+    int* teeFds = malloc((teeCount + 1) * sizeof(int));
+    for (int i = 0; i < teeCount; i++) {
+        teeFds[i] = openat(workingDirectoryFd, args[i + 1], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        if (teeFds[i] == -1) {
+            fprintf(stderr, "tee: %s: %s\n", args[i + 1], strerror(errno));
+            for (int j = 0; j < i; j++) {
+                close(teeFds[j]);
+            }
+            free(teeFds);
+            return 1;
+        }
+    }
+    int result = relayStream(0, 1, teeFds, teeCount);
+    for (int i = 0; i < teeCount; i++) {
+        close(teeFds[i]);
+    }
+    free(teeFds);
+    return result;
+}
+
+/* hashString - FNV-1a hash of a character array, used by the shell's hash tables
+*   Inputs: text - Null terminated character array
+*   Outputs: 32 bit hash value
+*/
+unsigned int hashString(const char* text) {
+    unsigned int hash = 2166136261u;
+    while (*text != '\0') {
+        hash ^= (unsigned char)*text;
+        hash *= 16777619u;
+        text++;
+    }
+    return hash;
+}
+
+/* builtinSlot - Index of a command name in builtinSlots
+*   Inputs: name - Command name, seed - Seed chosen by registerBuiltins
+*   Outputs: Slot number below BUILTIN_SLOTS
+*/
+unsigned int builtinSlot(const char* name, unsigned int seed) {
+    return ((hashString(name) ^ seed) * 2654435761u) >> (32 - BUILTIN_SLOT_BITS);
+}
+
+/* findBuiltin - Look up a built in command
+*   Inputs: name - First word of the command
+*   Outputs: The built in command, or NULL if the name isn't one
+*
+*   Purpose: The seed makes the slot index a perfect hash of the built in names, so a lookup is one hash and at most one strcmp
+*   however many built in commands there are.
+*/
+struct builtinCommand* findBuiltin(char* name) {
+    struct builtinCommand* builtin = builtinSlots[builtinSlot(name, builtinSeed)];
+    if (builtin == NULL || strcmp(builtin->name, name) != 0) {
+        return NULL;
+    }
+    return builtin;
+}
+
+/* clearPathCache - Forget every resolved command path
+*   Inputs: None
+*   Outputs: None
+*/
+void clearPathCache() {
+    for (int i = 0; i < PATH_CACHE_BUCKETS; i++) {
+        struct pathCacheEntry* entry = pathCache[i];
+        while (entry != NULL) {
+            struct pathCacheEntry* nextEntry = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+            entry = nextEntry;
+        }
+        pathCache[i] = NULL;
+    }
+}
+
+/* forgetCommandPath - Remove one command from the path cache, used when its cached file has disappeared
+*   Inputs: name - Command name to remove
+*   Outputs: None
+*/
+void forgetCommandPath(char* name) {
+    struct pathCacheEntry** link = &pathCache[hashString(name) % PATH_CACHE_BUCKETS];
+    while (*link != NULL) {
+        if (strcmp((*link)->name, name) == 0) {
+            struct pathCacheEntry* oldEntry = *link;
+            *link = oldEntry->next;
+            free(oldEntry->name);
+            free(oldEntry->path);
+            free(oldEntry);
+            return;
+        }
+        link = &(*link)->next;
+    }
+}
+
+/* resolveCommand - Find the absolute path of a command, using the path cache when possible
+*   Inputs: name - Command name as typed by the user
+*   Outputs: Pointer to the resolved path (owned by the cache, or name itself when it contains a /), or NULL if it was not found
+*
+*   Purpose: execvp tries to execute the command in every $PATH directory until one works, so every command costs a burst of
+*   failed exec calls. Resolving each name once and keeping the answer lets the launch engines exec the absolute path directly.
+*
+*   Procedure:
+*   Names containing a / are used as they are. Otherwise the current PATH is compared with the copy saved when the cache was
+*   filled and the cache is emptied if it changed. The name is looked up in its hash bucket, and on a miss each PATH directory is
+*   checked with a single stat for an executable regular file. The first match is stored at the head of its bucket and returned.
+*   Names that were not found are not cached, so installing a program is noticed right away.
+*/
+char* resolveCommand(char* name) {
+    if (strchr(name, '/') != NULL) {
+        return name;
+    }
+
+    // Invalidate the whole cache if PATH changed since it was filled
+    char* currentPath = getVariable("PATH");
+    if (currentPath == NULL) {
+        currentPath = "/usr/local/bin:/usr/bin:/bin";
+    }
+    if (cachedPathVariable == NULL || strcmp(cachedPathVariable, currentPath) != 0) {
+        clearPathCache();
+        free(cachedPathVariable);
+        cachedPathVariable = malloc((strlen(currentPath) + 1) * sizeof(char));
+        strcpy(cachedPathVariable, currentPath);
+    }
+
+    // Cache hit
+    unsigned int bucket = hashString(name) % PATH_CACHE_BUCKETS;
+    for (struct pathCacheEntry* entry = pathCache[bucket]; entry != NULL; entry = entry->next) {
+        if (strcmp(entry->name, name) == 0) {
+            entry->hits++;
+            return entry->path;
+        }
+    }
+
+    // Cache miss, walk the PATH directories (an empty entry means the current directory)
+    int nameLength = strlen(name);
+    char* candidate = malloc(strlen(currentPath) + nameLength + 3);
+    char* directory = currentPath;
+    while (directory != NULL) {
+        char* endOfDirectory = strchr(directory, ':');
+        int directoryLength = endOfDirectory == NULL ? (int)strlen(directory) : (int)(endOfDirectory - directory);
+        if (directoryLength == 0) {
+            strcpy(candidate, name);
+        }
+        else {
+            memcpy(candidate, directory, directoryLength);
+            candidate[directoryLength] = '/';
+            strcpy(candidate + directoryLength + 1, name);
+        }
+        struct stat fileInfo;
+        if (stat(candidate, &fileInfo) == 0 && S_ISREG(fileInfo.st_mode) && access(candidate, X_OK) == 0) {
+            struct pathCacheEntry* newEntry = malloc(sizeof(struct pathCacheEntry));
+            newEntry->name = malloc((nameLength + 1) * sizeof(char));
+            strcpy(newEntry->name, name);
+            newEntry->path = candidate;
+            newEntry->hits = 1;
+            newEntry->next = pathCache[bucket];
+            pathCache[bucket] = newEntry;
+            return newEntry->path;
+        }
+        directory = endOfDirectory == NULL ? NULL : endOfDirectory + 1;
+    }
+    free(candidate);
+    return NULL;
+}
+
+/* hashCommand - The hash built in command
+*   Inputs: args - Null terminated argument array, args[0] is "hash", shell - Shell state (unused)
+*   Outputs: 0 on success, 1 if a named command could not be found
+*
+*   Purpose: With no arguments, list the cached commands with their hit counts and paths. "hash -r" empties the cache and
+*   "hash NAME..." resolves the named commands ahead of time.
+*/
+int hashCommand(char** args, struct shellState* shell) {
+    if (args[1] == NULL) {
+        printf("hits\tcommand\n");
+        for (int i = 0; i < PATH_CACHE_BUCKETS; i++) {
+            for (struct pathCacheEntry* entry = pathCache[i]; entry != NULL; entry = entry->next) {
+                printf("%4u\t%s\n", entry->hits, entry->path);
+            }
+        }
+        fflush(stdout);
+        return 0;
+    }
+    if (strcmp(args[1], "-r") == 0) {
+        clearPathCache();
+        return 0;
+    }
+    int result = 0;
+    for (int i = 1; args[i] != NULL; i++) {
+        if (resolveCommand(args[i]) == NULL) {
+            printf("hash: %s: not found\n", args[i]);
+            fflush(stdout);
+            result = 1;
+        }
+    }
+    return result;
+}
+
+/* setLaunchMode - Select the engine used to start child processes
+*   Inputs: modeName - "fork", "vfork" or "spawn"
+*   Outputs: 0 if the mode was recognised and selected, -1 otherwise
+*/
+int setLaunchMode(char* modeName) {
+    if (strcmp(modeName, "fork") == 0) {
+        launchMode = LAUNCH_FORK;
+    }
+    else if (strcmp(modeName, "vfork") == 0) {
+        launchMode = LAUNCH_VFORK;
+    }
+    else if (strcmp(modeName, "spawn") == 0) {
+        launchMode = LAUNCH_SPAWN;
+    }
+    else {
+        return -1;
+    }
+    return 0;
+}
+
+/* execStageChild - Finish setting up a forked or vforked child and execute the stage's program
+*   Inputs: stage           - The prepared launch description
+*           groupLeader     - Process group to join, 0 to lead a new group, or -1 to stay in the shell's group
+*           SIGINT_original - The SIGINT action to restore, or NULL to keep ignoring CTL-C
+*           childMask       - Signal mask for the program (nothing blocked), set once the signal actions have been reset
+*           environment     - Environment for the program, from childEnvironment
+*   Outputs: None, the function never returns
+*
+*   Purpose: The child side shared by the fork and vfork engines. Since a vforked child borrows the shell's memory, everything
+*   here is limited to system calls that leave the shell untouched: no stdio and no allocation, and the error path uses _exit.
+*/
+void execStageChild(struct stageLaunch* stage, pid_t groupLeader, struct sigaction* SIGINT_original, sigset_t* childMask, char** environment) {
+    // Put the shell's signal handlers (and the terminal signals it ignores for job control) back to their defaults before signals are unblocked
+    struct sigaction defaultAction = { 0 };
+    defaultAction.sa_handler = SIG_DFL;
+    sigaction(SIGTSTP, &defaultAction, NULL);
+    sigaction(SIGTTOU, &defaultAction, NULL);
+    sigaction(SIGTTIN, &defaultAction, NULL);
+    if (SIGINT_original != NULL) {
+        sigaction(SIGINT, SIGINT_original, NULL);
+    }
+    sigprocmask(SIG_SETMASK, childMask, NULL);
+
+    if (groupLeader != -1) {
+        setpgid(0, groupLeader);
+    }
+    applyFdActions(stage);
+    execve(stage->path, stage->args, environment);
+
+    // The cached path may have gone stale since it was resolved, fall back to a full search before giving up
+    if (errno == ENOENT) {
+        execvpe(stage->args[0], stage->args, environment);
+    }
+
+    // Only reached if the program could not be executed, with errno saying why
+    char* reason = strerror(errno);
+    METRIC_ADD(execFailures, 1);
+    write(1, stage->args[0], strlen(stage->args[0]));
+    write(1, ": ", 2);
+    write(1, reason, strlen(reason));
+    _exit(1);
+}
+
+/* launchStage - Start one prepared pipeline stage with the selected launch engine
+*   Inputs: stage           - The prepared launch description (argv and stdin/stdout descriptors)
+*           groupLeader     - Process group to join, 0 to lead a new group, or -1 to stay in the shell's group
+*           SIGINT_original - The SIGINT action to restore in the child, or NULL to keep ignoring CTL-C
+*   Outputs: The process ID of the new child, or -1 if it could not be started
+*
+*   Purpose: To start a child process with as little work as possible on the shell's side, since everything the child needs was
+*   already prepared by the caller.
+*
+*   Procedure:
+*   In spawn mode the stage is translated into posix_spawn file actions (dup2 of the prepared descriptors, which are all close on
+*   exec otherwise, and the stage's other descriptor actions) and attributes (process group, signal defaults and mask), and posix_spawn creates the child without copying
+*   the shell's page tables. In vfork mode the child shares the shell's memory until it calls exec, which avoids the same copy, and
+*   in fork mode a regular copy is made. Signals are blocked around vfork and fork so the shell's handlers never run in the child.
+*   Relay stages and built in utilities need a full copy of the shell to run, so they always use fork and never exec. Every
+*   engine gives the program the environment from childEnvironment, which is only rebuilt after an exported variable changes.
+*/
+pid_t launchStage(struct stageLaunch* stage, pid_t groupLeader, struct sigaction* SIGINT_original) {
+    long long launchStart = nowNanoseconds();
+    int inShell = stage->relay || stage->builtin != NULL;
+    // Built before the child exists, since a vforked child must not allocate
+    char** environment = childEnvironment();
+    if (launchMode == LAUNCH_SPAWN && inShell == 0) {
+        posix_spawn_file_actions_t actions;
+        posix_spawnattr_t attributes;
+        posix_spawn_file_actions_init(&actions);
+        posix_spawnattr_init(&attributes);
+        short flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+
+        if (stage->inFd != -1) {
+            posix_spawn_file_actions_adddup2(&actions, stage->inFd, 0);
+        }
+        if (stage->outFd != -1) {
+            posix_spawn_file_actions_adddup2(&actions, stage->outFd, 1);
+        }
+        for (int i = 0; i < stage->fdActionCount; i++) {
+            if (stage->fdActions[i].source == -1) {
+                posix_spawn_file_actions_addclose(&actions, stage->fdActions[i].target);
+            }
+            else {
+                posix_spawn_file_actions_adddup2(&actions, stage->fdActions[i].source, stage->fdActions[i].target);
+            }
+        }
+        if (groupLeader != -1) {
+            flags |= POSIX_SPAWN_SETPGROUP;
+            posix_spawnattr_setpgroup(&attributes, groupLeader);
+        }
+
+        // Reset SIGTSTP, SIGTTOU and SIGTTIN (and SIGINT for foreground children) to the default action, and start with nothing blocked
+        sigset_t defaults;
+        sigemptyset(&defaults);
+        sigaddset(&defaults, SIGTSTP);
+        sigaddset(&defaults, SIGTTOU);
+        sigaddset(&defaults, SIGTTIN);
+        if (SIGINT_original != NULL && SIGINT_original->sa_handler == SIG_DFL) {
+            sigaddset(&defaults, SIGINT);
+        }
+        sigset_t emptyMask;
+        sigemptyset(&emptyMask);
+        posix_spawnattr_setsigdefault(&attributes, &defaults);
+        posix_spawnattr_setsigmask(&attributes, &emptyMask);
+        posix_spawnattr_setflags(&attributes, flags);
+
+        // Retry with a fresh lookup if the cached path has gone stale
+        pid_t newChildPid;
+        int spawnError = posix_spawn(&newChildPid, stage->path, &actions, &attributes, stage->args, environment);
+        if (spawnError == ENOENT && stage->path != stage->args[0]) {
+            forgetCommandPath(stage->args[0]);
+            stage->path = resolveCommand(stage->args[0]);
+            if (stage->path != NULL) {
+                spawnError = posix_spawn(&newChildPid, stage->path, &actions, &attributes, stage->args, environment);
+            }
+        }
+        posix_spawn_file_actions_destroy(&actions);
+        posix_spawnattr_destroy(&attributes);
+        if (spawnError != 0) {
+            METRIC_ADD(execFailures, 1);
+            printf("%s: %s", stage->args[0], strerror(spawnError));
+            fflush(stdout);
+            return -1;
+        }
+        METRIC_ADD(forks, 1);
+        METRIC_ADD(spawnNanoseconds, nowNanoseconds() - launchStart);
+        return newChildPid;
+    }
+
+    // fork and vfork engines, with every signal blocked until the child has reset its handlers
+    // The shell keeps SIGCHLD blocked for childSignalFd, so children start from an empty mask instead of the shell's
+    sigset_t allSignals;
+    sigset_t originalMask;
+    sigset_t childMask;
+    sigemptyset(&childMask);
+    sigfillset(&allSignals);
+    sigprocmask(SIG_BLOCK, &allSignals, &originalMask);
+    pid_t newChildPid;
+    if (launchMode == LAUNCH_VFORK && inShell == 0) {
+        newChildPid = vfork();
+    }
+    else {
+        newChildPid = fork();
+    }
+    if (newChildPid == 0) {
+        if (inShell) {
+            // Foreground built ins get CTL-C back like programs do
+            if (stage->builtin != NULL && SIGINT_original != NULL) {
+                sigaction(SIGINT, SIGINT_original, NULL);
+            }
+            sigprocmask(SIG_SETMASK, &childMask, NULL);
+            if (groupLeader != -1) {
+                setpgid(0, groupLeader);
+            }
+            applyFdActions(stage);
+            // The copy never calls exec, so close on exec does not apply and the pipe ends it holds have to be closed by hand.
+            // The descriptors the shell keeps open go with them (cd has also changed the copy's own directory)
+            close_range(3, ~0U, 0);
+            devNullFd = -1;
+            workingDirectoryFd = AT_FDCWD;
+            // It leaves with _exit, so the shell's atexit handlers (metrics, trace summary) don't run in the copy
+            int exitValue;
+            if (stage->builtin != NULL) {
+                exitValue = WEXITSTATUS(stage->builtin->run(stage->args, NULL));
+            }
+            else {
+                exitValue = runRelayStage(stage->args);
+            }
+            fflush(stdout);
+            _exit(exitValue);
+        }
+        execStageChild(stage, groupLeader, SIGINT_original, &childMask, environment);
+    }
+    sigprocmask(SIG_SETMASK, &originalMask, NULL);
+    if (newChildPid == -1) {
         perror("Error Creating Fork");
-        exit(1);
-        break;
-    case 0:
-        //Fork off  and run the new process for the child
-        redirectSuccess = redirectIO(expandedArgs, 0);
-        if (redirectSuccess == -1) {
-            exit(1);
+        return -1;
+    }
+    METRIC_ADD(forks, 1);
+    METRIC_ADD(spawnNanoseconds, nowNanoseconds() - launchStart);
+    return newChildPid;
+}
+
+/* launchPipeline - Start every stage of a pipeline as a concurrently running child process
+*   Inputs: arena           - The command arena, for expanded words and temporary arrays
+*           command         - The parsed pipeline from parseCommandLine
+*           foreground      - integer value for whether the pipeline runs in the foreground (1) or background (0), or 2 for a
+*                             command substitution, which runs like a foreground pipeline but always in the shell's process group
+*           pids            - Array receiving the process ID of each stage in order, -1 for a stage that could not be started
+*           SIGINT_original - The SIGINT action to restore in foreground children
+*   Outputs: Number of stages successfully started
+*
+*   Purpose: To connect each stage's output to the next stage's input and run them all at the same time in one process group.
+*
+*   Procedure:
+*   One pipe is created with pipe2(O_CLOEXEC) between every pair of neighbouring stages. For each stage the shell then prepares
+*   everything the child needs before it exists: redirectIO opens the redirected files on top of the pipe ends, expandArguments
+*   produces the final argument array and resolveCommand finds the program through the path cache. launchStage then starts the
+*   child, which joins the process group of the first stage. Background pipelines get their own group so they can be signalled as a
+*   unit, and so do foreground pipelines when job control is on (runForegroundProcess hands them the terminal). Without job control
+*   foreground pipelines stay in the shell's group so CTL-C still reaches them. A stage whose redirection fails is reported and skipped, its neighbours simply see its pipe closed. The parent
+*   closes all pipe descriptors once every stage has been started so end of file propagates.
+*/
+int launchPipeline(struct arena* arena, struct commandLine* command, int foreground, pid_t* pids, struct sigaction* SIGINT_original) {
+    // Create the pipes connecting the stages, pipes[2i] is read by stage i+1 and pipes[2i+1] is written by stage i
+    int stageCount = command->stageCount;
+    int* pipes = arenaAlloc(arena, (2 * stageCount) * sizeof(int));
+    for (int i = 0; i < stageCount - 1; i++) {
+        if (pipe2(pipes + 2 * i, O_CLOEXEC) == -1) {
+            perror("Error Creating Pipe");
+            for (int j = 0; j < i; j++) {
+                close(pipes[2 * j]);
+                close(pipes[2 * j + 1]);
+            }
+            return 0;
+        }
+    }
+
+    // Job stages all join the group led by the first stage, foreground stages without job control stay in the shell's group
+    int ownGroup = foreground == 0 || (foreground == 1 && terminalFd != -1);
+    pid_t groupLeader = ownGroup ? 0 : -1;
+    int started = 0;
+    struct simpleCommand* stageCommand = command->stages;
+    for (int i = 0; i < stageCount; i++, stageCommand = stageCommand->next) {
+        pids[i] = -1;
+        struct stageLaunch stage = { 0 };
+        stage.inFd = i > 0 ? pipes[2 * (i - 1)] : -1;
+        stage.outFd = i < stageCount - 1 ? pipes[2 * i + 1] : -1;
+
+        // Only the outer ends of a background pipeline fall back to /dev/null
+        int nullInput = (foreground == 0 && i == 0);
+        int nullOutput = (foreground == 0 && i == stageCount - 1);
+        long long phaseStart = traceStart();
+        int redirected = redirectIO(arena, stageCommand, nullInput, nullOutput, &stage);
+        traceEnd(TRACE_REDIRECT, phaseStart);
+        if (redirected == 0) {
+            phaseStart = traceStart();
+            stage.args = expandArguments(arena, stageCommand);
+            traceEnd(TRACE_EXPAND, phaseStart);
+            if (stage.args[0] != NULL) {
+                stage.relay = isRelayStage(stage.args, i);
+                stage.builtin = findBuiltin(stage.args[0]);
+                if (stage.builtin != NULL && (stage.builtin->flags & BUILTIN_FORKABLE) == 0) {
+                    stage.builtin = NULL;
+                }
+                phaseStart = traceStart();
+                stage.path = stage.builtin == NULL ? resolveCommand(stage.args[0]) : NULL;
+                traceEnd(TRACE_RESOLVE, phaseStart);
+                if (stage.path == NULL && stage.relay == 0 && stage.builtin == NULL) {
+                    METRIC_ADD(execFailures, 1);
+                    printf("%s: No such file or directory", stage.args[0]);
+                    fflush(stdout);
+                }
+                else {
+                    phaseStart = traceStart();
+                    pids[i] = launchStage(&stage, groupLeader, foreground ? SIGINT_original : NULL);
+                    traceEnd(TRACE_LAUNCH, phaseStart);
+                }
+            }
+        }
+        closeOpenedFds(&stage);
+
+        // Also set the group from the parent, so it is in place regardless of which process runs first
+        if (pids[i] != -1) {
+            if (groupLeader == 0) {
+                groupLeader = pids[i];
+            }
+            if (ownGroup) {
+                setpgid(pids[i], groupLeader);
+            }
+            started++;
+        }
+    }
+
+    // Close the parent's copy of every pipe
+    for (int i = 0; i < stageCount - 1; i++) {
+        close(pipes[2 * i]);
+        close(pipes[2 * i + 1]);
+    }
+    return started;
+}
+
+/* captureCommand - Run a command substitution and collect its output
+*   Inputs: arena       - The command arena, for the parse and the result
+*           commandText - The text between $( and )
+*           length      - Receives the length of the output
+*   Outputs: The output with trailing newlines removed (in the arena, null terminated)
+*
+*   Purpose: Let a command's output be used as (part of) an argument, like $(pwd) or $(ls | wc -l). The result stays one word.
+*
+*   Procedure:
+*   The text is parsed like a line of input. A BUILTIN_PURE utility with no redirections is run inside the shell with its stdout moved
+*   onto a memfd for the call, so it needs no process at all. Anything else is started with launchPipeline while the shell's stdout
+*   is the write end of a pipe, which the final stage inherits, after which the shell puts its own stdout back and closes its copy
+*   of the write end. Either way the output is read in RELAY_CHUNK blocks into a buffer that doubles as needed until end of file,
+*   the programs are collected, and the trailing newlines are trimmed.
+*/
+char* captureCommand(struct arena* arena, char* commandText, size_t* length) {
+    *length = 0;
+    struct commandLine* inner = parseCommandLine(arena, commandText);
+    if (inner == NULL || inner->stageCount == 0) {
+        return "";
+    }
+    // The built in is recognised from the word as typed, so the arguments are only expanded (running any nested substitution) once
+    struct simpleCommand* first = inner->stages;
+    struct builtinCommand* builtin = NULL;
+    if (inner->stageCount == 1 && first->argc > 0 && (first->argFlags[0] & WORD_EXPAND) == 0 && first->redirections == NULL) {
+        builtin = findBuiltin(first->argv[0]);
+    }
+    if (builtin != NULL && (builtin->flags & BUILTIN_PURE) == 0) {
+        builtin = NULL;
+    }
+
+    // Point the shell's stdout at the capture for as long as the command is being started (or, for a built in, run)
+    fflush(stdout);
+    int savedOut = fcntl(1, F_DUPFD_CLOEXEC, 10);
+    int captureFd;
+    pid_t* pids = NULL;
+    if (builtin != NULL) {
+        char** args = expandArguments(arena, first);
+        captureFd = memfd_create("substitution", MFD_CLOEXEC);
+        dup2(captureFd, 1);
+        builtin->run(args, NULL);
+        fflush(stdout);
+        lseek(captureFd, 0, SEEK_SET);
+    }
+    else {
+        int capturePipe[2];
+        if (pipe2(capturePipe, O_CLOEXEC) == -1) {
+            perror("Error Creating Pipe");
+            close(savedOut);
+            return "";
+        }
+        dup2(capturePipe[1], 1);
+        close(capturePipe[1]);
+        pids = arenaAlloc(arena, inner->stageCount * sizeof(pid_t));
+        launchPipeline(arena, inner, 2, pids, substitutionSIGINT);
+        fflush(stdout);
+        captureFd = capturePipe[0];
+    }
+    if (savedOut == -1) {
+        close(1);
+    }
+    else {
+        dup2(savedOut, 1);
+        close(savedOut);
+    }
+
+    // Read everything the command wrote, then collect its processes
+    char* output = NULL;
+    size_t capacity = 0;
+    size_t used = 0;
+    while (1) {
+        if (capacity - used < RELAY_CHUNK) {
+            capacity = capacity * 2 + RELAY_CHUNK;
+            output = realloc(output, capacity);
+        }
+        ssize_t bytesRead = read(captureFd, output + used, RELAY_CHUNK);
+        if (bytesRead == -1 && errno == EINTR) {
+            continue;
+        }
+        if (bytesRead <= 0) {
+            break;
+        }
+        used += bytesRead;
+    }
+    close(captureFd);
+    for (int i = 0; pids != NULL && i < inner->stageCount; i++) {
+        if (pids[i] != -1) {
+            waitpid(pids[i], NULL, 0);
+        }
+    }
+
+    while (used > 0 && output[used - 1] == '\n') {
+        used--;
+    }
+    char* result = arenaAlloc(arena, used + 1);
+    memcpy(result, output, used);
+    result[used] = '\0';
+    free(output);
+    *length = used;
+    return result;
+}
+
+/* describeCommand - Make a printable copy of a parsed command for job listings
+*   Inputs: arena - Arena to build the text in, command - The parsed pipeline
+*   Outputs: The words of every stage joined by spaces, with | between stages
+*/
+char* describeCommand(struct arena* arena, struct commandLine* command) {
+    int length = 1;
+    for (struct simpleCommand* stageCommand = command->stages; stageCommand != NULL; stageCommand = stageCommand->next) {
+        for (int i = 0; i < stageCommand->argc; i++) {
+            length += strlen(stageCommand->argv[i]) + 3;
+        }
+    }
+    char* text = arenaAlloc(arena, length);
+    char* output = text;
+    for (struct simpleCommand* stageCommand = command->stages; stageCommand != NULL; stageCommand = stageCommand->next) {
+        if (stageCommand != command->stages) {
+            output = stpcpy(output, " |");
+        }
+        for (int i = 0; i < stageCommand->argc; i++) {
+            if (output != text) {
+                *output++ = ' ';
+            }
+            output = stpcpy(output, stageCommand->argv[i]);
+        }
+    }
+    *output = '\0';
+    return text;
+}
+
+/* parseCpuList - Read a kernel CPU list
+*   Inputs: text - A list such as "0-3,8,10-11", set - CPU set to add the listed CPUs to
+*   Outputs: None
+*/
+void parseCpuList(char* text, cpu_set_t* set) {
+    char* cursor = text;
+    while (*cursor >= '0' && *cursor <= '9') {
+        long first = strtol(cursor, &cursor, 10);
+        long last = first;
+        if (*cursor == '-') {
+            last = strtol(cursor + 1, &cursor, 10);
+        }
+        for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+            CPU_SET(cpu, set);
+        }
+        if (*cursor == ',') {
+            cursor++;
+        }
+    }
+}
+
+/* loadPinTargets - Build the CPU sets that background processes are pinned to
+*   Inputs: None
+*   Outputs: None
+*
+*   Purpose: The targets start from the CPUs the shell itself may run on, less the first pinReserved of them which are left to
+*   the foreground (at least one CPU is always kept). In cpu mode there is one target per CPU. In node mode there is one target per
+*   NUMA node listed in /sys/devices/system/node, holding that node's CPUs, so a job's memory stays local to the CPUs it runs on.
+*   A machine without NUMA information counts as a single node.
+*/
+void loadPinTargets() {
+    free(pinTargets);
+    pinTargets = NULL;
+    pinTargetCount = 0;
+    pinNext = 0;
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (pinMode == PIN_NONE || sched_getaffinity(0, sizeof(allowed), &allowed) == -1) {
+        return;
+    }
+    int reserved = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE && reserved < pinReserved && CPU_COUNT(&allowed) > 1; cpu++) {
+        if (CPU_ISSET(cpu, &allowed)) {
+            CPU_CLR(cpu, &allowed);
+            reserved++;
+        }
+    }
+
+    // Either way the targets are disjoint and non-empty, so there are at most as many as there are CPUs
+    pinTargets = malloc(CPU_COUNT(&allowed) * sizeof(cpu_set_t));
+    if (pinMode == PIN_CPU) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &allowed)) {
+                CPU_ZERO(&pinTargets[pinTargetCount]);
+                CPU_SET(cpu, &pinTargets[pinTargetCount]);
+                pinTargetCount++;
+            }
+        }
+        return;
+    }
+    DIR* nodes = opendir("/sys/devices/system/node");
+    struct dirent* entry;
+    while (nodes != NULL && (entry = readdir(nodes)) != NULL) {
+        if (strncmp(entry->d_name, "node", 4) != 0 || entry->d_name[4] < '0' || entry->d_name[4] > '9') {
+            continue;
+        }
+        char path[512];
+        char cpuList[4096];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/%s/cpulist", entry->d_name);
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        ssize_t length = fd == -1 ? -1 : read(fd, cpuList, sizeof(cpuList) - 1);
+        if (fd != -1) {
+            close(fd);
+        }
+        if (length <= 0) {
+            continue;
+        }
+        cpuList[length] = '\0';
+        cpu_set_t nodeCpus;
+        CPU_ZERO(&nodeCpus);
+        parseCpuList(cpuList, &nodeCpus);
+        CPU_AND(&pinTargets[pinTargetCount], &nodeCpus, &allowed);
+        if (CPU_COUNT(&pinTargets[pinTargetCount]) > 0) {
+            pinTargetCount++;
+        }
+    }
+    if (nodes != NULL) {
+        closedir(nodes);
+    }
+    if (pinTargetCount == 0) {
+        pinTargets[0] = allowed;
+        pinTargetCount = 1;
+    }
+}
+
+/* writeControlFile - Write a value to a cgroup control file
+*   Inputs: directory - The cgroup directory, name - Control file name, text - Value to write
+*   Outputs: 0 on success, -1 if the file could not be opened or the kernel refused the value
+*/
+int writeControlFile(char* directory, char* name, char* text) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", directory, name);
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    int result = writeAll(fd, text, strlen(text));
+    close(fd);
+    return result;
+}
+
+/* setPlacement - Change one background job placement setting
+*   Inputs: name  - pin, reserve, cpu-time, memory, cgroup, cgroup-cpu or cgroup-memory
+*           value - none, cpu or node for pin, a directory or off for cgroup, otherwise a whole number (0 turns the limit off)
+*   Outputs: 0 if the setting was changed, -1 if the name or value wasn't recognised
+*/
+int setPlacement(char* name, char* value) {
+    if (strcmp(name, "pin") == 0) {
+        if (strcmp(value, "none") == 0) {
+            pinMode = PIN_NONE;
+        }
+        else if (strcmp(value, "cpu") == 0) {
+            pinMode = PIN_CPU;
+        }
+        else if (strcmp(value, "node") == 0) {
+            pinMode = PIN_NODE;
+        }
+        else {
+            return -1;
+        }
+        loadPinTargets();
+        return 0;
+    }
+    if (strcmp(name, "cgroup") == 0) {
+        free(cgroupBase);
+        cgroupBase = NULL;
+        cgroupUsable = 0;
+        if (strcmp(value, "off") != 0) {
+            cgroupBase = strdup(value);
+            // Only a cgroup v2 directory we may write to gets job leaves, which can use the cpu and memory controllers once they are
+            // enabled for it (this fails harmlessly when they already are or aren't available)
+            char controlPath[4096];
+            snprintf(controlPath, sizeof(controlPath), "%s/cgroup.subtree_control", cgroupBase);
+            cgroupUsable = access(controlPath, W_OK) == 0;
+            writeControlFile(cgroupBase, "cgroup.subtree_control", "+cpu +memory");
+        }
+        return 0;
+    }
+
+    char* end;
+    long number = strtol(value, &end, 10);
+    if (*value == '\0' || *end != '\0' || number < 0) {
+        return -1;
+    }
+    if (strcmp(name, "reserve") == 0) {
+        pinReserved = number;
+        loadPinTargets();
+    }
+    else if (strcmp(name, "cpu-time") == 0) {
+        jobCpuSeconds = number;
+    }
+    else if (strcmp(name, "memory") == 0) {
+        jobMemoryMB = number;
+    }
+    else if (strcmp(name, "cgroup-cpu") == 0) {
+        cgroupCpuPercent = number;
+    }
+    else if (strcmp(name, "cgroup-memory") == 0) {
+        cgroupMemoryMB = number;
+    }
+    else {
+        return -1;
+    }
+    return 0;
+}
+
+/* placementCommand - The placement built in command
+*   Inputs: args  - Expanded arguments, placement alone prints the settings and placement NAME VALUE changes one (see setPlacement)
+*           shell - Shell state (unused)
+*   Outputs: 0
+*/
+int placementCommand(char** args, struct shellState* shell) {
+    if (args[1] == NULL) {
+        char* pinNames[] = { "none", "cpu", "node" };
+        printf("pin %s (%d targets)\nreserve %d\ncpu-time %ld\nmemory %ld\n", pinNames[pinMode], pinTargetCount, pinReserved,
+            jobCpuSeconds, jobMemoryMB);
+        printf("cgroup %s%s\ncgroup-cpu %ld\ncgroup-memory %ld\n", cgroupBase != NULL ? cgroupBase : "off",
+            cgroupBase != NULL && cgroupUsable == 0 ? " (not a writable cgroup v2 directory)" : "", cgroupCpuPercent, cgroupMemoryMB);
+    }
+    else if (args[2] == NULL || args[3] != NULL || setPlacement(args[1], args[2]) == -1) {
+        printf("placement: usage: placement [pin none|cpu|node] [reserve CPUS] [cpu-time SECONDS] [memory MB] [cgroup DIR|off] "
+            "[cgroup-cpu PERCENT] [cgroup-memory MB]\n");
+    }
+    fflush(stdout);
+    return 0;
+}
+
+/* placeBackgroundJob - Apply the placement settings to a newly started background job
+*   Inputs: pids  - PIDs of the job's processes (-1 for stages that failed to start)
+*           count - Number of entries in pids
+*   Outputs: Path of the cgroup leaf created for the job (to be freed by the caller), or NULL
+*
+*   Purpose: Spread batch jobs across the machine and keep them from starving the foreground.
+*
+*   Procedure:
+*   The settings are applied by PID from the shell right after the processes start, which works the same with every launch engine
+*   (posix_spawn has no hook to run code in the child). A program may therefore run for a moment before it is placed, and anything
+*   it forks in that moment keeps the shell's placement. When the cgroup directory is a writable cgroup v2 directory, a leaf named after the shell
+*   and the job's first PID is made there, given cpu.max (percent of one CPU) and memory.max, and every process is moved into it.
+*   Pinning then gives each process the next CPU in turn in cpu mode, or the whole job the next NUMA node in node mode. Finally
+*   RLIMIT_CPU and RLIMIT_AS are set with prlimit.
+*/
+char* placeBackgroundJob(pid_t* pids, int count) {
+    int first = 0;
+    while (first < count && pids[first] == -1) {
+        first++;
+    }
+    if (first == count) {
+        return NULL;
+    }
+
+    char* leaf = NULL;
+    if (cgroupUsable) {
+        char value[64];
+        leaf = malloc(strlen(cgroupBase) + 64);
+        sprintf(leaf, "%s/smallsh-%s-%d", cgroupBase, shellPidText, pids[first]);
+        if (mkdir(leaf, 0755) == -1) {
+            free(leaf);
+            leaf = NULL;
+        }
+        else {
+            if (cgroupCpuPercent > 0) {
+                sprintf(value, "%ld 100000", cgroupCpuPercent * 1000);
+                writeControlFile(leaf, "cpu.max", value);
+            }
+            if (cgroupMemoryMB > 0) {
+                sprintf(value, "%lld", (long long)cgroupMemoryMB * 1048576);
+                writeControlFile(leaf, "memory.max", value);
+            }
+            for (int i = first; i < count; i++) {
+                if (pids[i] != -1) {
+                    sprintf(value, "%d", pids[i]);
+                    writeControlFile(leaf, "cgroup.procs", value);
+                }
+            }
+        }
+    }
+
+    cpu_set_t* jobTarget = pinTargetCount > 0 && pinMode == PIN_NODE ? &pinTargets[pinNext++ % pinTargetCount] : NULL;
+    for (int i = first; i < count; i++) {
+        if (pids[i] == -1) {
+            continue;
+        }
+        if (pinTargetCount > 0) {
+            cpu_set_t* target = jobTarget != NULL ? jobTarget : &pinTargets[pinNext++ % pinTargetCount];
+            sched_setaffinity(pids[i], sizeof(cpu_set_t), target);
+        }
+        if (jobCpuSeconds > 0) {
+            struct rlimit cpuLimit = { jobCpuSeconds, jobCpuSeconds };
+            prlimit(pids[i], RLIMIT_CPU, &cpuLimit, NULL);
+        }
+        if (jobMemoryMB > 0) {
+            struct rlimit memoryLimit = { (rlim_t)jobMemoryMB * 1048576, (rlim_t)jobMemoryMB * 1048576 };
+            prlimit(pids[i], RLIMIT_AS, &memoryLimit, NULL);
+        }
+    }
+    return leaf;
+}
+
+/* createBackgroundProcess
+*   Inputs: arena      - The command arena
+*           command    - The parsed pipeline from parseCommandLine
+*           listHead   - Head Node of the background process linkedList
+*   Outputs: None
+* 
+*   Purpose: This function creates a background process and adds it to the background process linked list data structure
+* 
+*   Procedure:
+*   This function will start the pipeline with launchPipeline, with the outer ends redirected to /dev/null unless the user redirected them.
+*   The parent will then create a background process struct for each stage's process, add it to the linkedList struct so it gets reaped,
+*   print the pid of the pipeline's first process and continue back to the user prompt to await the next input
+*/
+void createBackgroundProcess(struct arena* arena, struct commandLine* command, struct backgroundProcess* listHead) {
+    pid_t* pids = arenaAlloc(arena, command->stageCount * sizeof(pid_t));
+    int started = launchPipeline(arena, command, 0, pids, NULL);
+    if (started == 0) {
+        return;
+    }
+
+    // Pin, limit and move the job into its cgroup as configured with the placement command
+    char* cgroupPath = placeBackgroundJob(pids, command->stageCount);
+
+    //For the parent, add each child process to the list of background processes and return to the main prompt
+    char* commandText = describeCommand(arena, command);
+    int reported = 0;
+    for (int i = 0; i < command->stageCount; i++) {
+        if (pids[i] == -1) {
+            continue;
+        }
+        if (reported == 0) {
+            printf("\nbackground pid is %d\n", pids[i]);
+            fflush(stdout);
+            reported = 1;
+            lastBackgroundPid = pids[i];
+        }
+        struct backgroundProcess* newProcess = addBackgroundProcess(listHead, pids[i], -1, commandText);
+        newProcess->groupID = lastBackgroundPid;
+        newProcess->cgroupPath = cgroupPath == NULL ? NULL : strdup(cgroupPath);
+    }
+    free(cgroupPath);
+    return;
+}
+
+/* giveTerminal - Make a process group the foreground group of the terminal
+*   Inputs: group - The process group
+*   Outputs: None
+*
+*   Purpose: Only used with job control. The shell ignores SIGTTOU, so it can take the terminal back from the background as well.
+*/
+void giveTerminal(pid_t group) {
+    if (terminalFd != -1) {
+        tcsetpgrp(terminalFd, group);
+    }
+}
+
+/* stopJob - Record that a job has been stopped
+*   Inputs: listHead - Head Node of the background process linkedList, groupID - The job's process group
+*   Outputs: The wait status reported for a stopped job, exit value 128 + SIGTSTP
+*/
+int stopJob(struct backgroundProcess* listHead, pid_t groupID) {
+    pid_t reportedPid = -1;
+    for (struct backgroundProcess* focusProcess = listHead->next; focusProcess != NULL; focusProcess = focusProcess->next) {
+        if (focusProcess->groupID == groupID) {
+            setProcessStopped(focusProcess, 1);
+            if (reportedPid == -1) {
+                reportedPid = focusProcess->processID;
+            }
+        }
+    }
+    printf("\nbackground pid %d is stopped\n", reportedPid);
+    fflush(stdout);
+    return (128 + SIGTSTP) << 8;
+}
+
+/* runForegroundProcess
+*   Inputs: arena           - The command arena
+*           command         - The parsed pipeline from parseCommandLine
+*           SIGINT_original - The SIGINT action to restore in the children
+*           listHead        - Head Node of the background process linkedList, which a stopped pipeline is moved to
+*           stats           - Receives the wall time and the resource usage of all stages together
+*   Outputs: The wait status of the last stage, to be reported by the status command
+*
+*   Purpose: Run a command or pipeline in the foreground, blocking until every stage has finished. Each stage is collected with
+*   wait4 so its CPU time, memory and context switches are added to the statistics reported by time and status -v.
+*
+*   Procedure:
+*   With job control the pipeline has its own process group, which is given the terminal and sent SIGCONT (a stage that touched
+*   the terminal before the handover was stopped by SIGTTIN or SIGTTOU), and the stages are waited for with WUNTRACED. If CTL-Z
+*   stops them, the stages still running are added to the background process list as a stopped job that fg or bg can resume.
+*   Either way the shell takes the terminal back before returning to the prompt.
+*/
+int runForegroundProcess(struct arena* arena, struct commandLine* command, struct sigaction* SIGINT_original, struct backgroundProcess* listHead, struct jobStats* stats) {
+    int stageCount = command->stageCount;
+    pid_t* pids = arenaAlloc(arena, stageCount * sizeof(pid_t));
+    memset(stats, 0, sizeof(struct jobStats));
+    long long startTime = nowNanoseconds();
+    int started = launchPipeline(arena, command, 1, pids, SIGINT_original);
+    int childStatus = 1 << 8;
+
+    // The group is led by the first stage that started
+    pid_t groupID = -1;
+    for (int i = 0; i < stageCount && terminalFd != -1 && groupID == -1; i++) {
+        groupID = pids[i];
+    }
+    if (groupID != -1) {
+        giveTerminal(groupID);
+        kill(-groupID, SIGCONT);
+    }
+
+    // Wait for every stage, keeping the status of the final one like other shells do (a stage that never started counts as exit 1)
+    long long waitStart = traceStart();
+    for (int i = 0; i < stageCount && started > 0; i++) {
+        int stageStatus = 1 << 8;
+        if (pids[i] != -1) {
+            struct rusage usage;
+            wait4(pids[i], &stageStatus, groupID != -1 ? WUNTRACED : 0, &usage);
+            if (WIFSTOPPED(stageStatus)) {
+                char* commandText = describeCommand(arena, command);
+                for (int j = i; j < stageCount; j++) {
+                    if (pids[j] != -1) {
+                        addBackgroundProcess(listHead, pids[j], -1, commandText)->groupID = groupID;
+                    }
+                }
+                childStatus = stopJob(listHead, groupID);
+                break;
+            }
+            addUsage(stats, &usage);
+        }
+        if (i == stageCount - 1) {
+            childStatus = stageStatus;
+        }
+    }
+    traceEnd(TRACE_WAIT, waitStart);
+    if (groupID != -1) {
+        giveTerminal(getpgrp());
+    }
+    stats->wallNanoseconds = nowNanoseconds() - startTime;
+    return childStatus;
+}
+
+/* readWorkItems - Read every work item for the parallel command
+*   Inputs: fd        - Descriptor to read the items from
+*           itemCount - Pointer receiving the number of items
+*   Outputs: Array of item strings (one per non-empty line), pointing into a single buffer stored at index itemCount + 1
+*
+*   Purpose: The input is read in RELAY_CHUNK sized blocks into one growing buffer and then split into lines in place.
+*/
+char** readWorkItems(int fd, int* itemCount) {
+    size_t capacity = RELAY_CHUNK;
+    size_t length = 0;
+    char* buffer = malloc(capacity + 1);
+    while (1) {
+        if (length == capacity) {
+            capacity *= 2;
+            buffer = realloc(buffer, capacity + 1);
+        }
+        ssize_t received = read(fd, buffer + length, capacity - length);
+        if (received == -1 && errno == EINTR) {
+            continue;
+        }
+        if (received <= 0) {
+            break;
+        }
+        length += received;
+    }
+    buffer[length] = '\0';
+
+    // Split into lines, each line is one item (a line can't be shorter than one character plus its newline)
+    char** items = malloc((length / 2 + 3) * sizeof(char*));
+    int count = 0;
+    char* lineStart = buffer;
+    while (lineStart < buffer + length) {
+        char* newline = memchr(lineStart, '\n', buffer + length - lineStart);
+        if (newline == NULL) {
+            newline = buffer + length;
+        }
+        *newline = '\0';
+        if (newline > lineStart) {
+            items[count] = lineStart;
+            count++;
+        }
+        lineStart = newline + 1;
+    }
+    items[count] = NULL;
+    items[count + 1] = buffer;
+    *itemCount = count;
+    return items;
+}
+
+/* buildItemArgs - Fill in the parallel command template for one work item
+*   Inputs: arena         - Arena to build the arguments in
+*           template      - Null terminated template arguments
+*           item          - The work item
+*   Outputs: Null terminated argument array, with every {} in the template replaced by the item, or the item added as the last
+*            argument when the template has no {}
+*/
+char** buildItemArgs(struct arena* arena, char** template, char* item) {
+    int templateCount = 0;
+    while (template[templateCount] != NULL) {
+        templateCount++;
+    }
+    char** args = arenaAlloc(arena, (templateCount + 2) * sizeof(char*));
+    int itemLength = strlen(item);
+    int placed = 0;
+    for (int i = 0; i < templateCount; i++) {
+        char* marker = strstr(template[i], "{}");
+        if (marker == NULL) {
+            args[i] = template[i];
+            continue;
+        }
+        // Copy the word, replacing each {} (the result is at most item length / 2 + 1 times longer)
+        int wordLength = strlen(template[i]);
+        char* filled = arenaAlloc(arena, wordLength * (itemLength / 2 + 1) + 1);
+        char* output = filled;
+        for (char* input = template[i]; *input != '\0'; input++) {
+            if (input[0] == '{' && input[1] == '}') {
+                memcpy(output, item, itemLength);
+                output += itemLength;
+                input++;
+            }
+            else {
+                *output++ = *input;
+            }
+        }
+        *output = '\0';
+        args[i] = filled;
+        placed = 1;
+    }
+    if (placed == 0) {
+        args[templateCount] = item;
+        templateCount++;
+    }
+    args[templateCount] = NULL;
+    return args;
+}
+
+/* flushOrderedOutput - Write out the captured output of finished items, in item order
+*   Inputs: outputs    - Captured output descriptor of each item (-1 once written), finished - Whether each item has finished
+*           nextItem   - Pointer to the first item not written yet, itemCount - Number of items, outFd - Where the output goes
+*   Outputs: None
+*
+*   Purpose: For parallel -k. Each item's output was captured in its own memfd, and items are only written once every item before
+*   them has been written, using sendfile so the captured data goes straight from the memfd to the destination when it allows it.
+*/
+void flushOrderedOutput(int* outputs, char* finished, int* nextItem, int itemCount, int outFd) {
+    while (*nextItem < itemCount && finished[*nextItem]) {
+        int captured = outputs[*nextItem];
+        struct stat capturedInfo;
+        fstat(captured, &capturedInfo);
+        off_t offset = 0;
+        while (offset < capturedInfo.st_size) {
+            if (sendfile(outFd, captured, &offset, capturedInfo.st_size - offset) <= 0) {
+                break;
+            }
+        }
+
+        // sendfile refuses some destinations (such as files opened for appending), copy the rest through a buffer instead
+        if (offset < capturedInfo.st_size) {
+            char buffer[4096];
+            ssize_t chunk;
+            while ((chunk = pread(captured, buffer, sizeof(buffer), offset)) > 0 && writeAll(outFd, buffer, chunk) == 0) {
+                offset += chunk;
+            }
+        }
+        close(captured);
+        outputs[*nextItem] = -1;
+        (*nextItem)++;
+    }
+}
+
+/* parallelCommand - The parallel built in command
+*   Inputs: args  - Expanded arguments: parallel [-j N] [-k] [-a FILE] COMMAND [ARGS...]
+*           shell - Shell state: the command arena, the background process list and the SIGINT action for the children, or NULL
+*                   in a forked copy of the shell (a pipeline stage or a background job)
+*   Outputs: Wait status for the status command, exit value 0 if every item succeeded and 1 otherwise, or SIGINT if CTL-C
+*            stopped the run
+*
+*   Purpose: Run COMMAND once for every line of input (from stdin, a pipe, a < redirection or -a FILE) with at most N copies
+*   running at once, N defaulting to the number of online CPUs. Every {} in the command is replaced by the item, or the item is added as the
+*   last argument. With -k the output of each item is held back and written in input order, otherwise it appears as produced.
+*
+*   Procedure:
+*   The items are read first. Then, while there are items left or children running, new children are started with the selected
+*   launch engine until N are running, each added to the background process list with its item number. The command then blocks in
+*   wait4(-1) until any child exits, which frees its slot right away. A finished & job collected by the same wait is reported like
+*   cleanupBackgroundProcesses would have. For -k each child's stdout is a memfd that is written out once all earlier items finished.
+*   When a child is killed by SIGINT (CTL-C reaches the whole foreground group) no further items are started. A forked copy uses
+*   its own arena and an emptied job table, and its children inherit its SIGINT action.
+*/
+int parallelCommand(char** args, struct shellState* shell) {
+    struct arena forkedArena = { 0 };
+    struct backgroundProcess forkedHead = { 0 };
+    struct arena* arena = &forkedArena;
+    struct backgroundProcess* listHead = &forkedHead;
+    struct sigaction* SIGINT_original = NULL;
+    if (shell != NULL) {
+        arena = shell->arena;
+        listHead = shell->listHead;
+        SIGINT_original = shell->SIGINT_original;
+    }
+    else {
+        forkedHead.processID = -1;
+        forgetBackgroundProcesses(listHead);
+    }
+    // Parse the options
+    long slots = sysconf(_SC_NPROCESSORS_ONLN);
+    int ordered = 0;
+    char* itemFile = NULL;
+    int argIndex = 1;
+    while (args[argIndex] != NULL && args[argIndex][0] == '-') {
+        if (strcmp(args[argIndex], "--") == 0) {
+            argIndex++;
+            break;
+        }
+        else if (strcmp(args[argIndex], "-k") == 0) {
+            ordered = 1;
+        }
+        else if (strncmp(args[argIndex], "-j", 2) == 0) {
+            char* count = args[argIndex][2] != '\0' ? args[argIndex] + 2 : args[++argIndex];
+            slots = count != NULL ? atol(count) : 0;
+        }
+        else if (strcmp(args[argIndex], "-a") == 0 && args[argIndex + 1] != NULL) {
+            itemFile = args[++argIndex];
+        }
+        else {
+            break;
+        }
+        argIndex++;
+    }
+    if (args[argIndex] == NULL || slots < 1) {
+        printf("usage: parallel [-j N] [-k] [-a FILE] COMMAND [ARGS...]\n");
+        fflush(stdout);
+        return 2 << 8;
+    }
+    char** template = args + argIndex;
+
+    // The items come from -a FILE or stdin (runBuiltin has already applied any redirections to the shell)
+    int itemFd = 0;
+    if (itemFile != NULL) {
+        itemFd = open(itemFile, O_RDONLY | O_CLOEXEC);
+        if (itemFd == -1) {
+            printf("parallel: %s: %s\n", itemFile, strerror(errno));
+            fflush(stdout);
+            return 1 << 8;
+        }
+    }
+    int itemCount;
+    char** items = readWorkItems(itemFd, &itemCount);
+    if (itemFile != NULL) {
+        close(itemFd);
+    }
+    int outFd = 1;
+
+    char* commandPath = resolveCommand(template[0]);
+    if (commandPath == NULL) {
+        METRIC_ADD(execFailures, 1);
+        printf("%s: No such file or directory", template[0]);
+        fflush(stdout);
+        free(items[itemCount + 1]);
+        free(items);
+        return 1 << 8;
+    }
+
+    // Per item output capture for -k
+    int* outputs = NULL;
+    char* finished = NULL;
+    int nextOutput = 0;
+    if (ordered) {
+        outputs = malloc(itemCount * sizeof(int));
+        finished = calloc(itemCount, sizeof(char));
+    }
+
+    int nullInput = sharedDevNull();
+    int nextItem = 0;
+    int running = 0;
+    int failures = 0;
+    int interrupted = 0;
+    fflush(stdout);
+    while (nextItem < itemCount || running > 0) {
+        // Fill every free slot
+        while (running < slots && nextItem < itemCount && interrupted == 0) {
+            struct stageLaunch stage = { 0 };
+            stage.args = buildItemArgs(arena, template, items[nextItem]);
+            stage.path = commandPath;
+            stage.inFd = nullInput;
+            stage.outFd = -1;
+            if (ordered) {
+                outputs[nextItem] = memfd_create("parallel-item", MFD_CLOEXEC);
+                stage.outFd = outputs[nextItem];
+            }
+            pid_t child = launchStage(&stage, -1, SIGINT_original);
+            if (child == -1) {
+                failures++;
+                if (ordered) {
+                    finished[nextItem] = 1;
+                }
+            }
+            else {
+                addBackgroundProcess(listHead, child, nextItem, NULL);
+                running++;
+            }
+            nextItem++;
+        }
+        if (running == 0) {
+            break;
+        }
+
+        // Block until any child exits and free its slot
+        int status;
+        struct rusage usage;
+        pid_t finishedPid = wait4(-1, &status, 0, &usage);
+        if (finishedPid == -1) {
+            break;
+        }
+        struct backgroundProcess* focusProcess = findBackgroundProcess(finishedPid);
+        if (focusProcess == NULL) {
+            continue;
+        }
+        if (focusProcess->itemIndex == -1) {
+            reportBackgroundProcess(focusProcess, status, &usage);
+            continue;
+        }
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            failures++;
+        }
+        // CTL-C stops the run, the other running items got the same signal
+        if (WIFSIGNALED(status) && WTERMSIG(status) == SIGINT) {
+            interrupted = 1;
+        }
+        if (ordered) {
+            finished[focusProcess->itemIndex] = 1;
+        }
+        removeBackgroundProcess(focusProcess);
+        running--;
+        if (ordered) {
+            flushOrderedOutput(outputs, finished, &nextOutput, itemCount, outFd);
+        }
+    }
+    if (ordered) {
+        flushOrderedOutput(outputs, finished, &nextOutput, itemCount, outFd);
+        free(outputs);
+        free(finished);
+    }
+
+    free(items[itemCount + 1]);
+    free(items);
+    if (interrupted) {
+        if (shell != NULL) {
+            shell->loopControl = LOOP_ABORT;
+        }
+        return SIGINT;
+    }
+    return (failures == 0 ? 0 : 1) << 8;
+}
+
+/* exitCommand - The exit built in command
+*   Inputs: args - Expanded arguments (ignored), shell - Shell state
+*   Outputs: 0
+*
+*   Purpose: Terminate the background processes and ask the command loop to end.
+*/
+int exitCommand(char** args, struct shellState* shell) {
+    killRunningProcesses(shell->listHead);
+    cleanupBackgroundProcesses();
+    shell->exitRequested = 1;
+    return 0;
+}
+
+/* setLoopControl - Shared part of the break and continue built in commands
+*   Inputs: args - Expanded arguments (break [N], continue [N]), shell - Shell state, control - LOOP_BREAK or LOOP_CONTINUE
+*   Outputs: 0, or exit value 1 outside a loop or for a count that isn't a positive number
+*
+*   Purpose: The commands only record what to do. runScriptNode stops running the rest of the loop body as soon as loopControl is set,
+*   and each loop it leaves counts down loopLevels until the Nth enclosing loop ends or starts its next iteration.
+*/
+int setLoopControl(char** args, struct shellState* shell, int control) {
+    if (shell->loopDepth == 0) {
+        printf("%s: only meaningful in a for or while loop\n", args[0]);
+        fflush(stdout);
+        return 1 << 8;
+    }
+    int levels = 1;
+    if (args[1] != NULL) {
+        char* end;
+        levels = strtol(args[1], &end, 10);
+        if (*end != '\0' || end == args[1] || levels < 1) {
+            printf("%s: %s: loop count out of range\n", args[0], args[1]);
+            fflush(stdout);
+            return 1 << 8;
+        }
+    }
+    shell->loopControl = control;
+    shell->loopLevels = levels < shell->loopDepth ? levels : shell->loopDepth;
+    return 0;
+}
+
+/* breakCommand, continueCommand - The break and continue built in commands
+*   Inputs: args - Expanded arguments (break [N], continue [N]), shell - Shell state
+*   Outputs: 0, or exit value 1 if used outside a loop
+*/
+int breakCommand(char** args, struct shellState* shell) {
+    return setLoopControl(args, shell, LOOP_BREAK);
+}
+
+int continueCommand(char** args, struct shellState* shell) {
+    return setLoopControl(args, shell, LOOP_CONTINUE);
+}
+
+/* cdCommand - The cd built in command
+*   Inputs: args - Expanded arguments (cd [PATH]), shell - Shell state (unused)
+*   Outputs: 0 on success, exit value 1 if the directory could not be changed
+*/
+int cdCommand(char** args, struct shellState* shell) {
+    // Change directory to the supplied argument for new path (relative paths are relative to the CWD), or to the HOME directory without one
+    char* path = args[1] != NULL ? args[1] : getVariable("HOME");
+    if (path != NULL && chdir(path) == -1) {
+        printf("cd: %s: %s\n", path, strerror(errno));
+        fflush(stdout);
+        return 1 << 8;
+    }
+    refreshWorkingDirectory();
+    return 0;
+}
+
+/* statusCommand - The status built in command
+*   Inputs: args - Expanded arguments (status [-v]), shell - Shell state, for the last foreground command's status and statistics
+*   Outputs: 0
+*/
+int statusCommand(char** args, struct shellState* shell) {
+    // Prints out either the exit status or the terminating signal. 
+    // If it's run before any foreground command, return 0 (Status doesn't include the 3 foreground commands).
+    if (WIFEXITED(shell->lastStatus)) {
+        printf("exit value %d", WEXITSTATUS(shell->lastStatus));
+        fflush(stdout);
+    }
+    else {
+        printf("terminated by signal %d", WTERMSIG(shell->lastStatus));
+        fflush(stdout);
+    }
+    // status -v adds the resources used by the last foreground command
+    if (args[1] != NULL && strcmp(args[1], "-v") == 0) {
+        printf("\n");
+        printJobStats(stdout, &shell->lastStats);
+    }
+    return 0;
+}
+
+/* launchCommand - The launch built in command
+*   Inputs: args - Expanded arguments (launch [fork|vfork|spawn]), shell - Shell state (unused)
+*   Outputs: 0, or exit value 1 for an unknown mode
+*
+*   Purpose: Report or change the engine used to start child processes.
+*/
+int launchCommand(char** args, struct shellState* shell) {
+    char* modeNames[] = { "fork", "vfork", "spawn" };
+    if (args[1] == NULL) {
+        printf("%s\n", modeNames[launchMode]);
+        fflush(stdout);
+    }
+    else if (setLaunchMode(args[1]) == -1) {
+        printf("launch: unknown mode %s (expected fork, vfork or spawn)\n", args[1]);
+        fflush(stdout);
+        return 1 << 8;
+    }
+    return 0;
+}
+
+/* findJob - Find the job a fg, bg or wait argument refers to
+*   Inputs: name        - A PID, or NULL for the most recently started job
+*           commandName - Name of the command, for the error message
+*   Outputs: The list node of the process, or NULL (reported) if there is no such background process
+*/
+struct backgroundProcess* findJob(char* name, char* commandName) {
+    struct backgroundProcess* focusProcess = NULL;
+    if (name == NULL) {
+        focusProcess = lastJob;
+    }
+    else {
+        char* end;
+        long processID = strtol(name, &end, 10);
+        if (*name != '\0' && *end == '\0') {
+            focusProcess = findBackgroundProcess(processID);
+        }
+    }
+    if (focusProcess == NULL) {
+        printf("%s: %s: no such job\n", commandName, name != NULL ? name : "current");
+        fflush(stdout);
+    }
+    return focusProcess;
+}
+
+/* signalJob - Send a signal to every process of a job
+*   Inputs: focusProcess - Any process of the job, signo - The signal
+*   Outputs: None
+*/
+void signalJob(struct backgroundProcess* focusProcess, int signo) {
+    if (focusProcess->groupID != -1) {
+        kill(-focusProcess->groupID, signo);
+    }
+    else {
+        kill(focusProcess->processID, signo);
+    }
+}
+
+/* markJobRunning - Clear the stopped flag of every process of a job
+*   Inputs: listHead - Head Node of the background process linkedList, focusProcess - Any process of the job
+*   Outputs: None
+*/
+void markJobRunning(struct backgroundProcess* listHead, struct backgroundProcess* focusProcess) {
+    for (struct backgroundProcess* member = listHead->next; member != NULL; member = member->next) {
+        if (member == focusProcess || (focusProcess->groupID != -1 && member->groupID == focusProcess->groupID)) {
+            setProcessStopped(member, 0);
+        }
+    }
+}
+
+/* waitForProcess - Block until one background process exits
+*   Inputs: processID - The process, or -1 for any of them
+*   Outputs: The process's wait status, or exit value 127 if there was nothing to wait for
+*
+*   Purpose: wait4 blocks in the kernel until the child changes state, so nothing is polled. An exit is reported and recorded like
+*   one noticed at the prompt. A process stopped by a signal meanwhile is marked stopped and no longer waited for, since it could
+*   only be continued from another shell.
+*/
+int waitForProcess(pid_t processID) {
+    while (1) {
+        // wait4(-1) would never return while every remaining job is stopped
+        struct backgroundProcess* target = processID == -1 ? NULL : findBackgroundProcess(processID);
+        int anyRunning = processID == -1 ? (int)jobIndexCount > stoppedProcessCount : target != NULL && target->stopped == 0;
+        if (anyRunning == 0) {
+            return 127 << 8;
+        }
+
+        int status;
+        struct rusage usage;
+        pid_t finishedPid = wait4(processID, &status, WUNTRACED, &usage);
+        if (finishedPid == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return 127 << 8;
+        }
+        struct backgroundProcess* focusProcess = findBackgroundProcess(finishedPid);
+        if (focusProcess == NULL) {
+            continue;
+        }
+        if (WIFSTOPPED(status)) {
+            setProcessStopped(focusProcess, 1);
+            printf("\nbackground pid %d is stopped\n", finishedPid);
+            fflush(stdout);
+            continue;
+        }
+        reportBackgroundProcess(focusProcess, status, &usage);
+        return status;
+    }
+}
+
+/* waitCommand - The wait built in command
+*   Inputs: args - Expanded arguments (wait [-n] [PID...]), shell - Shell state, for the background process list
+*   Outputs: The wait status of the last process waited for, exit value 127 if there was none
+*
+*   Purpose: Block until background jobs finish, so scripts don't have to poll for them. Without arguments every running background
+*   process is waited for, with PIDs just those, and with -n only the next one to exit (whichever it is).
+*/
+int waitCommand(char** args, struct shellState* shell) {
+    if (args[1] != NULL && strcmp(args[1], "-n") == 0) {
+        return waitForProcess(-1);
+    }
+    int status = 0;
+    if (args[1] == NULL) {
+        while (status != (127 << 8)) {
+            status = waitForProcess(-1);
+        }
+        return 0;
+    }
+    for (int i = 1; args[i] != NULL; i++) {
+        struct backgroundProcess* focusProcess = findJob(args[i], "wait");
+        status = focusProcess != NULL ? waitForProcess(focusProcess->processID) : 127 << 8;
+    }
+    return status;
+}
+
+/* fgCommand - The fg built in command
+*   Inputs: args - Expanded arguments (fg [PID]), shell - Shell state, for the background process list
+*   Outputs: The wait status of the job's last process, or exit value 128 + SIGTSTP if it was stopped again
+*
+*   Purpose: Continue a background or stopped job (the most recent one by default) in the foreground. Its process group gets the
+*   terminal and SIGCONT, and its processes are waited for in the order they were started, like a foreground pipeline, collecting
+*   their statistics for status -v. If the job is stopped again it stays in the background process list.
+*/
+int fgCommand(char** args, struct shellState* shell) {
+    struct backgroundProcess* focusProcess = findJob(args[1], "fg");
+    if (focusProcess == NULL) {
+        return 1 << 8;
+    }
+    pid_t groupID = focusProcess->groupID;
+    printf("%s\n", focusProcess->commandText != NULL ? focusProcess->commandText : "");
+    fflush(stdout);
+    memset(&shell->lastStats, 0, sizeof(struct jobStats));
+    long long startTime = focusProcess->startTime;
+    if (groupID != -1) {
+        giveTerminal(groupID);
+    }
+    markJobRunning(shell->listHead, focusProcess);
+    signalJob(focusProcess, SIGCONT);
+
+    int status = 0;
+    while (focusProcess != NULL) {
+        struct rusage usage;
+        if (wait4(focusProcess->processID, &status, WUNTRACED, &usage) == -1 && errno == EINTR) {
+            continue;
+        }
+        if (WIFSTOPPED(status)) {
+            status = groupID != -1 ? stopJob(shell->listHead, groupID) : (128 + SIGTSTP) << 8;
+            setProcessStopped(focusProcess, 1);
+            break;
+        }
+        addUsage(&shell->lastStats, &usage);
+        removeBackgroundProcess(focusProcess);
+
+        // Move on to the next process of the job
+        focusProcess = NULL;
+        for (struct backgroundProcess* member = shell->listHead->next; groupID != -1 && member != NULL; member = member->next) {
+            if (member->groupID == groupID) {
+                focusProcess = member;
+                break;
+            }
+        }
+    }
+    shell->lastStats.wallNanoseconds = nowNanoseconds() - startTime;
+    if (groupID != -1) {
+        giveTerminal(getpgrp());
+    }
+    return status;
+}
+
+/* bgCommand - The bg built in command
+*   Inputs: args - Expanded arguments (bg [PID]), shell - Shell state, for the background process list
+*   Outputs: 0, or exit value 1 if there is no such job
+*
+*   Purpose: Continue a stopped job (the most recent one by default) in the background by sending SIGCONT to its process group.
+*/
+int bgCommand(char** args, struct shellState* shell) {
+    struct backgroundProcess* focusProcess = findJob(args[1], "bg");
+    if (focusProcess == NULL) {
+        return 1 << 8;
+    }
+    markJobRunning(shell->listHead, focusProcess);
+    signalJob(focusProcess, SIGCONT);
+    printf("background pid %d is running\n", focusProcess->processID);
+    fflush(stdout);
+    return 0;
+}
+
+/* openHistory - Open the history log
+*   Inputs: None
+*   Outputs: 0 on success, -1 if there is no history file
+*
+*   Purpose: The log is $SMALLSH_HISTORY (history is off when it is set but empty) or ~/.smallsh_history, one command per line.
+*   It is opened with O_APPEND and mapped as it is, so nothing is read or parsed at startup and opening it takes the same time
+*   however many entries it holds. Calling it again once the log is open does nothing, except in a forked copy of the shell
+*   running history in a pipeline, which has closed the inherited descriptor (see launchStage) and opens the log again.
+*/
+int openHistory() {
+    if (historyFd != -1 && fcntl(historyFd, F_GETFD) != -1) {
+        return 0;
+    }
+    char* path = getVariable("SMALLSH_HISTORY");
+    char defaultPath[4096];
+    if (path == NULL) {
+        char* home = getVariable("HOME");
+        if (home == NULL) {
+            return -1;
+        }
+        snprintf(defaultPath, sizeof(defaultPath), "%s/%s", home, HISTORY_FILE);
+        path = defaultPath;
+    }
+    if (*path == '\0') {
+        return -1;
+    }
+    historyFd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    return historyFd == -1 ? -1 : 0;
+}
+
+/* clearHistoryIndex - Forget every indexed entry
+*   Inputs: None
+*   Outputs: None
+*
+*   Purpose: Used when the log was truncated or can't be mapped. The posting lists keep their memory for the next indexing.
+*/
+void clearHistoryIndex() {
+    historyLineCount = 0;
+    historyIndexed = 0;
+    memset(historyPrefixHeads, 0, sizeof(historyPrefixHeads));
+    for (size_t i = 0; i < HISTORY_TRIGRAM_BUCKETS; i++) {
+        historyTrigrams[i].count = 0;
+    }
+}
+
+/* refreshHistory - Bring the mapping of the history log up to date
+*   Inputs: None
+*   Outputs: None
+*
+*   Purpose: Other shells append to the same log, so its size is checked before every lookup and the mapping is resized with
+*   mremap when it has changed. If the file was truncated the index starts over.
+*/
+void refreshHistory() {
+    struct stat logStat;
+    if (historyFd == -1 || fstat(historyFd, &logStat) == -1 || (size_t)logStat.st_size == historyLength) {
+        return;
+    }
+    size_t size = logStat.st_size;
+    if (size < historyLength) {
+        clearHistoryIndex();
+    }
+    char* resized = MAP_FAILED;
+    if (historyMap != NULL && size > 0) {
+        resized = mremap(historyMap, historyLength, size, MREMAP_MAYMOVE);
+    }
+    else if (size > 0) {
+        resized = mmap(NULL, size, PROT_READ, MAP_SHARED, historyFd, 0);
+    }
+    if (resized == MAP_FAILED) {
+        if (historyMap != NULL) {
+            munmap(historyMap, historyLength);
+        }
+        historyMap = NULL;
+        historyLength = 0;
+        clearHistoryIndex();
+        return;
+    }
+    historyMap = resized;
+    historyLength = size;
+}
+
+/* historyPrefixBucket - Hash the first bytes of a history entry or prefix
+*   Inputs: text - The entry or prefix, length - Number of bytes to hash (1 to HISTORY_PREFIX_BYTES)
+*   Outputs: Bucket number in historyPrefixHeads
+*/
+size_t historyPrefixBucket(const char* text, size_t length) {
+    size_t hash = 0;
+    for (size_t i = 0; i < length; i++) {
+        hash = hash * 131 + (unsigned char)text[i];
+    }
+    return hash % HISTORY_PREFIX_BUCKETS;
+}
+
+/* historyTrigramBucket - Hash a 3 byte sequence of a history entry or search text
+*   Inputs: text - Points at the 3 bytes
+*   Outputs: Bucket number in historyTrigrams
+*/
+size_t historyTrigramBucket(const char* text) {
+    unsigned char* bytes = (unsigned char*)text;
+    return ((bytes[0] << 16) ^ (bytes[1] << 8) ^ bytes[2]) * 2654435761u % HISTORY_TRIGRAM_BUCKETS;
+}
+
+/* indexHistory - Extend the line index over the part of the log not indexed yet
+*   Inputs: None
+*   Outputs: None
+*
+*   Purpose: Only the bytes added since the last call are scanned (with memchr), so repeated lookups cost nothing extra. Each new
+*   entry is also pushed onto the prefix index chains for its first 1, 2 and 3 bytes (as many as it has), which keeps every chain
+*   ordered from the newest entry to the oldest, and appended to the posting list of every 3 byte sequence it contains. Entries
+*   are indexed in order, so comparing with the last posting is enough to list an entry only once per bucket.
+*/
+void indexHistory() {
+    refreshHistory();
+    while (historyIndexed < historyLength) {
+        if (historyLineCount == historyLineCapacity) {
+            historyLineCapacity = historyLineCapacity == 0 ? 1024 : historyLineCapacity * 2;
+            historyLines = realloc(historyLines, historyLineCapacity * sizeof(size_t));
+            historyPrefixNext = realloc(historyPrefixNext, historyLineCapacity * HISTORY_PREFIX_BYTES * sizeof(size_t));
+        }
+        size_t number = historyLineCount++;
+        char* line = historyMap + historyIndexed;
+        historyLines[number] = historyIndexed;
+        char* newline = memchr(line, '\n', historyLength - historyIndexed);
+        historyIndexed = newline != NULL ? (size_t)(newline - historyMap) + 1 : historyLength;
+
+        size_t length = (historyMap + historyIndexed) - line - (newline != NULL);
+        for (size_t bytes = 1; bytes <= HISTORY_PREFIX_BYTES && bytes <= length; bytes++) {
+            size_t* head = &historyPrefixHeads[bytes - 1][historyPrefixBucket(line, bytes)];
+            historyPrefixNext[number * HISTORY_PREFIX_BYTES + bytes - 1] = *head;
+            *head = number + 1;
+        }
+        for (size_t i = 0; i + 3 <= length; i++) {
+            struct historyPostings* postings = &historyTrigrams[historyTrigramBucket(line + i)];
+            if (postings->count > 0 && postings->entries[postings->count - 1] == number) {
+                continue;
+            }
+            if (postings->count == postings->capacity) {
+                postings->capacity = postings->capacity == 0 ? 16 : postings->capacity * 2;
+                postings->entries = realloc(postings->entries, postings->capacity * sizeof(size_t));
+            }
+            postings->entries[postings->count++] = number;
+        }
+    }
+}
+
+/* historyEntry - Get one entry of the indexed history
+*   Inputs: number - Entry number, from 0, length - Receives the length of the entry (without its newline)
+*   Outputs: Pointer to the entry inside the mapping (not null terminated)
+*/
+char* historyEntry(size_t number, size_t* length) {
+    size_t end = number + 1 < historyLineCount ? historyLines[number + 1] : historyIndexed;
+    char* entry = historyMap + historyLines[number];
+    *length = end - historyLines[number];
+    if (*length > 0 && entry[*length - 1] == '\n') {
+        (*length)--;
+    }
+    return entry;
+}
+
+/* addHistory - Append a command line to the history log
+*   Inputs: line - The command line as it will be run
+*   Outputs: None
+*
+*   Purpose: Blank lines and comments are skipped. The entry and its newline go out in a single write on the O_APPEND descriptor,
+*   which the kernel performs atomically at the end of the file, so several shells can share one log without interleaving.
+*/
+void addHistory(char* line) {
+    size_t length = strlen(line);
+    if (historyFd == -1 || length == 0 || line[0] == '#' || strspn(line, " \t") == length) {
+        return;
+    }
+    char* entry = malloc(length + 1);
+    memcpy(entry, line, length);
+    entry[length] = '\n';
+    write(historyFd, entry, length + 1);
+    free(entry);
+}
+
+/* expandHistory - Replace a leading !! or !PREFIX with the command it recalls
+*   Inputs: arena - The command arena, which receives the new line, line - The line as typed
+*   Outputs: The line to run (line itself when it doesn't start with a recall), or NULL if no entry matched (reported)
+*
+*   Purpose: !! recalls the last entry and !PREFIX the most recent one that starts with PREFIX. The first word is replaced, the rest of
+*   the line is kept, and the resulting line is printed before it runs. !PREFIX follows the prefix index chain for the first (up to
+*   3) bytes of PREFIX from the newest entry back, so only entries sharing those bytes (or a hash bucket) are compared with memcmp,
+*   in place in the mapping.
+*/
+char* expandHistory(struct arena* arena, char* line) {
+    if (line[0] != '!' || line[1] == '\0' || line[1] == ' ' || line[1] == '\t' || line[1] == '=') {
+        return line;
+    }
+    size_t wordLength = strcspn(line, " \t");
+    char* prefix = line + 1;
+    size_t prefixLength = line[1] == '!' ? 0 : wordLength - 1;
+    indexHistory();
+
+    char* entry = NULL;
+    size_t entryLength = 0;
+    size_t length;
+    if (prefixLength == 0) {
+        // The last entry that isn't empty
+        for (size_t i = historyLineCount; i > 0 && entry == NULL; i--) {
+            char* candidate = historyEntry(i - 1, &length);
+            if (length > 0) {
+                entry = candidate;
+                entryLength = length;
+            }
+        }
+    }
+    else {
+        size_t bytes = prefixLength < HISTORY_PREFIX_BYTES ? prefixLength : HISTORY_PREFIX_BYTES;
+        size_t next = historyPrefixHeads[bytes - 1][historyPrefixBucket(prefix, bytes)];
+        while (next != 0 && entry == NULL) {
+            char* candidate = historyEntry(next - 1, &length);
+            if (length >= prefixLength && memcmp(candidate, prefix, prefixLength) == 0) {
+                entry = candidate;
+                entryLength = length;
+            }
+            next = historyPrefixNext[(next - 1) * HISTORY_PREFIX_BYTES + bytes - 1];
+        }
+    }
+    if (entry == NULL) {
+        printf("%.*s: event not found\n", (int)wordLength, line);
+        fflush(stdout);
+        return NULL;
+    }
+
+    size_t restLength = strlen(line + wordLength);
+    char* recalled = arenaAlloc(arena, entryLength + restLength + 1);
+    memcpy(recalled, entry, entryLength);
+    memcpy(recalled + entryLength, line + wordLength, restLength + 1);
+    printf("%s\n", recalled);
+    fflush(stdout);
+    return recalled;
+}
+
+/* historyCommand - The history built in command
+*   Inputs: args - Expanded arguments (history [COUNT] or history -s TEXT), shell - Shell state (unused)
+*   Outputs: 0, or exit value 1 if there is no history or no entry contains TEXT
+*
+*   Purpose: List the history with entry numbers, all of it or the last COUNT entries. With -s only the entries containing TEXT are
+*   listed. For TEXT of 3 bytes or more the substring index gives the candidates: of the posting lists for the 3 byte sequences of
+*   TEXT the shortest is walked and each entry on it is checked with memmem. Shorter TEXT has no sequence to look up, so memmem
+*   runs over the whole mapping at once and each match is turned into its entry by a binary search of the line index.
+*/
+int historyCommand(char** args, struct shellState* shell) {
+    if (openHistory() == -1) {
+        printf("history: no history file\n");
+        fflush(stdout);
+        return 1 << 8;
+    }
+    indexHistory();
+
+    if (args[1] != NULL && strcmp(args[1], "-s") == 0) {
+        if (args[2] == NULL || args[2][0] == '\0') {
+            printf("history: usage: history -s TEXT\n");
+            fflush(stdout);
+            return 1 << 8;
+        }
+        size_t textLength = strlen(args[2]);
+        int matches = 0;
+        if (textLength >= 3) {
+            struct historyPostings* shortest = NULL;
+            for (size_t i = 0; i + 3 <= textLength; i++) {
+                struct historyPostings* postings = &historyTrigrams[historyTrigramBucket(args[2] + i)];
+                if (shortest == NULL || postings->count < shortest->count) {
+                    shortest = postings;
+                }
+            }
+            for (size_t i = 0; i < shortest->count; i++) {
+                size_t length;
+                char* entry = historyEntry(shortest->entries[i], &length);
+                if (memmem(entry, length, args[2], textLength) != NULL) {
+                    printf("%5zu  %.*s\n", shortest->entries[i] + 1, (int)length, entry);
+                    matches++;
+                }
+            }
+        }
+        else {
+            size_t offset = 0;
+            char* match;
+            while (offset < historyIndexed && (match = memmem(historyMap + offset, historyIndexed - offset, args[2], textLength)) != NULL) {
+                // The entry is the last line starting at or before the match
+                size_t position = match - historyMap;
+                size_t low = 0;
+                size_t high = historyLineCount;
+                while (high - low > 1) {
+                    size_t middle = (low + high) / 2;
+                    if (historyLines[middle] <= position) {
+                        low = middle;
+                    }
+                    else {
+                        high = middle;
+                    }
+                }
+                size_t length;
+                char* entry = historyEntry(low, &length);
+                // A match running into the next line (the text contains a newline) is skipped
+                if (position + textLength <= historyLines[low] + length) {
+                    printf("%5zu  %.*s\n", low + 1, (int)length, entry);
+                    matches++;
+                }
+                offset = low + 1 < historyLineCount ? historyLines[low + 1] : historyIndexed;
+            }
+        }
+        fflush(stdout);
+        return matches > 0 ? 0 : 1 << 8;
+    }
+
+    size_t first = 0;
+    if (args[1] != NULL) {
+        long count = atol(args[1]);
+        if (count >= 0 && (size_t)count < historyLineCount) {
+            first = historyLineCount - count;
+        }
+    }
+    for (size_t i = first; i < historyLineCount; i++) {
+        size_t length;
+        char* entry = historyEntry(i, &length);
+        printf("%5zu  %.*s\n", i + 1, (int)length, entry);
+    }
+    fflush(stdout);
+    return 0;
+}
+
+/* traceCommand - The trace built in command
+*   Inputs: args - Expanded arguments (trace [FILE|FD|off|summary]), shell - Shell state (unused)
+*   Outputs: 0, or exit value 1 if the trace file could not be opened
+*
+*   Purpose: Report whether tracing is on, start it (like SMALLSH_TRACE) with records going to FILE or descriptor FD, stop it,
+*   or print the per-phase summary of everything traced so far.
+*/
+int traceCommand(char** args, struct shellState* shell) {
+    if (args[1] == NULL) {
+        printf("trace %s\n", traceFd == -1 ? "off" : "on");
+        fflush(stdout);
+    }
+    else if (strcmp(args[1], "off") == 0) {
+        if (traceFd != -1) {
+            close(traceFd);
+            traceFd = -1;
+        }
+    }
+    else if (strcmp(args[1], "summary") == 0) {
+        fflush(stdout);
+        printTraceSummary(1);
+    }
+    else if (startTrace(args[1]) == -1) {
+        printf("trace: %s: %s\n", args[1], strerror(errno));
+        fflush(stdout);
+        return 1 << 8;
+    }
+    return 0;
+}
+
+/* compareVariables - qsort comparison of two variable pointers by name
+*   Inputs: first, second - Pointers to struct shellVariable pointers
+*   Outputs: strcmp order of the names
+*/
+int compareVariables(const void* first, const void* second) {
+    return strcmp((*(struct shellVariable**)first)->name, (*(struct shellVariable**)second)->name);
+}
+
+/* printVariables - Print the shell variables sorted by name
+*   Inputs: exportedOnly - 1 to print only exported variables in export NAME=VALUE form, 0 to print all as NAME=VALUE
+*   Outputs: None
+*/
+void printVariables(int exportedOnly) {
+    struct shellVariable** sorted = malloc((variableCount + 1) * sizeof(struct shellVariable*));
+    int count = 0;
+    for (int bucket = 0; bucket < VARIABLE_BUCKETS; bucket++) {
+        for (struct shellVariable* variable = variableTable[bucket]; variable != NULL; variable = variable->next) {
+            if (variable->exported || exportedOnly == 0) {
+                sorted[count++] = variable;
+            }
+        }
+    }
+    qsort(sorted, count, sizeof(struct shellVariable*), compareVariables);
+    for (int i = 0; i < count; i++) {
+        printf("%s%s=%s\n", exportedOnly ? "export " : "", sorted[i]->name, sorted[i]->value);
+    }
+    fflush(stdout);
+    free(sorted);
+}
+
+/* assignVariables - Apply the NAME=VALUE (or, for export, bare NAME) arguments of set and export
+*   Inputs: args - Expanded arguments, args[0] is the command name, exported - 1 for export, 0 for set
+*   Outputs: 0, or exit value 1 if any argument was not a valid name or assignment (the others are still applied)
+*/
+int assignVariables(char** args, int exported) {
+    int result = 0;
+    for (int i = 1; args[i] != NULL; i++) {
+        char* separator = strchr(args[i], '=');
+        size_t nameLength = separator != NULL ? (size_t)(separator - args[i]) : strlen(args[i]);
+        int valid = nameLength > 0 && (isalpha((unsigned char)args[i][0]) || args[i][0] == '_');
+        for (size_t j = 1; j < nameLength && valid; j++) {
+            valid = isalnum((unsigned char)args[i][j]) || args[i][j] == '_';
+        }
+        if (valid == 0 || (separator == NULL && exported == 0)) {
+            printf("%s: %s: not a valid %s\n", args[0], args[i], exported ? "identifier" : "assignment");
+            fflush(stdout);
+            result = 1 << 8;
+            continue;
+        }
+        char* name = strndup(args[i], nameLength);
+        setVariable(name, separator != NULL ? separator + 1 : NULL, exported);
+        free(name);
+    }
+    return result;
+}
+
+/* setCommand - The set built in command
+*   Inputs: args - Expanded arguments (set [NAME=VALUE...]), shell - Shell state (unused)
+*   Outputs: 0, or exit value 1 if an argument was not a valid assignment
+*
+*   Purpose: Without arguments, print every variable sorted by name. Otherwise give each named variable its value, keeping it
+*   exported if it already was.
+*/
+int setCommand(char** args, struct shellState* shell) {
+    if (args[1] == NULL) {
+        printVariables(0);
+        return 0;
+    }
+    return assignVariables(args, 0);
+}
+
+/* exportCommand - The export built in command
+*   Inputs: args - Expanded arguments (export [NAME[=VALUE]...]), shell - Shell state (unused)
+*   Outputs: 0, or exit value 1 if an argument was not a valid name or assignment
+*
+*   Purpose: Without arguments, print the exported variables. Otherwise mark each named variable for export to child processes,
+*   giving it a value first when one is supplied.
+*/
+int exportCommand(char** args, struct shellState* shell) {
+    if (args[1] == NULL) {
+        printVariables(1);
+        return 0;
+    }
+    return assignVariables(args, 1);
+}
+
+/* unsetCommand - The unset built in command
+*   Inputs: args - Expanded arguments (unset NAME...), shell - Shell state (unused)
+*   Outputs: 0
+*/
+int unsetCommand(char** args, struct shellState* shell) {
+    for (int i = 1; args[i] != NULL; i++) {
+        unsetVariable(args[i]);
+    }
+    return 0;
+}
+
+/* echoCommand - The echo built in utility
+*   Inputs: args - Expanded arguments (echo [-n] [WORDS...]), shell - Shell state (unused, NULL in a forked stage)
+*   Outputs: 0
+*
+*   Purpose: Print the words separated by spaces, followed by a newline unless -n is given first.
+*/
+int echoCommand(char** args, struct shellState* shell) {
+    int first = 1;
+    int newline = 1;
+    if (args[1] != NULL && strcmp(args[1], "-n") == 0) {
+        newline = 0;
+        first = 2;
+    }
+    for (int i = first; args[i] != NULL; i++) {
+        if (i > first) {
+            putchar(' ');
+        }
+        fputs(args[i], stdout);
+    }
+    if (newline) {
+        putchar('\n');
+    }
+    fflush(stdout);
+    return 0;
+}
+
+/* trueCommand, falseCommand - The true and false built in utilities
+*   Inputs: args - Expanded arguments (ignored), shell - Shell state (unused)
+*   Outputs: Exit value 0 for true and 1 for false
+*/
+int trueCommand(char** args, struct shellState* shell) {
+    return 0;
+}
+
+int falseCommand(char** args, struct shellState* shell) {
+    return 1 << 8;
+}
+
+/* pwdCommand - The pwd built in utility
+*   Inputs: args - Expanded arguments (ignored), shell - Shell state (unused)
+*   Outputs: 0, or exit value 1 if the working directory could not be read
+*/
+int pwdCommand(char** args, struct shellState* shell) {
+    char directory[4096];
+    if (getcwd(directory, sizeof(directory)) == NULL) {
+        printf("pwd: %s\n", strerror(errno));
+        fflush(stdout);
+        return 1 << 8;
+    }
+    printf("%s\n", directory);
+    fflush(stdout);
+    return 0;
+}
+
+/* testInteger - Read an integer operand of test
+*   Inputs: text - The operand, value - Receives the number
+*   Outputs: 0 on success, -1 (after printing an error) if the operand is not a whole number
+*/
+int testInteger(char* text, long long* value) {
+    char* end;
+    errno = 0;
+    *value = strtoll(text, &end, 10);
+    if (*text == '\0' || *end != '\0' || errno != 0) {
+        printf("test: %s: integer expression expected\n", text);
+        fflush(stdout);
+        return -1;
+    }
+    return 0;
+}
+
+/* testExpression - Evaluate the expression given to test or [
+*   Inputs: args - The operands, count - Number of operands
+*   Outputs: 0 if the expression is true, 1 if it is false and 2 if it is malformed
+*
+*   Purpose: Supports the forms used in scripts: a lone string (true when not empty), ! EXPRESSION, the string tests -n and -z,
+*   the file tests -e -f -d -r -w -x -s -L and -h, the string comparisons = == and !=, and the integer comparisons -eq -ne -lt
+*   -le -gt and -ge.
+*/
+int testExpression(char** args, int count) {
+    if (count == 0) {
+        return 1;
+    }
+    if (count > 1 && strcmp(args[0], "!") == 0) {
+        int result = testExpression(args + 1, count - 1);
+        return result == 2 ? 2 : !result;
+    }
+    if (count == 1) {
+        return args[0][0] == '\0';
+    }
+    if (count == 2) {
+        char* operand = args[1];
+        struct stat fileInfo;
+        if (strcmp(args[0], "-n") == 0) {
+            return operand[0] == '\0';
+        }
+        if (strcmp(args[0], "-z") == 0) {
+            return operand[0] != '\0';
+        }
+        if (strcmp(args[0], "-L") == 0 || strcmp(args[0], "-h") == 0) {
+            return !(lstat(operand, &fileInfo) == 0 && S_ISLNK(fileInfo.st_mode));
+        }
+        if (strcmp(args[0], "-r") == 0) {
+            return access(operand, R_OK) != 0;
+        }
+        if (strcmp(args[0], "-w") == 0) {
+            return access(operand, W_OK) != 0;
+        }
+        if (strcmp(args[0], "-x") == 0) {
+            return access(operand, X_OK) != 0;
+        }
+        if (strlen(args[0]) == 2 && args[0][0] == '-' && strchr("efds", args[0][1]) != NULL) {
+            if (stat(operand, &fileInfo) == -1) {
+                return 1;
+            }
+            switch (args[0][1]) {
+            case 'f':
+                return !S_ISREG(fileInfo.st_mode);
+            case 'd':
+                return !S_ISDIR(fileInfo.st_mode);
+            case 's':
+                return fileInfo.st_size == 0;
+            default:
+                return 0;
+            }
+        }
+        printf("test: %s: unary operator expected\n", args[0]);
+        fflush(stdout);
+        return 2;
+    }
+    if (count == 3) {
+        char* operator = args[1];
+        if (strcmp(operator, "=") == 0 || strcmp(operator, "==") == 0) {
+            return strcmp(args[0], args[2]) != 0;
+        }
+        if (strcmp(operator, "!=") == 0) {
+            return strcmp(args[0], args[2]) == 0;
+        }
+        char* integerOperators[] = { "-eq", "-ne", "-lt", "-le", "-gt", "-ge" };
+        for (int i = 0; i < 6; i++) {
+            if (strcmp(operator, integerOperators[i]) != 0) {
+                continue;
+            }
+            long long left;
+            long long right;
+            if (testInteger(args[0], &left) == -1 || testInteger(args[2], &right) == -1) {
+                return 2;
+            }
+            int results[] = { left == right, left != right, left < right, left <= right, left > right, left >= right };
+            return !results[i];
+        }
+        printf("test: %s: binary operator expected\n", operator);
+        fflush(stdout);
+        return 2;
+    }
+    printf("test: too many arguments\n");
+    fflush(stdout);
+    return 2;
+}
+
+/* testCommand - The test and [ built in utilities
+*   Inputs: args - Expanded arguments (test EXPRESSION, or [ EXPRESSION ]), shell - Shell state (unused)
+*   Outputs: Exit value 0 if the expression is true, 1 if it is false and 2 if it is malformed
+*/
+int testCommand(char** args, struct shellState* shell) {
+    int count = 0;
+    while (args[count + 1] != NULL) {
+        count++;
+    }
+    if (strcmp(args[0], "[") == 0) {
+        if (count == 0 || strcmp(args[count], "]") != 0) {
+            printf("[: missing ]\n");
+            fflush(stdout);
+            return 2 << 8;
+        }
+        count--;
+    }
+    return testExpression(args + 1, count) << 8;
+}
+
+/* translateEscape - Translate the character after a backslash in a printf format or %b argument
+*   Inputs: character - The character following the backslash
+*   Outputs: The character the escape stands for, or -1 if it isn't one (the backslash is then printed as it is)
+*/
+int translateEscape(char character) {
+    char* escapes = "n\nt\tr\r\\\\a\ab\bf\fv\v";
+    char* match = strchr(escapes, character);
+    if (character == '0') {
+        return '\0';
+    }
+    if (character != '\0' && match != NULL && (match - escapes) % 2 == 0) {
+        return match[1];
+    }
+    return -1;
+}
+
+/* expandEscapes - Translate the backslash escapes of a printf %b argument
+*   Inputs: text - The argument, length - Receives the length of the result, stop - Set to 1 if the argument holds \c
+*   Outputs: The translated argument (malloc'ed), cut short at \c, which ends all output of the printf
+*/
+char* expandEscapes(const char* text, size_t* length, int* stop) {
+    char* result = malloc(strlen(text) + 1);
+    size_t used = 0;
+    for (; *text != '\0'; text++) {
+        if (*text == '\\' && text[1] == 'c') {
+            *stop = 1;
+            break;
+        }
+        int translated = *text == '\\' ? translateEscape(text[1]) : -1;
+        if (translated != -1) {
+            result[used++] = translated;
+            text++;
+        }
+        else {
+            result[used++] = *text;
+        }
+    }
+    result[used] = '\0';
+    *length = used;
+    return result;
+}
+
+/* printfCommand - The printf built in utility
+*   Inputs: args - Expanded arguments (printf FORMAT [ARGUMENTS...]), shell - Shell state (unused)
+*   Outputs: 0, exit value 1 if the format had an unknown conversion or 2 without a format
+*
+*   Purpose: Print the arguments under control of the format, which is repeated while arguments are left over.
+*
+*   Procedure:
+*   The format is copied to stdout with the escapes \n \t \r \\ \a \b \f \v and \0 translated. Each conversion (%s %b %c %d %i %u
+*   %o %x %X %e %f %g with optional flags, width and precision) takes the next argument, a missing argument counting as an empty
+*   string or 0. The conversion is rebuilt with the C length modifier for its type and handed to printf. %% prints a percent sign.
+*   %b prints its argument with the same escapes translated, and a \c in it ends the output there.
+*/
+int printfCommand(char** args, struct shellState* shell) {
+    if (args[1] == NULL) {
+        printf("printf: usage: printf FORMAT [ARGUMENTS...]\n");
+        fflush(stdout);
+        return 2 << 8;
+    }
+    char** values = args + 2;
+    int result = 0;
+    int stop = 0;
+    int consumed;
+    do {
+        consumed = 0;
+        for (char* cursor = args[1]; *cursor != '\0' && stop == 0; cursor++) {
+            if (*cursor == '\\' && cursor[1] != '\0') {
+                int translated = translateEscape(*++cursor);
+                if (translated != -1) {
+                    putchar(translated);
+                }
+                else {
+                    putchar('\\');
+                    putchar(*cursor);
+                }
+                continue;
+            }
+            if (*cursor != '%') {
+                putchar(*cursor);
+                continue;
+            }
+            if (cursor[1] == '%') {
+                putchar('%');
+                cursor++;
+                continue;
+            }
+
+            // Copy the flags, width and precision, then add the length modifier and the conversion
+            char spec[40];
+            int length = 0;
+            spec[length++] = *cursor++;
+            while (*cursor != '\0' && strchr("-+ #0123456789.", *cursor) != NULL && length < 32) {
+                spec[length++] = *cursor++;
+            }
+            char conversion = *cursor;
+            if (conversion == '\0') {
+                cursor--;
+                break;
+            }
+            char* value = "";
+            if (*values != NULL) {
+                value = *values++;
+                consumed = 1;
+            }
+            if (conversion == 's') {
+                spec[length++] = 's';
+                spec[length] = '\0';
+                printf(spec, value);
+            }
+            else if (conversion == 'b') {
+                size_t expandedLength;
+                char* expanded = expandEscapes(value, &expandedLength, &stop);
+                spec[length++] = 's';
+                spec[length] = '\0';
+                // Without a width or precision the whole result is written, including any \0
+                if (length == 2) {
+                    fwrite(expanded, 1, expandedLength, stdout);
+                }
+                else {
+                    printf(spec, expanded);
+                }
+                free(expanded);
+            }
+            else if (conversion == 'c') {
+                spec[length++] = 'c';
+                spec[length] = '\0';
+                if (value[0] != '\0') {
+                    printf(spec, value[0]);
+                }
+            }
+            else if (strchr("diuoxX", conversion) != NULL) {
+                spec[length++] = 'l';
+                spec[length++] = 'l';
+                spec[length++] = conversion;
+                spec[length] = '\0';
+                printf(spec, strtoll(value, NULL, 0));
+            }
+            else if (strchr("eEfFgG", conversion) != NULL) {
+                spec[length++] = conversion;
+                spec[length] = '\0';
+                printf(spec, strtod(value, NULL));
+            }
+            else {
+                fflush(stdout);
+                printf("printf: %%%c: invalid conversion\n", conversion);
+                result = 1 << 8;
+                break;
+            }
+        }
+    } while (*values != NULL && consumed && result == 0 && stop == 0);
+    fflush(stdout);
+    return result;
+}
+
+/* The built in commands, see the Builtin Command Struct */
+struct builtinCommand builtinCommands[] = {
+    { "exit", exitCommand, 0 },
+    { "break", breakCommand, BUILTIN_SETS_STATUS },
+    { "continue", continueCommand, BUILTIN_SETS_STATUS },
+    { "cd", cdCommand, 0 },
+    { "status", statusCommand, 0 },
+    { "jobs", jobsCommand, 0 },
+    { "trace", traceCommand, 0 },
+    { "history", historyCommand, BUILTIN_FORKABLE },
+    { "wait", waitCommand, BUILTIN_SETS_STATUS },
+    { "fg", fgCommand, BUILTIN_SETS_STATUS },
+    { "bg", bgCommand, 0 },
+    { "hash", hashCommand, 0 },
+    { "parallel", parallelCommand, BUILTIN_FORKABLE | BUILTIN_SETS_STATUS },
+    { "placement", placementCommand, 0 },
+    { "launch", launchCommand, 0 },
+    { "set", setCommand, BUILTIN_FORKABLE },
+    { "export", exportCommand, BUILTIN_FORKABLE },
+    { "unset", unsetCommand, 0 },
+    { "echo", echoCommand, BUILTIN_FORKABLE | BUILTIN_SETS_STATUS | BUILTIN_PURE },
+    { "true", trueCommand, BUILTIN_FORKABLE | BUILTIN_SETS_STATUS | BUILTIN_PURE },
+    { "false", falseCommand, BUILTIN_FORKABLE | BUILTIN_SETS_STATUS | BUILTIN_PURE },
+    { "pwd", pwdCommand, BUILTIN_FORKABLE | BUILTIN_SETS_STATUS | BUILTIN_PURE },
+    { "test", testCommand, BUILTIN_FORKABLE | BUILTIN_SETS_STATUS | BUILTIN_PURE },
+    { "[", testCommand, BUILTIN_FORKABLE | BUILTIN_SETS_STATUS | BUILTIN_PURE },
+    { "printf", printfCommand, BUILTIN_FORKABLE | BUILTIN_SETS_STATUS | BUILTIN_PURE },
+};
+
+/* registerBuiltins - Build the built in command lookup table
+*   Inputs: None
+*   Outputs: None
+*
+*   Purpose: Seeds are tried in turn until one places every built in command in its own slot of builtinSlots. With a few dozen
+*   names in BUILTIN_SLOTS slots a seed is found after a handful of attempts, once at startup.
+*/
+void registerBuiltins() {
+    int count = sizeof(builtinCommands) / sizeof(builtinCommands[0]);
+    for (builtinSeed = 0; ; builtinSeed++) {
+        memset(builtinSlots, 0, sizeof(builtinSlots));
+        int placed = 0;
+        while (placed < count) {
+            unsigned int slot = builtinSlot(builtinCommands[placed].name, builtinSeed);
+            if (builtinSlots[slot] != NULL) {
+                break;
+            }
+            builtinSlots[slot] = &builtinCommands[placed];
+            placed++;
+        }
+        if (placed == count) {
+            return;
+        }
+    }
+}
+
+/* runBuiltin - Run a built in command inside the shell
+*   Inputs: builtin - The command, args - Its expanded arguments, shell - Shell state, with the command's parse
+*   Outputs: The command's wait status, or exit value 1 if a redirection failed
+*
+*   Purpose: Built in commands run without creating a process, so their redirections are applied to the shell itself. redirectIO
+*   prepares the descriptor actions as for a child, then each descriptor an action changes is first saved above 9 with
+*   F_DUPFD_CLOEXEC (or noted as closed), the actions are applied in order for the length of the command, and the saved
+*   descriptors are put back afterwards in reverse order.
+*/
+int runBuiltin(struct builtinCommand* builtin, char** args, struct shellState* shell) {
+    struct simpleCommand* stageCommand = shell->command->stages;
+    if (stageCommand->redirections == NULL) {
+        return builtin->run(args, shell);
+    }
+
+    struct stageLaunch redirected = { 0 };
+    redirected.inFd = -1;
+    redirected.outFd = -1;
+    int result = 1 << 8;
+    if (redirectIO(shell->arena, stageCommand, 0, 0, &redirected) == 0) {
+        struct fdAction saved[STAGE_FD_ACTIONS];
+        int savedCount = 0;
+        fflush(stdout);
+        for (int i = 0; i < redirected.fdActionCount; i++) {
+            struct fdAction* action = &redirected.fdActions[i];
+            int alreadySaved = 0;
+            for (int j = 0; j < savedCount; j++) {
+                alreadySaved |= (saved[j].target == action->target);
+            }
+            if (alreadySaved == 0) {
+                saved[savedCount].target = action->target;
+                saved[savedCount].source = fcntl(action->target, F_DUPFD_CLOEXEC, 10);
+                savedCount++;
+            }
+            if (action->source == -1) {
+                close(action->target);
+            }
+            else {
+                dup2(action->source, action->target);
+            }
+        }
+        result = builtin->run(args, shell);
+        fflush(stdout);
+
+        // A descriptor the shell didn't have open (nothing to save) is closed again
+        for (int i = savedCount - 1; i >= 0; i--) {
+            if (saved[i].source == -1) {
+                close(saved[i].target);
+            }
+            else {
+                dup2(saved[i].source, saved[i].target);
+                close(saved[i].source);
+            }
+        }
+    }
+    closeOpenedFds(&redirected);
+    return result;
+}
+
+/* readCommandLine - Wait for the next line of input while reporting finished background processes
+*   Inputs: reader - The input line reader (descriptor and buffer)
+*           prompt - Prompt to print again after a background notice interrupts the wait, or NULL for none
+*   Outputs: Pointer to the next line without its newline (valid until the next call), or NULL at end of input
+*
+*   Purpose: Replace the blocking fgets call of the prompt loop with a wait on both the input and the child exit signal, so a
+*   background process that finishes while the user is typing is reported immediately instead of after the next command.
+*
+*   Procedure:
+*   The buffer is first searched for a complete line, which is returned straight away. Otherwise epoll_wait blocks on the input
+*   descriptor and childSignalFd together. A child exit calls cleanupBackgroundProcesses and re-prints the prompt if anything was
+*   reported. Readable input is read() onto the end of the buffer, which grows as needed so lines have no length limit. When the
+*   input can not be used with epoll (a regular file), the function reads directly. At end of input any unterminated last line is
+*   returned once, then NULL.
+*/
+char* readCommandLine(struct lineReader* reader, char* prompt) {
+    while (1) {
+        // Return a complete line if one is already buffered
+        char* lineStart = reader->buffer + reader->start;
+        char* newline = memchr(lineStart, '\n', reader->length - reader->start);
+        if (newline != NULL) {
+            *newline = '\0';
+            reader->start = newline - reader->buffer + 1;
+            return lineStart;
+        }
+        if (reader->endOfInput) {
+            if (reader->start < reader->length) {
+                // A mapped script has no room after its last byte, so an unterminated last line is copied out to be terminated
+                int lineLength = reader->length - reader->start;
+                if (reader->length >= reader->capacity) {
+                    lineStart = malloc(lineLength + 1);
+                    memcpy(lineStart, reader->buffer + reader->start, lineLength);
+                }
+                lineStart[lineLength] = '\0';
+                reader->start = reader->length;
+                return lineStart;
+            }
+            return NULL;
+        }
+
+        // Move the partial line to the front of the buffer and make room for more input
+        if (reader->start > 0) {
+            memmove(reader->buffer, lineStart, reader->length - reader->start);
+            reader->length -= reader->start;
+            reader->start = 0;
+        }
+        if (reader->length + 1 >= reader->capacity) {
+            reader->capacity *= 2;
+            reader->buffer = realloc(reader->buffer, reader->capacity);
+        }
+
+        // Wait for input or a child exit
+        if (inputEpollFd != -1) {
+            struct epoll_event events[2];
+            int ready = epoll_wait(inputEpollFd, events, 2, -1);
+            int inputReady = 0;
+            for (int i = 0; i < ready; i++) {
+                if (events[i].data.fd == childSignalFd) {
+                    if (cleanupBackgroundProcesses() > 0 && prompt != NULL) {
+                        printf("%s", prompt);
+                        fflush(stdout);
+                    }
+                }
+                else {
+                    inputReady = 1;
+                }
+            }
+            if (inputReady == 0) {
+                continue;
+            }
+        }
+        ssize_t received = read(reader->fd, reader->buffer + reader->length, reader->capacity - reader->length - 1);
+        if (received == -1 && errno == EINTR) {
+            continue;
+        }
+        if (received <= 0) {
+            reader->endOfInput = 1;
+        }
+        else {
+            reader->length += received;
+        }
+    }
+}
+
+/* readHereDocuments - Read the bodies of a command's here-documents
+*   Inputs: arena    - The command arena, which keeps the bodies
+*           command  - The parsed command, whose here-document targets are still their delimiters
+*           reader   - The input line reader the command came from
+*           prompt   - Continuation prompt printed before every body line, or NULL for none
+*   Outputs: None
+*
+*   Purpose: The lines following a command are the bodies of its here-documents, in the order the << operators were typed, each
+*   ending at a line that is exactly its delimiter (or at the end of input). A body replaces the delimiter as the redirection's target
+*   and is flagged for $ expansion like a word, unless the delimiter was written in quotes ('EOF' or "EOF"), which are removed.
+*/
+void readHereDocuments(struct arena* arena, struct commandLine* command, struct lineReader* reader, char* prompt) {
+    for (struct simpleCommand* stageCommand = command->stages; stageCommand != NULL; stageCommand = stageCommand->next) {
+        for (struct redirection* redirect = stageCommand->redirections; redirect != NULL; redirect = redirect->next) {
+            if (redirect->type != REDIRECT_HEREDOC) {
+                continue;
+            }
+            char* delimiter = redirect->target;
+            size_t delimiterLength = strlen(delimiter);
+            int quoted = delimiterLength >= 2 && (delimiter[0] == '\'' || delimiter[0] == '"') && delimiter[delimiterLength - 1] == delimiter[0];
+            if (quoted) {
+                delimiter[delimiterLength - 1] = '\0';
+                delimiter++;
+            }
+
+            size_t used = 0;
+            while (1) {
+                if (prompt != NULL) {
+                    printf("%s", prompt);
+                    fflush(stdout);
+                }
+                char* line = readCommandLine(reader, prompt);
+                if (line == NULL || strcmp(line, delimiter) == 0) {
+                    break;
+                }
+                appendExpanded(&used, line, strlen(line));
+                appendExpanded(&used, "\n", 1);
+            }
+            char* body = arenaAlloc(arena, used + 1);
+            if (used > 0) {
+                memcpy(body, expandBuffer, used);
+            }
+            body[used] = '\0';
+            redirect->target = body;
+            redirect->targetFlags = (quoted == 0 && memchr(body, '$', used) != NULL) ? WORD_EXPAND : 0;
+        }
+    }
+}
+
+/* openScriptInput - Set up the line reader to run the commands in a script file
+*   Inputs: reader - The line reader to initialize
+*           path   - Path of the script file
+*   Outputs: 0 on success, -1 if the file could not be opened or mapped
+*
+*   Purpose: Batch scripts can hold hundreds of thousands of lines. Mapping the whole file into memory lets readCommandLine split it
+*   into lines in place, with no system call per line and no copy of the file through a read buffer.
+*
+*   Procedure:
+*   The file is opened and mapped privately with write access, so readCommandLine can terminate each line in place (only the pages
+*   actually written to are copied by the kernel). The reader is marked as already at end of input so it never tries to read more.
+*/
+int openScriptInput(struct lineReader* reader, char* path) {
+    int scriptFd = open(path, O_RDONLY | O_CLOEXEC);
+    if (scriptFd == -1) {
+        return -1;
+    }
+    struct stat scriptInfo;
+    if (fstat(scriptFd, &scriptInfo) == -1) {
+        close(scriptFd);
+        return -1;
+    }
+    reader->fd = -1;
+    reader->start = 0;
+    reader->length = scriptInfo.st_size;
+    reader->capacity = scriptInfo.st_size;
+    reader->endOfInput = 1;
+    reader->buffer = "";
+    if (scriptInfo.st_size > 0) {
+        reader->buffer = mmap(NULL, scriptInfo.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, scriptFd, 0);
+        if (reader->buffer == MAP_FAILED) {
+            close(scriptFd);
+            return -1;
+        }
+        madvise(reader->buffer, scriptInfo.st_size, MADV_SEQUENTIAL);
+    }
+    close(scriptFd);
+    return 0;
+}
+
+/* openStringInput - Set up the line reader to run the commands given with -c
+*   Inputs: reader - The line reader to initialize, commands - The command string, which may contain several lines
+*   Outputs: None
+*/
+void openStringInput(struct lineReader* reader, char* commands) {
+    reader->fd = -1;
+    reader->start = 0;
+    reader->length = strlen(commands);
+    reader->capacity = reader->length + 1;
+    reader->buffer = malloc(reader->capacity);
+    memcpy(reader->buffer, commands, reader->capacity);
+    reader->endOfInput = 1;
+}
+
+/* Script Keywords
+*   The reserved words that start, divide and end the compound commands. A segment whose first word is one of them is handled by
+*   parseScriptNode, and the other values it reports when a list ends are SCRIPT_END (no more input) and SCRIPT_ERROR (a syntax
+*   error, already reported).
+*/
+#define KEYWORD_NONE 0
+#define KEYWORD_IF 1
+#define KEYWORD_THEN 2
+#define KEYWORD_ELIF 3
+#define KEYWORD_ELSE 4
+#define KEYWORD_FI 5
+#define KEYWORD_WHILE 6
+#define KEYWORD_DO 7
+#define KEYWORD_DONE 8
+#define KEYWORD_FOR 9
+#define SCRIPT_END 10
+#define SCRIPT_ERROR 11
+char* keywordNames[] = { "", "if", "then", "elif", "else", "fi", "while", "do", "done", "for" };
+
+/* splitSegment - Cut the next ; separated segment off a line
+*   Inputs: text - The rest of the line, rest - Set to the text after the ;, or NULL when the segment runs to the end of the line
+*   Outputs: None
+*
+*   Purpose: A ; separates commands like a new line does, except inside a $( ), which is parsed again when it runs. A line whose first
+*   word starts with # is a comment, including any ; in it.
+*/
+void splitSegment(char* text, char** rest) {
+    char* position = text + strspn(text, " \t");
+    *rest = NULL;
+    if (*position == '#') {
+        return;
+    }
+    int substitutionDepth = 0;
+    for (; *position != '\0'; position++) {
+        if (*position == '$' && position[1] == '(') {
+            substitutionDepth++;
+            position++;
+        }
+        else if (*position == '(' && substitutionDepth > 0) {
+            substitutionDepth++;
+        }
+        else if (*position == ')' && substitutionDepth > 0) {
+            substitutionDepth--;
+        }
+        else if (*position == ';' && substitutionDepth == 0) {
+            *position = '\0';
+            *rest = position + 1;
+            return;
+        }
+    }
+}
+
+/* nextSegment - Get the next command segment for the script parser
+*   Inputs: parser - The script parser
+*   Outputs: The segment, or NULL at the end of the input
+*
+*   Purpose: Segments come from the pushback slot first, then from the rest of the current line, and only then is another line read
+*   (after the ": " prompt, or "> " inside an unfinished compound command). Interactive lines go through history expansion and are
+*   recorded as they are read. Each line is copied into the parser's arena because the reader reuses its buffer for the next line
+*   while the parsed tree still points into this one.
+*/
+char* nextSegment(struct scriptParser* parser) {
+    if (parser->pushback != NULL) {
+        char* segment = parser->pushback;
+        parser->pushback = NULL;
+        return segment;
+    }
+    if (parser->pending == NULL) {
+        char* prompt = parser->interactive ? (parser->depth > 0 ? "> " : ": ") : NULL;
+        if (prompt != NULL) {
+            printf("%s", prompt);
+            fflush(stdout);
+        }
+        char* line = readCommandLine(parser->reader, prompt);
+        if (line == NULL) {
+            return NULL;
+        }
+
+        // Interactive lines can recall earlier ones with !! and !PREFIX, and are recorded in the history log as they will run
+        if (parser->interactive) {
+            char* recalled = expandHistory(parser->arena, line);
+            if (recalled == NULL) {
+                parser->shell->lastStatus = 1 << 8;
+                recalled = line + strlen(line);
+            }
+            addHistory(recalled);
+            line = recalled;
+        }
+        size_t length = strlen(line);
+        parser->pending = arenaAlloc(parser->arena, length + 1);
+        memcpy(parser->pending, line, length + 1);
+    }
+    char* segment = parser->pending;
+    splitSegment(segment, &parser->pending);
+    return segment;
+}
+
+/* segmentKeyword - Find out whether a segment starts with a keyword
+*   Inputs: segment - The segment, remainder - Set to the text after the keyword
+*   Outputs: One of the KEYWORD_ values, KEYWORD_NONE for an ordinary command
+*/
+int segmentKeyword(char* segment, char** remainder) {
+    char* word = segment + strspn(segment, " \t");
+    size_t length = strcspn(word, " \t");
+    for (int keyword = KEYWORD_IF; keyword <= KEYWORD_FOR; keyword++) {
+        if (strlen(keywordNames[keyword]) == length && memcmp(word, keywordNames[keyword], length) == 0) {
+            *remainder = word + length;
+            return keyword;
+        }
+    }
+    return KEYWORD_NONE;
+}
+
+struct scriptNode* parseScriptNode(struct scriptParser* parser, int* terminator);
+
+/* parseCommandList - Parse commands up to one of the keywords that can end the list
+*   Inputs: parser     - The script parser
+*           allowed    - Bit mask (1 << KEYWORD_) of the keywords that end the list
+*           terminator - Set to the keyword that ended the list, or SCRIPT_ERROR
+*   Outputs: The first command of the list (NULL for an empty list), or NULL after reporting a syntax error
+*/
+struct scriptNode* parseCommandList(struct scriptParser* parser, int allowed, int* terminator) {
+    struct scriptNode* head = NULL;
+    struct scriptNode** tail = &head;
+    while (1) {
+        int end;
+        struct scriptNode* node = parseScriptNode(parser, &end);
+        if (node != NULL) {
+            *tail = node;
+            tail = &node->next;
+            continue;
+        }
+        if (end != SCRIPT_END && end != SCRIPT_ERROR && (allowed & (1 << end))) {
+            *terminator = end;
+            return head;
+        }
+        if (end == SCRIPT_END) {
+            printf("syntax error: unexpected end of input\n");
+            fflush(stdout);
+        }
+        else if (end != SCRIPT_ERROR) {
+            printf("syntax error near unexpected token %s\n", keywordNames[end]);
+            fflush(stdout);
+        }
+        *terminator = SCRIPT_ERROR;
+        return NULL;
+    }
+}
+
+/* newScriptNode - Allocate an empty script node
+*   Inputs: arena - The script arena, type - One of the NODE_ types
+*   Outputs: The node
+*/
+struct scriptNode* newScriptNode(struct arena* arena, int type) {
+    struct scriptNode* node = arenaAlloc(arena, sizeof(struct scriptNode));
+    memset(node, 0, sizeof(struct scriptNode));
+    node->type = type;
+    return node;
+}
+
+/* parseIf - Parse the rest of an if command, after the if (or elif) keyword
+*   Inputs: parser - The script parser, terminator - Set to SCRIPT_ERROR on failure
+*   Outputs: The NODE_IF node, or NULL after reporting a syntax error
+*/
+struct scriptNode* parseIf(struct scriptParser* parser, int* terminator) {
+    struct scriptNode* node = newScriptNode(parser->arena, NODE_IF);
+    int end;
+    parser->depth++;
+    node->condition = parseCommandList(parser, 1 << KEYWORD_THEN, &end);
+    if (end != SCRIPT_ERROR) {
+        node->body = parseCommandList(parser, (1 << KEYWORD_ELIF) | (1 << KEYWORD_ELSE) | (1 << KEYWORD_FI), &end);
+    }
+    // An elif is parsed as an if of its own, which reads up to (and including) the shared fi
+    if (end == KEYWORD_ELIF) {
+        node->elseBody = parseIf(parser, &end);
+        end = node->elseBody != NULL ? KEYWORD_FI : SCRIPT_ERROR;
+    }
+    else if (end == KEYWORD_ELSE) {
+        node->elseBody = parseCommandList(parser, 1 << KEYWORD_FI, &end);
+    }
+    parser->depth--;
+    if (end == SCRIPT_ERROR) {
+        *terminator = SCRIPT_ERROR;
+        return NULL;
+    }
+    return node;
+}
+
+/* parseLoop - Parse the rest of a while or for command, after the keyword
+*   Inputs: parser    - The script parser
+*           type      - NODE_WHILE or NODE_FOR
+*           header    - For a for loop, the text after the keyword (NAME in WORDS)
+*           terminator - Set to SCRIPT_ERROR on failure
+*   Outputs: The loop node, or NULL after reporting a syntax error
+*
+*   Procedure:
+*   A while loop's condition is the list up to do. A for loop's header is checked for a variable name and the in keyword, and its
+*   words are parsed like the arguments of a command so they can be expanded (and matched against file names) each time the loop
+*   starts. Nothing but the ; or new line may come between the header and do. The body runs up to done.
+*/
+struct scriptNode* parseLoop(struct scriptParser* parser, int type, char* header, int* terminator) {
+    struct scriptNode* node = newScriptNode(parser->arena, type);
+    int end;
+    *terminator = SCRIPT_ERROR;
+    if (type == NODE_FOR) {
+        char* name = header + strspn(header, " \t");
+        size_t nameLength = strcspn(name, " \t");
+        char* words = name + nameLength;
+        words += strspn(words, " \t");
+        int valid = nameLength > 0 && (isalpha((unsigned char)name[0]) || name[0] == '_');
+        for (size_t i = 0; i < nameLength; i++) {
+            valid = valid && (isalnum((unsigned char)name[i]) || name[i] == '_');
+        }
+        if (valid == 0 || strncmp(words, "in", 2) != 0 || (words[2] != '\0' && words[2] != ' ' && words[2] != '\t')) {
+            printf("syntax error: expected for NAME in WORDS\n");
+            fflush(stdout);
+            return NULL;
+        }
+        node->variable = arenaAlloc(parser->arena, nameLength + 1);
+        memcpy(node->variable, name, nameLength);
+        node->variable[nameLength] = '\0';
+        struct commandLine* wordList = parseCommandLine(parser->arena, words + 2);
+        if (wordList == NULL) {
+            return NULL;
+        }
+        if (wordList->stageCount > 1 || wordList->stages->redirections != NULL || wordList->background) {
+            printf("syntax error: for %s: the word list can't have operators\n", node->variable);
+            fflush(stdout);
+            return NULL;
+        }
+        node->words = wordList->stages;
+    }
+    parser->depth++;
+    node->condition = parseCommandList(parser, 1 << KEYWORD_DO, &end);
+    if (end != SCRIPT_ERROR && type == NODE_FOR && node->condition != NULL) {
+        printf("syntax error: for %s: expected do\n", node->variable);
+        fflush(stdout);
+        end = SCRIPT_ERROR;
+    }
+    if (end != SCRIPT_ERROR) {
+        node->body = parseCommandList(parser, 1 << KEYWORD_DONE, &end);
+    }
+    parser->depth--;
+    if (end == SCRIPT_ERROR) {
+        return NULL;
+    }
+    return node;
+}
+
+/* parseScriptNode - Parse the next command of the input into a script node
+*   Inputs: parser     - The script parser
+*           terminator - Set when no node is returned: the keyword found instead, SCRIPT_END or SCRIPT_ERROR
+*   Outputs: The node, or NULL
+*
+*   Purpose: The command loop calls this once per top level command, and an if, while or for is parsed completely (reading more lines
+*   as needed) into a tree before any of it runs. The loop bodies are then run from the tree, with no line read or parsed again.
+*
+*   Procedure:
+*   Blank segments and comments are skipped. A segment that doesn't start with a keyword is parsed by parseCommandLine (its
+*   here-documents read right away, from the lines that follow). After if, while, then, do, else, elif or a closing keyword, the
+*   rest of the segment is pushed back to be parsed as the next segment, so then echo a works as in other shells.
+*/
+struct scriptNode* parseScriptNode(struct scriptParser* parser, int* terminator) {
+    while (1) {
+        char* segment = nextSegment(parser);
+        if (segment == NULL) {
+            *terminator = SCRIPT_END;
+            return NULL;
+        }
+        char* remainder;
+        int keyword = segmentKeyword(segment, &remainder);
+        if (keyword == KEYWORD_NONE) {
+            long long parseStart = traceStart();
+            struct commandLine* command = parseCommandLine(parser->arena, segment);
+            traceEnd(TRACE_PARSE, parseStart);
+            if (command == NULL) {
+                *terminator = SCRIPT_ERROR;
+                return NULL;
+            }
+            if (command->hereDocuments > 0) {
+                readHereDocuments(parser->arena, command, parser->reader, parser->interactive ? "> " : NULL);
+            }
+            // Blank lines and comments aren't traced, the time spent parsing them is dropped
+            if (command->stageCount == 0) {
+                if (traceFd != -1) {
+                    writeTrace(NULL, parseStart);
+                }
+                continue;
+            }
+            struct scriptNode* node = newScriptNode(parser->arena, NODE_COMMAND);
+            node->command = command;
+            return node;
+        }
+        if (keyword == KEYWORD_FOR) {
+            return parseLoop(parser, NODE_FOR, remainder, terminator);
+        }
+        if (remainder[strspn(remainder, " \t")] != '\0') {
+            parser->pushback = remainder;
+        }
+        if (keyword == KEYWORD_IF) {
+            return parseIf(parser, terminator);
+        }
+        if (keyword == KEYWORD_WHILE) {
+            return parseLoop(parser, NODE_WHILE, NULL, terminator);
+        }
+        *terminator = keyword;
+        return NULL;
+    }
+}
+
+/* runCommand - Run one parsed command line
+*   Inputs: command - The parsed command, with at least one stage, shell - Shell state
+*   Outputs: The command's wait status (0 for a background job)
+*
+*   Purpose: Expands the words and runs the command as a built in, a background job or a foreground pipeline, then does the
+*   bookkeeping every command gets: the status and $?, the time report and trace record, releasing the command arena and (without
+*   the epoll wait) collecting finished background processes.
+*/
+int runCommand(struct commandLine* command, struct shellState* shell) {
+    struct arena* arena = shell->arena;
+    long long commandStart = traceStart();
+    METRIC_ADD(commands, 1);
+
+    // A leading time word runs the rest of the line as usual and then reports what it used on stderr
+    int timing = command->timed;
+    struct jobStats timingStart;
+    if (timing) {
+        usageSince(&timingStart, NULL);
+    }
+
+    // Built in commands are looked up by the first word of a single command. Utilities sent to the background are
+    // left to createBackgroundProcess, which runs them in a forked copy of the shell
+    long long phaseStart = traceStart();
+    char** args = expandArguments(arena, command->stages);
+    traceEnd(TRACE_EXPAND, phaseStart);
+    struct builtinCommand* builtin = command->stageCount == 1 && args[0] != NULL ? findBuiltin(args[0]) : NULL;
+    int background = foregroundOnly == 0 && command->background;
+    int status = 0;
+    shell->command = command;
+    if (builtin != NULL && ((builtin->flags & BUILTIN_FORKABLE) == 0 || background == 0)) {
+        phaseStart = traceStart();
+        status = runBuiltin(builtin, args, shell);
+        traceEnd(TRACE_BUILTIN, phaseStart);
+        if (builtin->flags & BUILTIN_SETS_STATUS) {
+            shell->lastStatus = status;
+        }
+    }
+    else if (background) {
+        createBackgroundProcess(arena, command, shell->listHead);
+    }
+    else {
+        // For parent, wait for the pipeline to finish and store the exit status in the lastStatus variable
+        status = runForegroundProcess(arena, command, shell->SIGINT_original, shell->listHead, &shell->lastStats);
+        shell->lastStatus = status;
+        if (timing) {
+            printJobStats(stderr, &shell->lastStats);
+            timing = 0;
+        }
+        // CTL-C stops the whole compound command the pipeline was part of, not just the pipeline
+        if (WIFSIGNALED(status) && WTERMSIG(status) == SIGINT) {
+            shell->loopControl = LOOP_ABORT;
+        }
+    }
+
+    // Built in commands (and background jobs, which only get as far as starting) are measured from the snapshot
+    if (timing) {
+        struct jobStats timingStats;
+        usageSince(&timingStats, &timingStart);
+        printJobStats(stderr, &timingStats);
+    }
+    if (traceFd != -1) {
+        writeTrace(describeCommand(arena, command), commandStart);
+    }
+
+    // Keep $? up to date for the next command
+    lastExitValue = WIFEXITED(shell->lastStatus) ? WEXITSTATUS(shell->lastStatus) : 128 + WTERMSIG(shell->lastStatus);
+
+    // Everything allocated for this command is released at once
+    arenaReset(arena);
+
+    // Without the epoll wait, finished background processes are collected between commands (only while there are any)
+    if (inputEpollFd == -1 && shell->listHead->next != NULL) {
+        cleanupBackgroundProcesses();
+    }
+    return status;
+}
+
+/* finishIteration - Act on a break or continue at the end of a loop iteration
+*   Inputs: shell - Shell state
+*   Outputs: 1 if the loop has to end, 0 to go on with the next iteration
+*
+*   Purpose: A break or continue for an outer loop (break 2) ends this loop and leaves loopControl set for the enclosing one.
+*/
+int finishIteration(struct shellState* shell) {
+    if (shell->exitRequested || shell->loopControl == LOOP_ABORT) {
+        return 1;
+    }
+    if (shell->loopControl == 0) {
+        return 0;
+    }
+    shell->loopLevels--;
+    if (shell->loopLevels > 0) {
+        return 1;
+    }
+    int control = shell->loopControl;
+    shell->loopControl = 0;
+    return control == LOOP_BREAK;
+}
+
+/* forValues - Expand the word list of a for loop
+*   Inputs: node - The NODE_FOR node, shell - Shell state, values - Set to the list of values, count - Set to the number of values
+*   Outputs: The block holding the values, to be freed (along with values) when the loop ends
+*
+*   Purpose: The words are expanded like arguments, so they can be file name patterns, variables and command substitutions, and each
+*   resulting argument is one value, even when a file name or a variable's value contains blanks. Only a word with a $( ) in it
+*   is split at blanks and new lines after it is expanded, which lets a loop go over the lines or words the command printed, and
+*   if it is also a pattern each field is matched on its own. The values are copied out of the command arena, which the commands
+*   of the loop body reset.
+*/
+char* forValues(struct scriptNode* node, struct shellState* shell, char*** values, int* count) {
+    struct simpleCommand* list = node->words;
+    int capacity = list != NULL ? list->argc + 1 : 1;
+    int pieceCount = 0;
+    char** pieces = arenaAlloc(shell->arena, capacity * sizeof(char*));
+    for (int i = 0; list != NULL && i < list->argc; i++) {
+        char* alone[2] = {list->argv[i], NULL};
+        char** expanded = alone;
+        char* split = NULL;
+        if ((list->argFlags[i] & WORD_EXPAND) && strstr(list->argv[i], "$(") != NULL) {
+            split = expandVariables(shell->arena, list->argv[i]);
+        }
+        else if (list->argFlags[i] != 0) {
+            // Expand this word alone, so its arguments can't run into the neighbouring words
+            struct simpleCommand single = *list;
+            single.argc = 1;
+            single.argv = list->argv + i;
+            single.argFlags = list->argFlags + i;
+            single.expandCount = 1;
+            expanded = expandArguments(shell->arena, &single);
+        }
+
+        int next = 0;
+        char* cursor = split;
+        while (1) {
+            char* piece;
+            if (split == NULL) {
+                piece = expanded[next++];
+            }
+            else {
+                cursor += strspn(cursor, " \t\n");
+                if (*cursor == '\0') {
+                    break;
+                }
+                piece = cursor;
+                cursor += strcspn(cursor, " \t\n");
+                if (*cursor != '\0') {
+                    *cursor = '\0';
+                    cursor++;
+                }
+            }
+            if (piece == NULL) {
+                break;
+            }
+            // A field of a $( ) word that was a pattern is matched after the split, and kept as it is if it matches nothing
+            int before = pieceCount;
+            if (split != NULL && (list->argFlags[i] & WORD_GLOB)) {
+                globPath(shell->arena, piece[0] == '/' ? "/" : "", piece + (piece[0] == '/'), &pieces, &pieceCount, &capacity);
+            }
+            if (pieceCount > before) {
+                continue;
+            }
+            if (pieceCount == capacity) {
+                capacity *= 2;
+                char** grown = arenaAlloc(shell->arena, capacity * sizeof(char*));
+                memcpy(grown, pieces, pieceCount * sizeof(char*));
+                pieces = grown;
+            }
+            pieces[pieceCount++] = piece;
+        }
+    }
+
+    size_t total = 1;
+    for (int i = 0; i < pieceCount; i++) {
+        total += strlen(pieces[i]) + 1;
+    }
+    char* block = malloc(total);
+    *values = malloc((pieceCount + 1) * sizeof(char*));
+    *count = pieceCount;
+    char* position = block;
+    for (int i = 0; i < pieceCount; i++) {
+        size_t length = strlen(pieces[i]);
+        memcpy(position, pieces[i], length + 1);
+        (*values)[i] = position;
+        position += length + 1;
+    }
+    arenaReset(shell->arena);
+    return block;
+}
+
+/* runScriptNode - Run a list of script nodes
+*   Inputs: node - The first node of the list, shell - Shell state
+*   Outputs: The wait status of the last command run (0 when nothing ran)
+*
+*   Purpose: The tree is walked directly: commands go to runCommand, if runs one branch on the status of its condition, and the
+*   loops run their bodies from the tree for as many iterations as they need. A list stops early when exit, break or continue
+*   is used or CTL-C killed a foreground command (see finishIteration).
+*/
+int runScriptNode(struct scriptNode* node, struct shellState* shell) {
+    int status = 0;
+    for (; node != NULL && shell->exitRequested == 0 && shell->loopControl == 0; node = node->next) {
+        if (node->type == NODE_COMMAND) {
+            status = runCommand(node->command, shell);
+        }
+        else if (node->type == NODE_IF) {
+            status = runScriptNode(node->condition, shell);
+            if (shell->exitRequested || shell->loopControl != 0) {
+                break;
+            }
+            status = runScriptNode(status == 0 ? node->body : node->elseBody, shell);
+        }
+        else if (node->type == NODE_WHILE) {
+            status = 0;
+            shell->loopDepth++;
+            while (1) {
+                int conditionStatus = runScriptNode(node->condition, shell);
+                if (shell->exitRequested || shell->loopControl != 0) {
+                    if (finishIteration(shell)) {
+                        break;
+                    }
+                    continue;
+                }
+                if (conditionStatus != 0) {
+                    break;
+                }
+                status = runScriptNode(node->body, shell);
+                if (finishIteration(shell)) {
+                    break;
+                }
+            }
+            shell->loopDepth--;
+        }
+        else {
+            char** values;
+            int count;
+            char* block = forValues(node, shell, &values, &count);
+            status = 0;
+            shell->loopDepth++;
+            for (int i = 0; i < count; i++) {
+                setVariable(node->variable, values[i], 0);
+                status = runScriptNode(node->body, shell);
+                if (finishIteration(shell)) {
+                    break;
+                }
+            }
+            shell->loopDepth--;
+            free(values);
+            free(block);
+        }
+    }
+    return status;
+}
+
+/* hashBytes - 64 bit FNV-1a hash of a block of memory, taken eight bytes at a time
+*   Inputs: data - The bytes, length - Number of bytes
+*   Outputs: The hash value
+*
+*   Purpose: Identifies the contents of a script (and the path of its cache file) quickly enough to hash a large script on every
+*   run that has to check it.
+*/
+uint64_t hashBytes(const char* data, size_t length) {
+    uint64_t hash = 14695981039346656037ull;
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        hash = (hash ^ word) * 1099511628211ull;
+    }
+    for (; i < length; i++) {
+        hash = (hash ^ (unsigned char)data[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+/* cacheReserve - Add a zeroed object to the script cache image
+*   Inputs: cache - The image being built, size - Size of the object
+*   Outputs: Offset of the object (8 byte aligned) in the image
+*
+*   Purpose: The image grows by doubling, so objects are only ever referred to by offset while it is being built.
+*/
+size_t cacheReserve(struct scriptCache* cache, size_t size) {
+    size_t offset = (cache->length + 7) & ~(size_t)7;
+    if (offset + size > cache->capacity) {
+        cache->capacity = cache->capacity > 0 ? cache->capacity : 65536;
+        while (offset + size > cache->capacity) {
+            cache->capacity *= 2;
+        }
+        cache->image = realloc(cache->image, cache->capacity);
+    }
+    memset(cache->image + cache->length, 0, offset + size - cache->length);
+    cache->length = offset + size;
+    return offset;
+}
+
+/* cacheLink - Set a pointer in the script cache image
+*   Inputs: cache  - The image
+*           field  - Offset of the pointer field
+*           target - Offset of the object it points to, 0 for NULL
+*           size   - Size of that object in bytes, with CACHE_STRING added for a string
+*   Outputs: None
+*
+*   Purpose: The target's offset is stored in the field and the field is added to the relocation table with the target's size, so
+*   loading the image can check the object lies inside the file and turn the offset into an address.
+*/
+void cacheLink(struct scriptCache* cache, size_t field, size_t target, uint64_t size) {
+    uintptr_t value = target;
+    memcpy(cache->image + field, &value, sizeof(value));
+    if (target == 0) {
+        return;
+    }
+    if (cache->relocationCount == cache->relocationCapacity) {
+        cache->relocationCapacity = cache->relocationCapacity > 0 ? cache->relocationCapacity * 2 : 1024;
+        cache->relocations = realloc(cache->relocations, cache->relocationCapacity * 2 * sizeof(uint64_t));
+    }
+    cache->relocations[cache->relocationCount * 2] = field;
+    cache->relocations[cache->relocationCount * 2 + 1] = size;
+    cache->relocationCount++;
+}
+
+/* cacheString - Copy a string into the script cache image
+*   Inputs: cache - The image, text - The string, or NULL
+*   Outputs: Offset of the copy, 0 for NULL
+*/
+size_t cacheString(struct scriptCache* cache, const char* text) {
+    if (text == NULL) {
+        return 0;
+    }
+    size_t length = strlen(text) + 1;
+    size_t offset = cacheReserve(cache, length);
+    memcpy(cache->image + offset, text, length);
+    return offset;
+}
+
+/* cacheLinkString - Copy a string into the script cache image and point a field at it
+*   Inputs: cache - The image, field - Offset of the pointer field, text - The string, or NULL
+*   Outputs: None
+*/
+void cacheLinkString(struct scriptCache* cache, size_t field, const char* text) {
+    size_t size = text != NULL ? strlen(text) + 1 : 0;
+    cacheLink(cache, field, cacheString(cache, text), size | CACHE_STRING);
+}
+
+/* cacheStage - Copy a pipeline stage, with its words and redirections, into the script cache image
+*   Inputs: cache - The image, stage - The stage
+*   Outputs: Offset of the copy (its next pointer is left NULL for the caller to link)
+*/
+size_t cacheStage(struct scriptCache* cache, struct simpleCommand* stage) {
+    size_t stageOffset = cacheReserve(cache, sizeof(struct simpleCommand));
+    struct simpleCommand copy = *stage;
+    memcpy(cache->image + stageOffset, &copy, sizeof(copy));
+
+    // Each stage gets its own argv and flag arrays, rather than a slice of one array for the line
+    size_t argvOffset = cacheReserve(cache, (stage->argc + 1) * sizeof(char*));
+    for (int i = 0; i < stage->argc; i++) {
+        cacheLinkString(cache, argvOffset + i * sizeof(char*), stage->argv[i]);
+    }
+    size_t flagsOffset = cacheReserve(cache, (stage->argc + 1) * sizeof(int));
+    memcpy(cache->image + flagsOffset, stage->argFlags, stage->argc * sizeof(int));
+    cacheLink(cache, stageOffset + offsetof(struct simpleCommand, argv), argvOffset, (stage->argc + 1) * sizeof(char*));
+    cacheLink(cache, stageOffset + offsetof(struct simpleCommand, argFlags), flagsOffset, (stage->argc + 1) * sizeof(int));
+
+    size_t link = stageOffset + offsetof(struct simpleCommand, redirections);
+    for (struct redirection* redirect = stage->redirections; redirect != NULL; redirect = redirect->next) {
+        size_t redirectOffset = cacheReserve(cache, sizeof(struct redirection));
+        struct redirection redirectCopy = *redirect;
+        memcpy(cache->image + redirectOffset, &redirectCopy, sizeof(redirectCopy));
+        cacheLinkString(cache, redirectOffset + offsetof(struct redirection, target), redirect->target);
+        cacheLink(cache, link, redirectOffset, sizeof(struct redirection));
+        link = redirectOffset + offsetof(struct redirection, next);
+    }
+    cacheLink(cache, link, 0, 0);
+    cacheLink(cache, stageOffset + offsetof(struct simpleCommand, next), 0, 0);
+    return stageOffset;
+}
+
+/* cacheNodeList - Copy a list of script nodes, and everything they point to, into the script cache image
+*   Inputs: cache - The image, node - The first node of the list, or NULL
+*   Outputs: Offset of the copy of the first node, 0 for an empty list
+*/
+size_t cacheNodeList(struct scriptCache* cache, struct scriptNode* node) {
+    size_t first = 0;
+    size_t link = 0;
+    for (; node != NULL; node = node->next) {
+        size_t nodeOffset = cacheReserve(cache, sizeof(struct scriptNode));
+        struct scriptNode copy = *node;
+        memcpy(cache->image + nodeOffset, &copy, sizeof(copy));
+        size_t commandOffset = 0;
+        if (node->command != NULL) {
+            commandOffset = cacheReserve(cache, sizeof(struct commandLine));
+            struct commandLine commandCopy = *node->command;
+            memcpy(cache->image + commandOffset, &commandCopy, sizeof(commandCopy));
+            size_t stageLink = commandOffset + offsetof(struct commandLine, stages);
+            for (struct simpleCommand* stage = node->command->stages; stage != NULL; stage = stage->next) {
+                size_t stageOffset = cacheStage(cache, stage);
+                cacheLink(cache, stageLink, stageOffset, sizeof(struct simpleCommand));
+                stageLink = stageOffset + offsetof(struct simpleCommand, next);
+            }
+        }
+        size_t nodeSize = sizeof(struct scriptNode);
+        cacheLink(cache, nodeOffset + offsetof(struct scriptNode, command), commandOffset, sizeof(struct commandLine));
+        cacheLink(cache, nodeOffset + offsetof(struct scriptNode, condition), cacheNodeList(cache, node->condition), nodeSize);
+        cacheLink(cache, nodeOffset + offsetof(struct scriptNode, body), cacheNodeList(cache, node->body), nodeSize);
+        cacheLink(cache, nodeOffset + offsetof(struct scriptNode, elseBody), cacheNodeList(cache, node->elseBody), nodeSize);
+        cacheLinkString(cache, nodeOffset + offsetof(struct scriptNode, variable), node->variable);
+        size_t wordsOffset = node->words != NULL ? cacheStage(cache, node->words) : 0;
+        cacheLink(cache, nodeOffset + offsetof(struct scriptNode, words), wordsOffset, sizeof(struct simpleCommand));
+        cacheLink(cache, nodeOffset + offsetof(struct scriptNode, next), 0, 0);
+        if (link == 0) {
+            first = nodeOffset;
+        }
+        else {
+            cacheLink(cache, link, nodeOffset, sizeof(struct scriptNode));
+        }
+        link = nodeOffset + offsetof(struct scriptNode, next);
+    }
+    return first;
+}
+
+/* cacheTopLevelNode - Add a parsed top level command to the script cache image
+*   Inputs: cache - The image, node - The command, as returned by parseScriptNode
+*   Outputs: None
+*
+*   Purpose: Called by runCommandLoop before each command runs, so the image is complete when the script ends.
+*/
+void cacheTopLevelNode(struct scriptCache* cache, struct scriptNode* node) {
+    if (cache->length == 0) {
+        cacheReserve(cache, sizeof(struct scriptCacheHeader));
+    }
+    if (cache->nodeCount == cache->nodeCapacity) {
+        cache->nodeCapacity = cache->nodeCapacity > 0 ? cache->nodeCapacity * 2 : 1024;
+        cache->nodes = realloc(cache->nodes, cache->nodeCapacity * sizeof(uint64_t));
+    }
+    cache->nodes[cache->nodeCount++] = cacheNodeList(cache, node);
+}
+
+/* inputLeft - Find out whether any commands are left in the input
+*   Inputs: parser - The script parser
+*   Outputs: 1 if anything but blanks is left on the current line or in the reader's buffer, 0 otherwise
+*/
+int inputLeft(struct scriptParser* parser) {
+    if (parser->pushback != NULL || (parser->pending != NULL && parser->pending[strspn(parser->pending, " \t")] != '\0')) {
+        return 1;
+    }
+    struct lineReader* reader = parser->reader;
+    for (size_t i = reader->start; i < reader->length; i++) {
+        if (strchr(" \t\r\n", reader->buffer[i]) == NULL) {
+            return 1;
+        }
+    }
+    return reader->endOfInput == 0;
+}
+
+/* runCommandLoop - Read, parse and run commands until the input ends or exit is used
+*   Inputs: reader      - Where the commands come from
+*           shell       - Shell state
+*           interactive - 1 to prompt for each line and use the history log
+*           cache       - Script cache image to add every parsed command to, or NULL
+*   Outputs: None
+*
+*   Purpose: The loop shared by the shell's own input and the jobs of the command server. Commands are parsed into the script arena,
+*   a whole if, while or for at a time, and each command's expansions go in the command arena. At the end of the input the background
+*   processes are terminated, like with the exit command.
+*/
+void runCommandLoop(struct lineReader* reader, struct shellState* shell, int interactive, struct scriptCache* cache) {
+    struct arena scriptArena = { 0 };
+    struct scriptParser parser = { 0 };
+    parser.reader = reader;
+    parser.arena = &scriptArena;
+    parser.shell = shell;
+    parser.interactive = interactive;
+
+    while (1) {
+        int terminator;
+        struct scriptNode* node = parseScriptNode(&parser, &terminator);
+        if (node != NULL) {
+            if (cache != NULL) {
+                cacheTopLevelNode(cache, node);
+            }
+            runScriptNode(node, shell);
+            shell->loopControl = 0;
+            if (shell->exitRequested) {
+                // A script that ends with exit can still be cached, one that stops part way can't
+                if (cache != NULL && inputLeft(&parser)) {
+                    cache->failed = 1;
+                }
+                break;
+            }
+        }
+        else if (terminator == SCRIPT_END) {
+            // End of input behaves like the exit command
+            killRunningProcesses(shell->listHead);
+            break;
+        }
+        else {
+            // A malformed command (reported by the parser, or a keyword out of place here) counts as a failed command
+            if (terminator != SCRIPT_ERROR) {
+                printf("syntax error near unexpected token %s\n", keywordNames[terminator]);
+                fflush(stdout);
+            }
+            shell->lastStatus = 1 << 8;
+            lastExitValue = 1;
+            if (cache != NULL) {
+                cache->failed = 1;
+            }
+            parser.depth = 0;
+            parser.pushback = NULL;
+        }
+
+        // The parsed tree is released once nothing is left of the line it came from
+        if (parser.pending == NULL && parser.pushback == NULL) {
+            arenaReset(&scriptArena);
+        }
+    }
+}
+
+/* scriptCachePath - Find the cache file for a script
+*   Inputs: scriptPath   - The script as given
+*           absolutePath - Receives the script's absolute path (PATH_MAX bytes)
+*           cachePath    - Receives the path of the cache file
+*           size         - Size of cachePath
+*   Outputs: 0 on success, -1 if the script isn't cached (SMALLSH_CACHE=off, or no cache directory)
+*
+*   Purpose: Cache files live in SMALLSH_CACHE if it names a directory, or in $XDG_CACHE_HOME/smallsh or ~/.cache/smallsh, and are
+*   named after a hash of the script's absolute path. The directory is created with any missing parents, and when that fails
+*   the shell says so once and runs scripts without the cache.
+*/
+int scriptCachePath(char* scriptPath, char* absolutePath, char* cachePath, size_t size) {
+    char* setting = getenv("SMALLSH_CACHE");
+    if ((setting != NULL && strcmp(setting, "off") == 0) || realpath(scriptPath, absolutePath) == NULL) {
+        return -1;
+    }
+    char directory[PATH_MAX];
+    char* base = getenv("XDG_CACHE_HOME");
+    char* home = getenv("HOME");
+    if (setting != NULL && *setting != '\0') {
+        snprintf(directory, sizeof(directory), "%s", setting);
+    }
+    else if (base != NULL && *base != '\0') {
+        snprintf(directory, sizeof(directory), "%s/smallsh", base);
+    }
+    else if (home != NULL && *home != '\0') {
+        snprintf(directory, sizeof(directory), "%s/.cache/smallsh", home);
+    }
+    else {
+        return -1;
+    }
+
+    // Create the directory and any missing parents, and say once if it can't be used
+    for (char* slash = strchr(directory + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        mkdir(directory, 0700);
+        *slash = '/';
+    }
+    if (mkdir(directory, 0700) == -1 && errno != EEXIST) {
+        if (cacheWarned == 0) {
+            fprintf(stderr, "smallsh: script cache %s: %s\n", directory, strerror(errno));
+            cacheWarned = 1;
+        }
+        return -1;
+    }
+    snprintf(cachePath, size, "%s/%016llx.ssc", directory, (unsigned long long)hashBytes(absolutePath, strlen(absolutePath)));
+    return 0;
+}
+
+/* Cache Check Struct
+*   State of checkCachedNodes while it walks a relocated script cache: the mapping, its size, and how many more objects may be
+*   visited (the number of relocations, since a well formed image has one per object), which stops a loop in the lists.
+*/
+struct cacheCheck
+{
+    char* image;
+    size_t imageSize;
+    size_t budget;
+};
+
+/* cacheObjectValid - Check that a pointer from a relocated script cache points at a whole object inside the mapping
+*   Inputs: check - The walk state, pointer - The pointer, size - Size of the object, alignment - Its required alignment
+*   Outputs: Integer representing a boolean value, 1 if the object lies inside the mapping (and the visit budget isn't spent)
+*/
+int cacheObjectValid(struct cacheCheck* check, const void* pointer, size_t size, size_t alignment) {
+    uintptr_t address = (uintptr_t)pointer;
+    uintptr_t start = (uintptr_t)check->image;
+    if (check->budget == 0 || address < start || size > check->imageSize || address - start > check->imageSize - size
+        || address % alignment != 0) {
+        return 0;
+    }
+    check->budget--;
+    return 1;
+}
+
+/* cacheStringValid - Check that a string from a relocated script cache ends inside the mapping
+*   Inputs: check - The walk state, text - The string
+*   Outputs: Integer representing a boolean value
+*/
+int cacheStringValid(struct cacheCheck* check, const char* text) {
+    if (cacheObjectValid(check, text, 1, 1) == 0) {
+        return 0;
+    }
+    return memchr(text, '\0', check->image + check->imageSize - text) != NULL;
+}
+
+/* cacheStageValid - Check a pipeline stage of a relocated script cache
+*   Inputs: check - The walk state, stage - The stage
+*   Outputs: Integer representing a boolean value
+*/
+int cacheStageValid(struct cacheCheck* check, struct simpleCommand* stage) {
+    if (cacheObjectValid(check, stage, sizeof(struct simpleCommand), sizeof(void*)) == 0 || stage->argc < 0
+        || (size_t)stage->argc >= check->imageSize / sizeof(char*)
+        || cacheObjectValid(check, stage->argv, (stage->argc + 1) * sizeof(char*), sizeof(char*)) == 0
+        || cacheObjectValid(check, stage->argFlags, (stage->argc + 1) * sizeof(int), sizeof(int)) == 0
+        || stage->argv[stage->argc] != NULL) {
+        return 0;
+    }
+    for (int i = 0; i < stage->argc; i++) {
+        if (cacheStringValid(check, stage->argv[i]) == 0) {
+            return 0;
+        }
+    }
+    for (struct redirection* redirect = stage->redirections; redirect != NULL; redirect = redirect->next) {
+        if (cacheObjectValid(check, redirect, sizeof(struct redirection), sizeof(void*)) == 0 || redirect->type < REDIRECT_INPUT
+            || redirect->type > REDIRECT_BOTH_APPEND || redirect->fd < 0 || redirect->fd > 9
+            || cacheStringValid(check, redirect->target) == 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* checkCachedNodes - Check a list of script nodes of a relocated script cache, and everything below it
+*   Inputs: check - The walk state, node - The first node, or NULL
+*   Outputs: Integer representing a boolean value, 1 if runScriptNode can follow every pointer and count in the list
+*
+*   Purpose: The relocation table only vouches for the pointers it lists. This walk checks that the tree has the shape
+*   runScriptNode expects: every pointer leads to a whole object of its type inside the mapping (an offset left unrelocated never
+*   does), node and redirection types and descriptors are in range, argv has argc strings and a NULL, and stageCount matches the
+*   stage list. A loop in a list uses up the visit budget.
+*/
+int checkCachedNodes(struct cacheCheck* check, struct scriptNode* node) {
+    for (; node != NULL; node = node->next) {
+        if (cacheObjectValid(check, node, sizeof(struct scriptNode), sizeof(void*)) == 0 || node->type < NODE_COMMAND
+            || node->type > NODE_FOR) {
+            return 0;
+        }
+        if (node->type == NODE_COMMAND) {
+            struct commandLine* command = node->command;
+            if (cacheObjectValid(check, command, sizeof(struct commandLine), sizeof(void*)) == 0) {
+                return 0;
+            }
+            int stageCount = 0;
+            for (struct simpleCommand* stage = command->stages; stage != NULL; stage = stage->next) {
+                if (cacheStageValid(check, stage) == 0) {
+                    return 0;
+                }
+                stageCount++;
+            }
+            if (stageCount != command->stageCount) {
+                return 0;
+            }
+        }
+        else if (node->type == NODE_FOR) {
+            if (cacheStringValid(check, node->variable) == 0 || (node->words != NULL && cacheStageValid(check, node->words) == 0)) {
+                return 0;
+            }
+        }
+        if (checkCachedNodes(check, node->condition) == 0 || checkCachedNodes(check, node->body) == 0
+            || checkCachedNodes(check, node->elseBody) == 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* loadScriptCache - Map the cached parse of a script, if it is still valid
+*   Inputs: cachePath    - The cache file
+*           absolutePath - The script's absolute path
+*           scriptInfo   - The script's stat information
+*           reader       - The script's line reader (not read from yet), for its contents
+*   Outputs: The table of top level commands, or NULL to parse the script instead
+*           nodeCount - Set to the number of top level commands
+*
+*   Purpose: A valid cache replaces reading, splitting and parsing the whole script with one mmap and a pass over the relocation table.
+*
+*   Procedure:
+*   The file is mapped privately and writable, so relocating only changes this process's copy of the pages that hold pointers. It is
+*   used when it comes from this version and build of the shell, describes this script and the script's size is unchanged. If the
+*   modification time differs, the script's contents are hashed and compared, and a match (the script was only touched or checked
+*   out again) updates the time in the file so the next run skips the hash. Each relocated pointer is checked to point at an
+*   object that lies wholly inside the file, using the size recorded with it, and each string to end inside its recorded length,
+*   so a truncated cache or one with bad offsets is parsed around rather than followed. The relocated tree is then walked by
+*   checkCachedNodes, which rejects pointers the table didn't list, objects of the wrong type, out of range counts and loops.
+*/
+struct scriptNode** loadScriptCache(char* cachePath, char* absolutePath, struct stat* scriptInfo, struct lineReader* reader, size_t* nodeCount) {
+    int cacheFd = open(cachePath, O_RDWR | O_CLOEXEC);
+    if (cacheFd == -1) {
+        return NULL;
+    }
+    struct stat cacheInfo;
+    char* image = MAP_FAILED;
+    if (fstat(cacheFd, &cacheInfo) == 0 && cacheInfo.st_size >= (off_t)sizeof(struct scriptCacheHeader)) {
+        image = mmap(NULL, cacheInfo.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, cacheFd, 0);
+    }
+    if (image == MAP_FAILED) {
+        close(cacheFd);
+        return NULL;
+    }
+    size_t imageSize = cacheInfo.st_size;
+    struct scriptCacheHeader* header = (struct scriptCacheHeader*)image;
+    int64_t modified = scriptInfo->st_mtim.tv_sec * 1000000000LL + scriptInfo->st_mtim.tv_nsec;
+    int valid = header->magic == SCRIPT_CACHE_MAGIC && header->version == SCRIPT_CACHE_VERSION && header->layout == SCRIPT_CACHE_LAYOUT
+        && header->imageSize == imageSize && header->scriptSize == (uint64_t)scriptInfo->st_size
+        && header->pathOffset < imageSize && memchr(image + header->pathOffset, '\0', imageSize - header->pathOffset) != NULL
+        && strcmp(image + header->pathOffset, absolutePath) == 0
+        && header->nodesOffset % sizeof(uint64_t) == 0 && header->relocationsOffset % sizeof(uint64_t) == 0
+        && header->nodeCount <= imageSize / sizeof(uint64_t) && header->nodesOffset <= imageSize - header->nodeCount * sizeof(uint64_t)
+        && header->relocationCount <= imageSize / (2 * sizeof(uint64_t))
+        && header->relocationsOffset <= imageSize - header->relocationCount * 2 * sizeof(uint64_t);
+    if (valid && header->scriptModified != modified) {
+        valid = hashBytes(reader->buffer, reader->length) == header->scriptHash;
+        if (valid) {
+            pwrite(cacheFd, &modified, sizeof(modified), offsetof(struct scriptCacheHeader, scriptModified));
+        }
+    }
+    close(cacheFd);
+
+    uint64_t* relocations = (uint64_t*)(image + header->relocationsOffset);
+    for (size_t i = 0; valid && i < header->relocationCount; i++) {
+        uint64_t field = relocations[2 * i];
+        uint64_t size = relocations[2 * i + 1] & ~CACHE_STRING;
+        uintptr_t value;
+        valid = field <= imageSize - sizeof(uintptr_t) && size > 0 && size <= imageSize;
+        if (valid) {
+            memcpy(&value, image + field, sizeof(value));
+            valid = value >= sizeof(struct scriptCacheHeader) && value <= imageSize - size;
+        }
+        if (valid && (relocations[2 * i + 1] & CACHE_STRING)) {
+            valid = image[value + size - 1] == '\0';
+        }
+        if (valid) {
+            value += (uintptr_t)image;
+            memcpy(image + field, &value, sizeof(value));
+        }
+    }
+    struct scriptNode** nodes = (struct scriptNode**)(image + header->nodesOffset);
+    struct cacheCheck check = { image, imageSize, header->relocationCount };
+    for (size_t i = 0; valid && i < header->nodeCount; i++) {
+        valid = nodes[i] != NULL && checkCachedNodes(&check, nodes[i]);
+    }
+    if (valid == 0) {
+        munmap(image, imageSize);
+        return NULL;
+    }
+    *nodeCount = header->nodeCount;
+    return nodes;
+}
+
+/* saveScriptCache - Finish the script cache image and write it to the cache file
+*   Inputs: cache        - The image built while the script ran
+*           cachePath    - The cache file
+*           absolutePath - The script's absolute path
+*           scriptInfo   - The script's stat information from before the run
+*           scriptHash   - hashBytes of the script's contents from before the run
+*   Outputs: None
+*
+*   Purpose: The path, the table of top level commands and the relocation table are added and the header filled in. The image is
+*   written to a temporary file that is then renamed over the cache file, so a shell starting at the same time never maps a partial
+*   one. Failing to write the cache only means the next run parses the script again.
+*/
+void saveScriptCache(struct scriptCache* cache, char* cachePath, char* absolutePath, struct stat* scriptInfo, uint64_t scriptHash) {
+    if (cache->length == 0) {
+        cacheReserve(cache, sizeof(struct scriptCacheHeader));
+    }
+    size_t pathOffset = cacheString(cache, absolutePath);
+    size_t nodesOffset = cacheReserve(cache, cache->nodeCount * sizeof(struct scriptNode*));
+    for (size_t i = 0; i < cache->nodeCount; i++) {
+        cacheLink(cache, nodesOffset + i * sizeof(struct scriptNode*), cache->nodes[i], sizeof(struct scriptNode));
+    }
+    size_t relocationsOffset = cacheReserve(cache, cache->relocationCount * 2 * sizeof(uint64_t));
+    memcpy(cache->image + relocationsOffset, cache->relocations, cache->relocationCount * 2 * sizeof(uint64_t));
+
+    struct scriptCacheHeader header = { 0 };
+    header.magic = SCRIPT_CACHE_MAGIC;
+    header.version = SCRIPT_CACHE_VERSION;
+    header.layout = SCRIPT_CACHE_LAYOUT;
+    header.scriptSize = scriptInfo->st_size;
+    header.scriptModified = scriptInfo->st_mtim.tv_sec * 1000000000LL + scriptInfo->st_mtim.tv_nsec;
+    header.scriptHash = scriptHash;
+    header.pathOffset = pathOffset;
+    header.nodesOffset = nodesOffset;
+    header.nodeCount = cache->nodeCount;
+    header.relocationsOffset = relocationsOffset;
+    header.relocationCount = cache->relocationCount;
+    header.imageSize = cache->length;
+    memcpy(cache->image, &header, sizeof(header));
+
+    char temporaryPath[PATH_MAX + 64];
+    snprintf(temporaryPath, sizeof(temporaryPath), "%s.XXXXXX", cachePath);
+    int cacheFd = mkostemp(temporaryPath, O_CLOEXEC);
+    if (cacheFd == -1) {
+        return;
+    }
+    int written = writeAll(cacheFd, cache->image, cache->length);
+    close(cacheFd);
+    if (written == -1 || rename(temporaryPath, cachePath) == -1) {
+        unlink(temporaryPath);
+    }
+}
+
+/* runScriptFile - Run a script file, from its cached parse when there is a valid one
+*   Inputs: reader - The script's line reader, from openScriptInput, path - The script as given, shell - Shell state
+*   Outputs: None
+*
+*   Purpose: With a valid cache the top level commands are run straight from the mapped tree, ending like runCommandLoop does. Otherwise
+*   the script runs through runCommandLoop as usual while it builds the image, which is saved at the end unless the script could not
+*   be cached.
+*/
+void runScriptFile(struct lineReader* reader, char* path, struct shellState* shell) {
+    char absolutePath[PATH_MAX];
+    char cachePath[PATH_MAX + 32];
+    struct stat scriptInfo;
+    if (scriptCachePath(path, absolutePath, cachePath, sizeof(cachePath)) == -1 || stat(path, &scriptInfo) == -1) {
+        runCommandLoop(reader, shell, 0, NULL);
+        return;
+    }
+    size_t nodeCount;
+    struct scriptNode** nodes = loadScriptCache(cachePath, absolutePath, &scriptInfo, reader, &nodeCount);
+    if (nodes != NULL) {
+        for (size_t i = 0; i < nodeCount; i++) {
+            runScriptNode(nodes[i], shell);
+            shell->loopControl = 0;
+            if (shell->exitRequested) {
+                return;
+            }
+        }
+        killRunningProcesses(shell->listHead);
+        return;
+    }
+
+    // Hashed before the run, which cuts the mapped script into lines in place
+    uint64_t scriptHash = hashBytes(reader->buffer, reader->length);
+    struct scriptCache cache = { 0 };
+    runCommandLoop(reader, shell, 0, &cache);
+    if (cache.failed == 0) {
+        saveScriptCache(&cache, cachePath, absolutePath, &scriptInfo, scriptHash);
+    }
+    free(cache.image);
+    free(cache.relocations);
+    free(cache.nodes);
+}
+
+/* addServerEndpoint - Start waiting on a client connection or a job's output pipe
+*   Inputs: fd - The descriptor (non-blocking), type - ENDPOINT_CLIENT or ENDPOINT_OUTPUT
+*   Outputs: None
+*
+*   Purpose: serverEndpoints grows to cover the descriptor, so it may move: callers look endpoints up by descriptor again afterwards.
+*/
+void addServerEndpoint(int fd, int type) {
+    if (fd >= serverEndpointCount) {
+        int newCount = serverEndpointCount > 0 ? serverEndpointCount : 64;
+        while (newCount <= fd) {
+            newCount *= 2;
+        }
+        serverEndpoints = realloc(serverEndpoints, newCount * sizeof(struct serverEndpoint));
+        memset(serverEndpoints + serverEndpointCount, 0, (newCount - serverEndpointCount) * sizeof(struct serverEndpoint));
+        serverEndpointCount = newCount;
+    }
+    memset(&serverEndpoints[fd], 0, sizeof(struct serverEndpoint));
+    serverEndpoints[fd].type = type;
+    serverEndpoints[fd].events = EPOLLIN;
+    struct epoll_event event = { 0 };
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    epoll_ctl(serverEpollFd, EPOLL_CTL_ADD, fd, &event);
+}
+
+/* closeServerEndpoint - Stop waiting on an endpoint and close it
+*   Inputs: fd - The endpoint's descriptor
+*   Outputs: None
+*/
+void closeServerEndpoint(int fd) {
+    epoll_ctl(serverEpollFd, EPOLL_CTL_DEL, fd, NULL);
+    close(fd);
+    free(serverEndpoints[fd].input);
+    free(serverEndpoints[fd].output);
+    memset(&serverEndpoints[fd], 0, sizeof(struct serverEndpoint));
+}
+
+/* watchClient - Register a client connection for the epoll events its state calls for
+*   Inputs: fd - The client's descriptor
+*   Outputs: None
+*
+*   Purpose: A client is read (EPOLLIN) until it stops sending and written (EPOLLOUT) while replies are queued for it. A closing or
+*   broken client with nothing to send is not waited on at all, so a connection the other end has closed can't wake the loop again.
+*/
+void watchClient(int fd) {
+    struct serverEndpoint* client = &serverEndpoints[fd];
+    unsigned int events = 0;
+    if (client->broken == 0) {
+        events = (client->closing ? 0 : EPOLLIN) | (client->outputLength > 0 ? EPOLLOUT : 0);
+    }
+    if (events == client->events) {
+        return;
+    }
+    struct epoll_event event = { 0 };
+    event.events = events;
+    event.data.fd = fd;
+    epoll_ctl(serverEpollFd, client->events == 0 ? EPOLL_CTL_ADD : (events == 0 ? EPOLL_CTL_DEL : EPOLL_CTL_MOD), fd, &event);
+    client->events = events;
+}
+
+/* settleClient - Close a client connection that has nothing left to do
+*   Inputs: fd - The client's descriptor
+*   Outputs: None
+*
+*   Purpose: Called after a client's state changed. The connection is closed once the client has stopped sending (or was dropped),
+*   its last job is done and every reply has been sent, and otherwise only its epoll registration is brought up to date. Until
+*   then the descriptor stays open even when the client is gone, since its running jobs refer to it by number.
+*/
+void settleClient(int fd) {
+    struct serverEndpoint* client = &serverEndpoints[fd];
+    if (client->closing && client->runningJobs == 0 && client->outputLength == 0) {
+        closeServerEndpoint(fd);
+        return;
+    }
+    watchClient(fd);
+}
+
+/* dropClient - Give up on a client connection that can't be written to
+*   Inputs: fd - The client's descriptor
+*   Outputs: None
+*
+*   Purpose: Its queued replies are discarded and the connection is shut down, so the client sees it end. Its jobs run to completion
+*   regardless, and the descriptor is closed by settleClient when they are done.
+*/
+void dropClient(int fd) {
+    struct serverEndpoint* client = &serverEndpoints[fd];
+    client->broken = 1;
+    client->closing = 1;
+    client->outputLength = 0;
+    shutdown(fd, SHUT_RDWR);
+    watchClient(fd);
+}
+
+/* flushClient - Send as much of a client's queued replies as its socket takes
+*   Inputs: fd - The client's descriptor
+*   Outputs: None
+*
+*   Purpose: Called when the socket has room again (EPOLLOUT). What is sent is removed from the front of the queue, and a
+*   connection that fails is dropped.
+*/
+void flushClient(int fd) {
+    struct serverEndpoint* client = &serverEndpoints[fd];
+    size_t sent = 0;
+    while (sent < client->outputLength) {
+        ssize_t written = send(fd, client->output + sent, client->outputLength - sent, MSG_NOSIGNAL);
+        if (written > 0) {
+            sent += written;
+        }
+        else if (written == -1 && errno == EINTR) {
+            continue;
+        }
+        else if (written == -1 && errno == EAGAIN) {
             break;
         }
         else {
-            args = parseArgs(expandedArgs);
-            executionSuccess = execvp(args[0], args);
-            if (executionSuccess != 0) {
-                printf("%s: No such file or directory", args[0]);
-                fflush(stdout);
-            }
-            exit(executionSuccess);
+            dropClient(fd);
+            return;
+        }
+    }
+    memmove(client->output, client->output + sent, client->outputLength - sent);
+    client->outputLength -= sent;
+    settleClient(fd);
+}
+
+/* sendToClient - Write a reply to a client connection
+*   Inputs: fd - The client's descriptor, text - The bytes to send, length - Number of bytes
+*   Outputs: None
+*
+*   Purpose: The server never waits for a client. The connection is non-blocking, and when the client isn't reading and its socket
+*   buffer is full the rest of the reply is queued behind any earlier ones and sent by flushClient as room appears. A client whose
+*   queue would grow past SERVER_QUEUE_LIMIT bytes, or that has gone away, is dropped and gets no more replies (its jobs run to
+*   completion regardless). MSG_NOSIGNAL keeps a closed connection from raising SIGPIPE.
+*/
+#define SERVER_QUEUE_LIMIT (4 << 20)
+void sendToClient(int fd, const char* text, size_t length) {
+    struct serverEndpoint* client = &serverEndpoints[fd];
+    // Replies already waiting go first, so nothing is sent directly until the queue is empty
+    while (length > 0 && client->broken == 0 && client->outputLength == 0) {
+        ssize_t sent = send(fd, text, length, MSG_NOSIGNAL);
+        if (sent > 0) {
+            text += sent;
+            length -= sent;
+        }
+        else if (sent == -1 && errno == EINTR) {
+            continue;
+        }
+        else if (sent == -1 && errno == EAGAIN) {
             break;
         }
-    default:
-        //For the parent, add the child process to the list of background processes and return to the main prompt
-        newProcess->processID = newChildPid;
-        printf("\nbackground pid is %d\n", newProcess->processID);
-        fflush(stdout);
-        struct backgroundProcess* endOfList = listHead;
-        while (endOfList->next != NULL) {
-            endOfList = endOfList->next;
+        else {
+            dropClient(fd);
+            return;
         }
-        newProcess->next = NULL;
-        newProcess->prev = endOfList;
-        endOfList->next = newProcess;
     }
-    return;
+    if (length == 0 || client->broken) {
+        return;
+    }
+    if (client->outputLength + length > SERVER_QUEUE_LIMIT) {
+        dropClient(fd);
+        return;
+    }
+    if (client->outputLength + length > client->outputCapacity) {
+        while (client->outputLength + length > client->outputCapacity) {
+            client->outputCapacity = client->outputCapacity > 0 ? client->outputCapacity * 2 : 8192;
+        }
+        client->output = realloc(client->output, client->outputCapacity);
+    }
+    memcpy(client->output + client->outputLength, text, length);
+    client->outputLength += length;
+    watchClient(fd);
 }
 
-/* main 
-*   Inputs: None
+/* forwardJobOutput - Pass what a job has written to its output pipe on to the job's client
+*   Inputs: fd - The read end of the job's output pipe (an ENDPOINT_OUTPUT)
+*   Outputs: Number of bytes forwarded, 0 at the end of the output, -1 if nothing is available right now
+*
+*   Purpose: Each piece is sent as an "output PID LENGTH" line followed by LENGTH bytes, so the output of several jobs running for
+*   one client can be told apart and may contain anything.
+*/
+int forwardJobOutput(int fd) {
+    char buffer[RELAY_CHUNK];
+    ssize_t got;
+    do {
+        got = read(fd, buffer, sizeof(buffer));
+    } while (got == -1 && errno == EINTR);
+    if (got <= 0) {
+        return got == 0 ? 0 : -1;
+    }
+    char header[64];
+    int clientFd = serverEndpoints[fd].clientFd;
+    sendToClient(clientFd, header, sprintf(header, "output %d %zd\n", serverEndpoints[fd].processID, got));
+    sendToClient(clientFd, buffer, got);
+    return got;
+}
+
+/* finishServerJob - Report a finished command server job to its client
+*   Inputs: focusProcess - The job's list node
+*           status       - Its wait status
+*           stats        - Its resource usage
+*   Outputs: None
+*
+*   Purpose: Called by reportBackgroundProcess. Everything the job wrote before exiting is still in its pipe and is forwarded first,
+*   then the pipe is closed (output from processes it left running in the background is dropped) and the "done" line sent. A client
+*   that has stopped sending is closed once its last job is done and its replies have gone out.
+*/
+void finishServerJob(struct backgroundProcess* focusProcess, int status, struct jobStats* stats) {
+    if (focusProcess->outputFd != -1) {
+        while (forwardJobOutput(focusProcess->outputFd) > 0) {
+        }
+        closeServerEndpoint(focusProcess->outputFd);
+        focusProcess->outputFd = -1;
+    }
+    char result[256];
+    int length = snprintf(result, sizeof(result), "done %d %s=%d wall_ns=%lld user_us=%lld sys_us=%lld maxrss_kb=%ld ctxsw=%ld/%ld\n",
+        focusProcess->processID, WIFEXITED(status) ? "exit" : "signal", WIFEXITED(status) ? WEXITSTATUS(status) : WTERMSIG(status),
+        stats->wallNanoseconds, stats->userMicroseconds, stats->systemMicroseconds, stats->maxResidentKB, stats->voluntarySwitches,
+        stats->involuntarySwitches);
+    int clientFd = focusProcess->clientFd;
+    sendToClient(clientFd, result, length);
+    serverEndpoints[clientFd].runningJobs--;
+    settleClient(clientFd);
+}
+
+/* runServerJob - Run a submitted script in the forked copy of the server
+*   Inputs: shell    - Shell state
+*           text     - The commands, or the path of the script file
+*           outputFd - Write end of the capture pipe, or -1 to discard the output
+*           fromFile - 1 if text is a script file
+*   Outputs: None, the function exits with the status of the last command
+*
+*   Purpose: The job is an ordinary non-interactive shell from here on: standard input is /dev/null, standard output and error go
+*   to the capture pipe or /dev/null, and none of the server's descriptors, blocked stop signals or jobs are kept.
+*/
+void runServerJob(struct shellState* shell, char* text, int outputFd, int fromFile) {
+    int nullFd = sharedDevNull();
+    dup2(nullFd, 0);
+    dup2(outputFd != -1 ? outputFd : nullFd, 1);
+    dup2(outputFd != -1 ? outputFd : nullFd, 2);
+    if (outputFd != -1) {
+        close(outputFd);
+    }
+    for (int fd = 0; fd < serverEndpointCount; fd++) {
+        if (serverEndpoints[fd].type != 0) {
+            close(fd);
+        }
+    }
+    close(serverListenFd);
+    close(serverEpollFd);
+    close(serverStopFd);
+    sigset_t stopSignals;
+    sigemptyset(&stopSignals);
+    sigaddset(&stopSignals, SIGTERM);
+    sigaddset(&stopSignals, SIGHUP);
+    sigprocmask(SIG_UNBLOCK, &stopSignals, NULL);
+    forgetBackgroundProcesses(shell->listHead);
+
+    struct lineReader reader = { 0 };
+    if (fromFile) {
+        if (openScriptInput(&reader, text) == -1) {
+            fprintf(stderr, "smallsh: %s: %s\n", text, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        runScriptFile(&reader, text, shell);
+    }
+    else {
+        openStringInput(&reader, text);
+        runCommandLoop(&reader, shell, 0, NULL);
+    }
+    exit(lastExitValue);
+}
+
+/* startServerJob - Start a job for a client's request
+*   Inputs: shell    - Shell state
+*           clientFd - The client's connection
+*           text     - The commands, or the path of the script file
+*           capture  - 1 to send the job's output back to the client
+*           fromFile - 1 if text is a script file
+*   Outputs: None
+*
+*   Purpose: The job is a forked copy of the server (already set up, so nothing of the shell's startup is repeated) and is entered
+*   in the background process list like a job started with &, where cleanupBackgroundProcesses collects it. The client is told the
+*   job's PID right away with a "started PID" line.
+*/
+void startServerJob(struct shellState* shell, int clientFd, char* text, int capture, int fromFile) {
+    char reply[320];
+    int outputPipe[2] = { -1, -1 };
+    if (capture && pipe2(outputPipe, O_CLOEXEC) == -1) {
+        sendToClient(clientFd, reply, snprintf(reply, sizeof(reply), "error %s\n", strerror(errno)));
+        return;
+    }
+    pid_t processID = fork();
+    if (processID == 0) {
+        runServerJob(shell, text, outputPipe[1], fromFile);
+    }
+    METRIC_ADD(forks, processID != -1);
+    if (capture) {
+        close(outputPipe[1]);
+    }
+    if (processID == -1) {
+        if (capture) {
+            close(outputPipe[0]);
+        }
+        sendToClient(clientFd, reply, snprintf(reply, sizeof(reply), "error %s\n", strerror(errno)));
+        return;
+    }
+    struct backgroundProcess* job = addBackgroundProcess(shell->listHead, processID, -1, text);
+    job->clientFd = clientFd;
+    if (capture) {
+        fcntl(outputPipe[0], F_SETFL, O_NONBLOCK);
+        addServerEndpoint(outputPipe[0], ENDPOINT_OUTPUT);
+        serverEndpoints[outputPipe[0]].processID = processID;
+        serverEndpoints[outputPipe[0]].clientFd = clientFd;
+        job->outputFd = outputPipe[0];
+    }
+    serverEndpoints[clientFd].runningJobs++;
+    sendToClient(clientFd, reply, sprintf(reply, "started %d\n", processID));
+}
+
+/* handleServerRequest - Act on one request line from a client
+*   Inputs: shell - Shell state, clientFd - The client's connection, line - The request
+*   Outputs: None
+*
+*   Purpose: Requests are "run COMMANDS" and "capture COMMANDS", where COMMANDS is one line of the shell's syntax (separate commands
+*   with ;), or the same with -f PATH to run a script file. capture sends the job's standard output and error back, run discards
+*   them. Blank lines are ignored and anything else gets an "error" line.
+*/
+void handleServerRequest(struct shellState* shell, int clientFd, char* line) {
+    char* verb = line + strspn(line, " \t");
+    size_t verbLength = strcspn(verb, " \t");
+    if (verbLength == 0) {
+        return;
+    }
+    char* text = verb + verbLength;
+    text += strspn(text, " \t");
+    int capture;
+    if (verbLength == 3 && memcmp(verb, "run", 3) == 0) {
+        capture = 0;
+    }
+    else if (verbLength == 7 && memcmp(verb, "capture", 7) == 0) {
+        capture = 1;
+    }
+    else {
+        sendToClient(clientFd, "error unknown request\n", 22);
+        return;
+    }
+    int fromFile = 0;
+    if (text[0] == '-' && text[1] == 'f' && (text[2] == ' ' || text[2] == '\t')) {
+        fromFile = 1;
+        text += 3 + strspn(text + 3, " \t");
+    }
+    if (*text == '\0') {
+        sendToClient(clientFd, "error no commands\n", 18);
+        return;
+    }
+    startServerJob(shell, clientFd, text, capture, fromFile);
+}
+
+/* readClientRequests - Read from a client connection and act on the complete request lines
+*   Inputs: shell - Shell state, clientFd - The client's connection
 *   Outputs: None
 *
+*   Purpose: Everything available is read into the client's input buffer and each complete line is handled, a partial line waits
+*   for the rest. When the client stops sending (or the connection fails) a final unterminated line is handled too and the
+*   connection is no longer read, it is closed as soon as none of its jobs are running and its replies are sent. The lines left
+*   by a client that was dropped for not reading its replies are ignored.
+*/
+void readClientRequests(struct shellState* shell, int clientFd) {
+    int ended = 0;
+    while (1) {
+        struct serverEndpoint* client = &serverEndpoints[clientFd];
+        if (client->inputCapacity - client->inputLength < 4096) {
+            client->inputCapacity = client->inputCapacity > 0 ? client->inputCapacity * 2 : 8192;
+            client->input = realloc(client->input, client->inputCapacity);
+        }
+        ssize_t got = read(clientFd, client->input + client->inputLength, client->inputCapacity - client->inputLength - 1);
+        if (got > 0) {
+            client->inputLength += got;
+            continue;
+        }
+        if (got == -1 && errno == EINTR) {
+            continue;
+        }
+        ended = (got == 0 || errno != EAGAIN);
+        break;
+    }
+
+    // Requests start jobs, which can grow serverEndpoints, so the client is looked up again for every line
+    char* input = serverEndpoints[clientFd].input;
+    size_t length = serverEndpoints[clientFd].inputLength;
+    size_t start = 0;
+    char* newline;
+    while (serverEndpoints[clientFd].broken == 0 && (newline = memchr(input + start, '\n', length - start)) != NULL) {
+        *newline = '\0';
+        handleServerRequest(shell, clientFd, input + start);
+        start = newline - input + 1;
+    }
+    if (ended && start < length && serverEndpoints[clientFd].broken == 0) {
+        input[length] = '\0';
+        handleServerRequest(shell, clientFd, input + start);
+        start = length;
+    }
+    if (serverEndpoints[clientFd].broken) {
+        start = length;
+    }
+    memmove(input, input + start, length - start);
+    serverEndpoints[clientFd].inputLength = length - start;
+
+    if (ended) {
+        serverEndpoints[clientFd].closing = 1;
+    }
+    settleClient(clientFd);
+}
+
+/* serveClients - Run the command server
+*   Inputs: path - Path of the Unix domain socket to listen on, shell - Shell state
+*   Outputs: Exit value for the shell, EXIT_FAILURE if the socket could not be set up
+*
+*   Purpose: One long lived shell takes commands from any number of local clients, so submitting a job costs a socket round trip and
+*   a fork of an already initialized shell instead of starting a new shell process.
+*
+*   Procedure:
+*   A socket file left behind by a server that is no longer running is replaced, one that still accepts connections is not. SIGTERM
+*   and SIGHUP are blocked and read from a signalfd, so the server can stop cleanly. A single epoll set then covers the listening
+*   socket, childSignalFd, the stop signals, every client connection and the output pipe of every capturing job, all non-blocking:
+*   new connections are accepted, request lines start jobs (see handleServerRequest), output is forwarded as it arrives, replies a
+*   client's socket had no room for are sent when it becomes writable and finished jobs are collected by cleanupBackgroundProcesses,
+*   which reports them to their clients. No client is ever waited for. When the server stops, its jobs are terminated and the socket
+*   file is removed.
+*/
+int serveClients(char* path, struct shellState* shell) {
+    struct sockaddr_un address = { 0 };
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "smallsh: %s: socket path too long\n", path);
+        return EXIT_FAILURE;
+    }
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+    serverListenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int bound = bind(serverListenFd, (struct sockaddr*)&address, sizeof(address));
+    if (bound == -1 && errno == EADDRINUSE) {
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (connect(probe, (struct sockaddr*)&address, sizeof(address)) == -1 && errno == ECONNREFUSED) {
+            unlink(path);
+            bound = bind(serverListenFd, (struct sockaddr*)&address, sizeof(address));
+        }
+        else {
+            errno = EADDRINUSE;
+        }
+        close(probe);
+    }
+    if (bound == -1 || listen(serverListenFd, SOMAXCONN) == -1) {
+        fprintf(stderr, "smallsh: %s: %s\n", path, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    sigset_t stopSignals;
+    sigemptyset(&stopSignals);
+    sigaddset(&stopSignals, SIGTERM);
+    sigaddset(&stopSignals, SIGHUP);
+    sigprocmask(SIG_BLOCK, &stopSignals, NULL);
+    serverStopFd = signalfd(-1, &stopSignals, SFD_NONBLOCK | SFD_CLOEXEC);
+
+    serverEpollFd = epoll_create1(EPOLL_CLOEXEC);
+    int watched[] = { serverListenFd, childSignalFd, serverStopFd };
+    for (int i = 0; i < 3; i++) {
+        struct epoll_event event = { 0 };
+        event.events = EPOLLIN;
+        event.data.fd = watched[i];
+        epoll_ctl(serverEpollFd, EPOLL_CTL_ADD, watched[i], &event);
+    }
+
+    int running = 1;
+    while (running) {
+        struct epoll_event events[64];
+        int ready = epoll_wait(serverEpollFd, events, 64, -1);
+        for (int i = 0; i < ready; i++) {
+            int fd = events[i].data.fd;
+            if (fd == serverListenFd) {
+                int clientFd;
+                while ((clientFd = accept4(serverListenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+                    addServerEndpoint(clientFd, ENDPOINT_CLIENT);
+                }
+            }
+            else if (fd == childSignalFd) {
+                cleanupBackgroundProcesses();
+            }
+            else if (fd == serverStopFd) {
+                running = 0;
+            }
+            // An endpoint closed earlier in this batch has no type any more and its event is dropped
+            else if (fd < serverEndpointCount && serverEndpoints[fd].type == ENDPOINT_CLIENT) {
+                // Queued replies go out first, a client that has stopped sending is only ever waited on for them
+                if ((events[i].events & EPOLLOUT) || serverEndpoints[fd].closing) {
+                    flushClient(fd);
+                }
+                if (serverEndpoints[fd].type == ENDPOINT_CLIENT && serverEndpoints[fd].closing == 0 && (events[i].events & ~EPOLLOUT)) {
+                    readClientRequests(shell, fd);
+                }
+            }
+            else if (fd < serverEndpointCount && serverEndpoints[fd].type == ENDPOINT_OUTPUT && forwardJobOutput(fd) == 0) {
+                // The job closed its output before exiting
+                struct backgroundProcess* job = findBackgroundProcess(serverEndpoints[fd].processID);
+                if (job != NULL) {
+                    job->outputFd = -1;
+                }
+                closeServerEndpoint(fd);
+            }
+        }
+    }
+    killRunningProcesses(shell->listHead);
+    unlink(path);
+    return EXIT_SUCCESS;
+}
+
+// The benchmark harness (bench/bench.c) includes this file to reach the functions above and supplies its own main
+#ifndef SMALLSH_NO_MAIN
+
+/* main 
+*   Inputs: argc, argv - Optional script to run: "smallsh FILE" runs the commands in FILE and "smallsh -c STRING" runs STRING,
+*           "smallsh -s SOCKET" runs the command server on SOCKET
+*   Outputs: Exit value of the last foreground command when running a script, 0 for an interactive session
+*
 *   Purpose: To facilitate the interactive shell program, handle built in commands and run foreground processes. 
 *
 *   Procedure: 
 *   To begin the program, first this function will set up the environment that the interactive shell loop will operate in, by 
 *   changing the signal interrupts for SIGINT and SIGTSTP, as well as declaring/initializing some variables used for state tracking 
-*   (running, lastStatus). The Linked List structure's head will be created as well, initialized with a -1 PID as a placeholder. Then the
-*   program name is printed and the function enters the while loop until the exit command is recieved. The prompt will accept user input,
-*   and handle the action based upon the command recieved. For cd, the working directory will be changed based on the relative or absolute
-*   filepath provided, or to the base HOME directory if no argument for path is supplied. for status, the exit status of the last foreground 
-*   process is printed. For exit, all existing processes are killed and the program ends. For all other provided commands, child processes are 
-*   forked depending on the provided commands and run in either the foreground or backgrond. Once per cycle, the background processes that have 
-*   exited are cleaned up
+*   (running, lastStatus). The Linked List structure's head will be created as well, initialized with a -1 PID as a placeholder. The input
+*   is then chosen: a script file, a -c string or standard input. Only a terminal on standard input gives an interactive session, where the
+*   program name is printed, the ': ' prompt is shown before every line and finished background processes are reported while waiting for
+*   input. Any other input is run as a batch without prompts and read in large blocks. The function then enters the while loop until the exit 
+*   command (or the end of the input) is recieved, and handles the action based upon the command recieved. For cd, the working directory will 
+*   be changed based on the relative or absolute filepath provided, or to the base HOME directory if no argument for path is supplied. for 
+*   status, the exit status of the last foreground process is printed. For exit, all existing processes are killed and the program ends. For 
+*   all other provided commands, child processes are forked depending on the provided commands and run in either the foreground or backgrond. 
+*   Once per cycle, the background processes that have exited are cleaned up
 */
 
-int main(){
+int main(int argc, char* argv[]) {
     // Set up custom handling of interrupts, assistance for this came from the signal handling API examples
     //Initialize sigaction struct's
     struct sigaction SIGTSTP_action = { 0 }, ignore = { 0 }, SIGINT_original_action = { 0 };
@@ -478,142 +6880,149 @@ int main(){
     ignore.sa_handler = SIG_IGN;
     sigaction(SIGINT, &ignore, &SIGINT_original_action);
 
-    //Set up loop, initialize status variable and open working directory
-    int running = 1;
-    int lastStatus = 0;
-    
-    // Create background process data structure
-    struct backgroundProcess* listHead = malloc(sizeof(struct backgroundProcess));
-    listHead->next = NULL;
-    listHead->prev = NULL;
-    listHead->processID = -1;
+    // Shell variables start out as the exported contents of the environment
+    importEnvironment();
+    refreshWorkingDirectory();
 
-    //Print Program title 
-    printf("smallsh\n");
-    fflush(stdout);
-    char userInput[2050];
+    // Pick the process launch engine requested in the environment, if any
+    char* launchSetting = getenv("SMALLSH_LAUNCH");
+    if (launchSetting != NULL && setLaunchMode(launchSetting) == -1) {
+        printf("SMALLSH_LAUNCH: unknown launch mode %s\n", launchSetting);
+        fflush(stdout);
+    }
 
-    // Begin shell loop
-    while (running == 1) {
-        printf(": ");
+    // Tracing can be started from the environment, with the records going to a file or an inherited descriptor
+    char* traceSetting = getenv("SMALLSH_TRACE");
+    if (traceSetting != NULL && *traceSetting != '\0' && startTrace(traceSetting) == -1) {
+        printf("SMALLSH_TRACE: %s: %s\n", traceSetting, strerror(errno));
         fflush(stdout);
-        fgets(userInput, 2049, stdin);
+    }
+
+    // Live counters for external monitors are published in shared memory on request
+    char* metricsSetting = getenv("SMALLSH_METRICS");
+    if (metricsSetting != NULL && *metricsSetting != '\0' && openMetrics() == -1) {
+        printf("SMALLSH_METRICS: /dev/shm: %s\n", strerror(errno));
         fflush(stdout);
+    }
 
-        //If the user input contained any characters, remove the newline from the input string and proceed, otherwise reprompt
-        if (strlen(userInput) > 1) {
-            userInput[strlen(userInput) - 1] = '\0';
+    // Background job placement can be configured from the environment as well
+    char* placementVariables[][2] = { { "pin", "SMALLSH_PIN" }, { "reserve", "SMALLSH_RESERVE" }, { "cpu-time", "SMALLSH_CPU_TIME" },
+        { "memory", "SMALLSH_MEMORY" }, { "cgroup", "SMALLSH_CGROUP" }, { "cgroup-cpu", "SMALLSH_CGROUP_CPU" },
+        { "cgroup-memory", "SMALLSH_CGROUP_MEMORY" } };
+    for (int i = 0; i < 7; i++) {
+        char* placementSetting = getenv(placementVariables[i][1]);
+        if (placementSetting != NULL && setPlacement(placementVariables[i][0], placementSetting) == -1) {
+            printf("%s: invalid value %s\n", placementVariables[i][1], placementSetting);
+            fflush(stdout);
+        }
+    }
 
-            // Expand the $$ variable to the shell's PID
-            char* expandedArgs = expandVariables(userInput);
+    // Choose where commands come from, only a terminal on standard input gets an interactive session
+    struct lineReader reader = { 0 };
+    int interactive = 0;
+    char* serverPath = NULL;
+    char* scriptPath = NULL;
+    if (argc > 1 && strcmp(argv[1], "-s") == 0) {
+        if (argc < 3) {
+            fprintf(stderr, "smallsh: -s: option requires an argument\n");
+            return EXIT_FAILURE;
+        }
+        serverPath = argv[2];
+    }
+    else if (argc > 1 && strcmp(argv[1], "-c") == 0) {
+        if (argc < 3) {
+            fprintf(stderr, "smallsh: -c: option requires an argument\n");
+            return EXIT_FAILURE;
+        }
+        openStringInput(&reader, argv[2]);
+    }
+    else if (argc > 1) {
+        if (openScriptInput(&reader, argv[1]) == -1) {
+            fprintf(stderr, "smallsh: %s: %s\n", argv[1], strerror(errno));
+            return EXIT_FAILURE;
+        }
+        scriptPath = argv[1];
+    }
+    else {
+        interactive = isatty(0);
+        reader.capacity = interactive ? 4096 : 65536;
+        reader.buffer = malloc(reader.capacity);
+    }
+    if (interactive) {
+        openHistory();
+    }
 
-            // Create copy of arguments for tokenizing
-            char* argCopy = calloc(strlen(expandedArgs) + 1, sizeof(char));
-            strcpy(argCopy, expandedArgs);
-            char* saveptr;
+    // Job control: an interactive shell leads its own process group, owns the terminal and ignores the signals sent to background
+    // groups that use it, so it can hand the terminal to foreground jobs and take it back
+    if (interactive) {
+        struct sigaction ignoreTerminal = { 0 };
+        ignoreTerminal.sa_handler = SIG_IGN;
+        sigaction(SIGTTOU, &ignoreTerminal, NULL);
+        sigaction(SIGTTIN, &ignoreTerminal, NULL);
+        setpgid(0, 0);
+        terminalFd = 0;
+        giveTerminal(getpgrp());
+    }
 
-            // Pull the first argument, if it's not a comment (first character #) or proceed into the if/else tree to check built in commands
-            char* inputToken = strtok_r(argCopy, " ", &saveptr);
-            if (strncmp(inputToken, "#", 1) != 0) {
-                if (strcmp(inputToken, "exit") == 0) {
-                    killRunningProcesses(listHead);
-                    cleanupBackgroundProcesses(listHead);
-                    break;
-                }
-                else if (strcmp(inputToken, "cd") == 0) {
-                    char directory[250];
-                    getcwd(directory, 249);
+    // Route child exits through a signalfd instead of a handler, and (interactively) wait on it together with the input
+    sigset_t childSignal;
+    sigemptyset(&childSignal);
+    sigaddset(&childSignal, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &childSignal, NULL);
+    childSignalFd = signalfd(-1, &childSignal, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (interactive) {
+        inputEpollFd = epoll_create1(EPOLL_CLOEXEC);
+        struct epoll_event inputEvent = { 0 };
+        inputEvent.events = EPOLLIN;
+        inputEvent.data.fd = childSignalFd;
+        epoll_ctl(inputEpollFd, EPOLL_CTL_ADD, childSignalFd, &inputEvent);
+        inputEvent.data.fd = 0;
+        epoll_ctl(inputEpollFd, EPOLL_CTL_ADD, 0, &inputEvent);
+    }
 
-                    // Change directory to the directory specified in the HOME directory to the supplied argument for new path
-                    char* inputArg = strtok_r(NULL, " ", &saveptr);
-                    char* path = getenv("HOME");
-                    if (inputArg == NULL) {
-                        chdir(path);
-                    }
-                    else {
-                        // Absolute paths, checking to see if the base directory is in the passed argument. If so, it's an absolute path
-                        if (strncmp(path, inputArg, sizeof(path) - 1) == 0) {
-                            int success = chdir(inputArg);
-                        }
-                        //Relative paths, no base directory means it's not absolute so the CWD needs to be appended before the provided argument
-                        else {
-                            char directory[250];
-                            getcwd(directory, 249);
-                            strncat(directory, "/", 1);
-                            strncat(directory, inputArg, strlen(inputArg) + 1);
-                            chdir(directory);
-                        }
+    // Arena for the commands being run
+    struct arena commandArena = { 0 };
+    shellPidLength = sprintf(shellPidText, "%d", getpid());
+    
+    // Create background process data structure
+    struct backgroundProcess* listHead = malloc(sizeof(struct backgroundProcess));
+    listHead->next = NULL;
+    listHead->prev = NULL;
+    listHead->processID = -1;
 
-                    }
-                }
-                else if (strcmp(inputToken, "status") == 0) {
-                    // Prints out either the exit status or the terminating signal. 
-                    // If it's run before any foreground command, return 0 (Status doesn't include the 3 foreground commands).
-                    if (WIFEXITED(lastStatus)) {
-                        printf("exit value %d", WEXITSTATUS(lastStatus));
-                        fflush(stdout);
-                    }
-                    else {
-                        printf("terminated by signal %d", WTERMSIG(lastStatus));
-                        fflush(stdout);
-                    }
-                }
-                else {   //Handle Non-Built in Commands and Executables
+    // State shared with the built in commands, starting with a status of 0 and zeroed statistics
+    struct shellState shell = { 0 };
+    shell.arena = &commandArena;
+    shell.listHead = listHead;
+    shell.SIGINT_original = &SIGINT_original_action;
+    substitutionSIGINT = &SIGINT_original_action;
+    registerBuiltins();
 
-                    int backgroundCommand = checkBackgroundCommand(expandedArgs);
-                    char** args;
-                    
-                    // If foreground only mode hasn't been toggled
-                    if (foregroundOnly == 0 && backgroundCommand) {
-                        createBackgroundProcess(args, expandedArgs, listHead);
-                    }
-                    else {
-                        int newChildPid = fork();
-                        int childStatus;
-                        int redirectSuccess;
-                        int executionSuccess;
-                        switch (newChildPid) {
-                        case -1:
-                            perror("Error Creating Fork");
-                            exit(1);
-                            break;
-                        case 0:
-                            //Fork off and run the new process for the child
-                            redirectSuccess = redirectIO(expandedArgs, 1);
-                            if (redirectSuccess == -1) {
-                                exit(1);
-                                break;
-                            }
-                            else {
-
-                                //Re-set SIGINT behaviour to interrupt FG child
-                                sigaction(SIGINT, &SIGINT_original_action, NULL);
-
-                                //Execute Command
-                                args = parseArgs(expandedArgs);
-                                executionSuccess = execvp(args[0], args);
-                                if (executionSuccess != 0) {
-                                    printf("%s: No such file or directory", args[0]);
-                                    fflush(stdout);
-                                    exit(1);
-                                }
-                                else {
-                                    exit(executionSuccess);
-                                }
-
-                                break;
-                            }
-                        default:
-                            // For parent, wait for the child process to finish and store the exit status in the lastStatus variable
-                            waitpid(newChildPid, &childStatus, 0);
-                            lastStatus = childStatus;
-                        }
-                    }
-                }
-            }
-            free(argCopy);
-        }
-        cleanupBackgroundProcesses(listHead);
+    // As a command server the shell only starts jobs for its clients
+    if (serverPath != NULL) {
+        return serveClients(serverPath, &shell);
     }
-    return EXIT_SUCCESS;
+
+    //Print Program title 
+    if (interactive) {
+        printf("smallsh\n");
+        fflush(stdout);
+    }
+
+    // Script files can be run from their cached parse
+    if (scriptPath != NULL) {
+        runScriptFile(&reader, scriptPath, &shell);
+    }
+    else {
+        runCommandLoop(&reader, &shell, interactive, NULL);
+    }
+    if (traceFd != -1) {
+        printTraceSummary(traceFd);
+    }
+    if (interactive) {
+        return EXIT_SUCCESS;
+    }
+    return lastExitValue;
 }
+
+#endif
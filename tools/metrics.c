@@ -0,0 +1,141 @@
+/* smallsh metrics reader
+*   Usage: metrics [-i MILLISECONDS] [-n SAMPLES] [PID...]
+*
+*   Samples the live counters that shells started with SMALLSH_METRICS publish in /dev/shm/smallsh.PID and prints one JSON object
+*   per shell per sample on stdout. Without PIDs every shell found in /dev/shm is read. One sample is taken by default, -i repeats
+*   them at an interval (forever, or -n times). Reading is plain loads from a read only mapping, so the shells do no work for it.
+*   A file left behind by a shell that was killed is reported with "alive":false.
+*
+*   The file includes smallsh.c directly (without its main) for the layout of the metrics page.
+*/
+#define SMALLSH_NO_MAIN
+#include "../smallsh.c"
+
+
+/* Mapped Shell Struct
+*   One metrics page being sampled, mapped once and kept for every sample.
+*/
+struct mappedShell
+{
+    pid_t processID;
+    struct shellMetrics* page;
+};
+
+/* mapShell - Map the metrics page of a shell
+*   Inputs: processID - The shell's PID, shell - Receives the mapping
+*   Outputs: 0 on success, -1 if the shell publishes no (complete) metrics page
+*/
+int mapShell(pid_t processID, struct mappedShell* shell) {
+    char path[64];
+    snprintf(path, sizeof(path), "/dev/shm/smallsh.%d", processID);
+    int pageFd = open(path, O_RDONLY | O_CLOEXEC);
+    if (pageFd == -1) {
+        return -1;
+    }
+    struct stat pageInfo;
+    struct shellMetrics* page = MAP_FAILED;
+    if (fstat(pageFd, &pageInfo) == 0 && pageInfo.st_size >= (off_t)sizeof(struct shellMetrics)) {
+        page = mmap(NULL, sizeof(struct shellMetrics), PROT_READ, MAP_SHARED, pageFd, 0);
+    }
+    close(pageFd);
+    if (page == MAP_FAILED) {
+        return -1;
+    }
+    if (__atomic_load_n(&page->magic, __ATOMIC_ACQUIRE) != METRICS_MAGIC || page->version != METRICS_VERSION) {
+        munmap(page, sizeof(struct shellMetrics));
+        return -1;
+    }
+    shell->processID = processID;
+    shell->page = page;
+    return 0;
+}
+
+/* printSample - Print the current counters of one shell
+*   Inputs: shell - The mapped page
+*   Outputs: None
+*/
+void printSample(struct mappedShell* shell) {
+    struct shellMetrics* page = shell->page;
+    uint64_t forks = __atomic_load_n(&page->forks, __ATOMIC_RELAXED);
+    uint64_t spawnNanoseconds = __atomic_load_n(&page->spawnNanoseconds, __ATOMIC_RELAXED);
+    int alive = kill(shell->processID, 0) == 0 || errno == EPERM;
+    printf("{\"pid\":%d,\"alive\":%s,\"uptime_s\":%lld,\"commands\":%llu,\"forks\":%llu,\"exec_failures\":%llu,"
+        "\"background_live\":%lld,\"background_total\":%llu,\"spawn_ns\":%llu,\"spawn_avg_us\":%.1f,\"foreground_toggles\":%llu,"
+        "\"foreground_only\":%llu}\n",
+        shell->processID, alive ? "true" : "false", (long long)(time(NULL) - page->startTime),
+        (unsigned long long)__atomic_load_n(&page->commands, __ATOMIC_RELAXED), (unsigned long long)forks,
+        (unsigned long long)__atomic_load_n(&page->execFailures, __ATOMIC_RELAXED),
+        (long long)__atomic_load_n(&page->backgroundLive, __ATOMIC_RELAXED),
+        (unsigned long long)__atomic_load_n(&page->backgroundTotal, __ATOMIC_RELAXED), (unsigned long long)spawnNanoseconds,
+        forks > 0 ? spawnNanoseconds / 1000.0 / forks : 0.0,
+        (unsigned long long)__atomic_load_n(&page->foregroundToggles, __ATOMIC_RELAXED),
+        (unsigned long long)__atomic_load_n(&page->foregroundOnly, __ATOMIC_RELAXED));
+}
+
+int main(int argc, char* argv[]) {
+    long interval = 0;
+    long samples = -1;
+    int argument = 1;
+    for (; argument + 1 < argc && argv[argument][0] == '-'; argument += 2) {
+        if (strcmp(argv[argument], "-i") == 0) {
+            interval = atol(argv[argument + 1]);
+        }
+        else if (strcmp(argv[argument], "-n") == 0) {
+            samples = atol(argv[argument + 1]);
+        }
+        else {
+            break;
+        }
+    }
+    if (argument < argc && argv[argument][0] == '-') {
+        fprintf(stderr, "usage: %s [-i MILLISECONDS] [-n SAMPLES] [PID...]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (samples == -1) {
+        samples = interval > 0 ? 0 : 1;
+    }
+
+    // The shells named on the command line, or every one publishing in /dev/shm
+    int capacity = 64;
+    int count = 0;
+    struct mappedShell* shells = malloc(capacity * sizeof(struct mappedShell));
+    if (argument < argc) {
+        for (; argument < argc; argument++) {
+            if (mapShell(atoi(argv[argument]), &shells[count]) == -1) {
+                fprintf(stderr, "metrics: no metrics for pid %s\n", argv[argument]);
+                continue;
+            }
+            if (++count == capacity) {
+                capacity *= 2;
+                shells = realloc(shells, capacity * sizeof(struct mappedShell));
+            }
+        }
+    }
+    else {
+        DIR* directory = opendir("/dev/shm");
+        struct dirent* entry;
+        while (directory != NULL && (entry = readdir(directory)) != NULL) {
+            if (strncmp(entry->d_name, "smallsh.", 8) != 0 || mapShell(atoi(entry->d_name + 8), &shells[count]) == -1) {
+                continue;
+            }
+            if (++count == capacity) {
+                capacity *= 2;
+                shells = realloc(shells, capacity * sizeof(struct mappedShell));
+            }
+        }
+        if (directory != NULL) {
+            closedir(directory);
+        }
+    }
+
+    for (long sample = 0; samples == 0 || sample < samples; sample++) {
+        if (sample > 0) {
+            usleep(interval * 1000);
+        }
+        for (int i = 0; i < count; i++) {
+            printSample(&shells[i]);
+        }
+        fflush(stdout);
+    }
+    return count > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}